@@ -789,4 +789,40 @@ namespace Automata {
     bool areEquivalent(const DFA& lhs, const DFA& rhs, string& counterexample) {
         return !shortestStringIn(xorConstruct(lhs, rhs), counterexample);
     }
+
+    /* Since only lengths matter, we can treat every character as the same character
+     * and run the subset construction for the resulting one-letter automaton. The
+     * sets of states reachable after 0, 1, 2, ... steps must eventually repeat, and
+     * from then on they cycle, which gives us the threshold and period directly.
+     * Automata built from cycles with coprime lengths can take exponentially many steps
+     * to repeat, so we stop once the result couldn't be represented anyway.
+     */
+    Languages::LengthSet lengthsOf(const NFA& automaton) {
+        map<set<State*>, size_t> seen;
+        vector<bool> accepting;
+
+        auto curr = toSet(epsilonClosureOf(startStatesOf(automaton)));
+        while (!seen.count(curr)) {
+            if (accepting.size() >= Languages::kMaxLengthSetSize) throw Languages::LengthSetTooLarge();
+
+            seen[curr] = accepting.size();
+            accepting.push_back(any_of(curr.begin(), curr.end(), [](State* state) {
+                return state->isAccepting;
+            }));
+
+            /* Follow every non-epsilon transition. */
+            unordered_set<State*> next;
+            for (State* state: curr) {
+                for (const auto& entry: state->transitions) {
+                    if (entry.first != EPSILON_TRANSITION) {
+                        auto dest = epsilonClosureOf(entry.second);
+                        next.insert(dest.begin(), dest.end());
+                    }
+                }
+            }
+            curr = toSet(next);
+        }
+
+        return Languages::makeLengthSet(accepting, seen[curr]);
+    }
 }
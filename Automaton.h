@@ -73,4 +73,9 @@ namespace Automata {
     bool shortestStringIn(const NFA& lhs, std::string& result);
 
     bool areEquivalent(const DFA& lhs, const DFA& rhs, std::string& counterexample);
+
+    /* Returns the set of lengths of strings the automaton accepts, throwing
+     * Languages::LengthSetTooLarge if that set can't be represented.
+     */
+    Languages::LengthSet lengthsOf(const NFA& automaton);
 }
@@ -12,6 +12,19 @@
 #include <random>
 #include <unordered_map>
 #include <unordered_set>
+#include <limits>
+#include <numeric>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <list>
+#include <iomanip>
+#include <cstdint>
+#include <chrono>
+#include <cmath>
 using namespace std;
 
 namespace CFG {
@@ -118,6 +131,112 @@ namespace CFG {
            return result;
         }
 
+        /* Map from nonterminals to sets of terminals (FIRST / FOLLOW sets). */
+        using TerminalSets = map<char32_t, set<char32_t>>;
+
+        /* Adds FIRST(alpha) into the result set, where alpha is a sequence of symbols.
+         * Returns whether the whole sequence is nullable.
+         */
+        bool addFirstOf(vector<Symbol>::const_iterator begin,
+                        vector<Symbol>::const_iterator end,
+                        const TerminalSets& first,
+                        const Nulls& nullable,
+                        set<char32_t>& result) {
+            for (; begin != end; ++begin) {
+                if (begin->type == Symbol::Type::TERMINAL) {
+                    result.insert(begin->ch);
+                    return false;
+                }
+
+                auto itr = first.find(begin->ch);
+                if (itr != first.end()) result.insert(itr->second.begin(), itr->second.end());
+                if (!nullable.count(begin->ch)) return false;
+            }
+            return true;
+        }
+
+        /* FIRST sets for each nonterminal. */
+        TerminalSets firstSetsOf(const CFG& cfg, const Nulls& nullable) {
+            return fixedPointIterate<set<char32_t>>(cfg, [&](const Production& p, TerminalSets& first) {
+                auto& ours = first[p.nonterminal];
+                size_t oldSize = ours.size();
+                addFirstOf(p.replacement.begin(), p.replacement.end(), first, nullable, ours);
+                return ours.size() != oldSize;
+            });
+        }
+
+        /* Sets of terminals stored as bitsets indexed by terminal number. These are used
+         * for lookahead filtering in the Earley parsers, which need to do lots of quick
+         * membership tests.
+         */
+        using TerminalBitset = vector<uint64_t>;
+
+        bool contains(const TerminalBitset& bits, size_t index) {
+            return bits[index >> 6] & (uint64_t(1) << (index & 63));
+        }
+
+        void include(TerminalBitset& bits, size_t index) {
+            bits[index >> 6] |= uint64_t(1) << (index & 63);
+        }
+
+        /* One-token lookahead information for Earley prediction. Terminals are numbered
+         * 0, 1, 2, ... in alphabet order, and the end of the input gets the number after
+         * that.
+         *
+         * For each production A -> gamma, we store the set of terminals that can begin
+         * a string derived from gamma. If gamma is nullable, we instead store every
+         * terminal (and the end of input), since a nullable production can be
+         * completed without reading anything.
+         *
+         * We also store FIRST(A) for each nonterminal A, which is used when building
+         * the lookahead-filtered version of the LR(0) e-DFA.
+         */
+        struct Lookahead {
+            map<char32_t, size_t> terminals;
+            size_t endOfInput;
+
+            unordered_map<const Production*, TerminalBitset> predict;
+            map<char32_t, TerminalBitset> first;
+        };
+
+        Lookahead lookaheadFor(const CFG& cfg, const Nulls& nullable) {
+            Lookahead result;
+            for (char32_t ch: cfg.alphabet) {
+                result.terminals.insert(make_pair(ch, result.terminals.size()));
+            }
+            result.endOfInput = result.terminals.size();
+
+            auto first = firstSetsOf(cfg, nullable);
+            for (const auto& entry: first) {
+                auto& bits = result.first[entry.first];
+                bits.resize(result.endOfInput / 64 + 1);
+                for (char32_t ch: entry.second) {
+                    include(bits, result.terminals.at(ch));
+                }
+            }
+
+            for (const auto& p: cfg.productions) {
+                auto& bits = result.predict[&p];
+                bits.resize(result.endOfInput / 64 + 1);
+
+                set<char32_t> terminals;
+                if (addFirstOf(p.replacement.begin(), p.replacement.end(), first, nullable, terminals)) {
+                    fill(bits.begin(), bits.end(), ~uint64_t(0));
+                } else {
+                    for (char32_t ch: terminals) {
+                        include(bits, result.terminals.at(ch));
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        /* Whether we use lookahead to filter out Earley predictions that can't possibly
+         * pan out.
+         */
+        const bool kUseLookahead = true;
+
         string toString(const set<char32_t>& s) {
             ostringstream result;
             result << "{ ";
@@ -176,6 +295,12 @@ namespace CFG {
 
             /* Productions by nonterminal; used for quick lookup during prediction. */
             map<char32_t, vector<const Production*>> grammar;
+
+            /* Lookahead information, or null if we aren't filtering predictions. */
+            const Lookahead* lookahead = nullptr;
+
+            /* Terminal number of the character at each position; used for lookahead. */
+            vector<size_t> next;
         };
 
         /* For debugging. */
@@ -226,6 +351,9 @@ namespace CFG {
             return result;
         }
 
+        /* Input is a string that's already been decoded, output is whether we match. */
+        using DecodedMatcher = function<bool (const vector<char32_t>&)>;
+
         /* Utility for Earley: is item's dot at end? */
         bool dotAtEnd(const EarleyItem& item) {
             return item.dotPos == item.production->replacement.size();
@@ -337,6 +465,13 @@ namespace CFG {
             return result;
         }
 
+        /* Whether a production could possibly be used to derive the part of the string
+         * starting at the given index, based on one token of lookahead.
+         */
+        bool canPredict(const EarleyState& state, const Production* prod, size_t index) {
+            return !state.lookahead || contains(state.lookahead->predict.at(prod), state.next[index]);
+        }
+
         /* "Predict" step of Earley parser. */
         bool predict(EarleyState& state, size_t index) {
             bool result = false;
@@ -367,6 +502,8 @@ namespace CFG {
                 char32_t nonterminal = afterDot(item).ch;
                 for (const auto* prod: state.grammar[nonterminal]) {
                     if (kParserVerbose) cout << "    Considering production " << prod << endl;
+                    if (!canPredict(state, prod, index)) continue;
+
                     /* If we haven't yet seen this, we may need to put it into the queue
                      * too for nonterminals at the front.
                      */
@@ -424,15 +561,26 @@ namespace CFG {
         EarleyState earley(char32_t start,
                            const Nulls& nullable,
                            const map<char32_t, vector<const Production*>>& grammar,
+                           const Lookahead* lookahead,
                            const vector<char32_t>& input) {
             EarleyState state;
-            state.nullable = nullable;
-            state.grammar  = grammar;
+            state.nullable  = nullable;
+            state.grammar   = grammar;
+            state.lookahead = lookahead;
             state.items.resize(input.size() + 1);
 
+            /* Translate the input to terminal numbers for lookahead purposes. */
+            if (lookahead) {
+                for (char32_t ch: input) {
+                    state.next.push_back(lookahead->terminals.at(ch));
+                }
+                state.next.push_back(lookahead->endOfInput);
+            }
+
             /* Seed with the initial Earley items. */
             if (kParserVerbose) cout << "SEEDING" << endl;
             for (const auto* prod: state.grammar[start]) {
+                if (!canPredict(state, prod, 0)) continue;
                 if (kParserVerbose) cout << "Including this production." << endl;
                 addItem(state, 0, { prod, 0, 0 });
             }
@@ -469,8 +617,9 @@ namespace CFG {
         bool accepts(char32_t start,
                      const Nulls& nullable,
                      const map<char32_t, vector<const Production*>>& grammar,
+                     const Lookahead* lookahead,
                      const vector<char32_t>& input) {
-            return acceptingItem(earley(start, nullable, grammar, input), start) != nullptr;
+            return acceptingItem(earley(start, nullable, grammar, lookahead, input), start) != nullptr;
         }
 
         /* Given a nonterminal and a position, creates a sequence of Earley items corresponding
@@ -696,8 +845,9 @@ namespace CFG {
         Derivation derivationOf(char32_t start,
                                 const Nulls& nullable,
                                 const map<char32_t, vector<const Production*>>& grammar,
+                                const Lookahead* lookahead,
                                 const vector<char32_t>& input) {
-            auto state = earley(start, nullable, grammar, input);
+            auto state = earley(start, nullable, grammar, lookahead, input);
 
             /* Try all possible derivations from the end and see if any of them work. */
             for (const auto& item: state.items.back()) {
@@ -731,14 +881,15 @@ namespace CFG {
             return result;
         }
 
-        Matcher earleyMatcherFor(const CFG& cfg) {
+        DecodedMatcher earleyMatcherFor(const CFG& cfg) {
             /* Clone the grammar locally so that internal pointers stay valid. */
             auto grammarRef = make_shared<CFG>(cfg);
             auto nullable   = nullablesOf(*grammarRef);
             auto grammar    = toEarleyGrammar(*grammarRef);
+            auto lookahead  = make_shared<Lookahead>(lookaheadFor(*grammarRef, nullable));
 
-            return [=](const string& input) {
-                return accepts(grammarRef->startSymbol, nullable, grammar, utf8Decode(input, grammarRef->alphabet));
+            return [=](const vector<char32_t>& input) {
+                return accepts(grammarRef->startSymbol, nullable, grammar, kUseLookahead? lookahead.get() : nullptr, input);
             };
         }
     }
@@ -748,9 +899,11 @@ namespace CFG {
         auto grammarRef = make_shared<CFG>(cfg);
         auto nullable   = nullablesOf(*grammarRef);
         auto grammar    = toEarleyGrammar(*grammarRef);
+        auto lookahead  = make_shared<Lookahead>(lookaheadFor(*grammarRef, nullable));
 
         return [=](const string& input) {
-            return derivationOf(grammarRef->startSymbol, nullable, grammar, utf8Decode(input, grammarRef->alphabet));
+            return derivationOf(grammarRef->startSymbol, nullable, grammar, kUseLookahead? lookahead.get() : nullptr,
+                                utf8Decode(input, grammarRef->alphabet));
         };
     }
 
@@ -776,21 +929,46 @@ namespace CFG {
         /* Type representing the 5D (!) Tail table.
          *
          * Nonterminal x Length x Production x Start -> [ numbers ]
+         *
+         * The numbers are counts of strings, which outgrow any integer type very quickly and
+         * even overflow a double once lengths get into the thousands. They're only ever used
+         * as relative weights, so each list is scaled down by a common factor, and we keep the
+         * log of that factor alongside it.
          */
-        using TailTable = map<char32_t, map<size_t, map<const Production*, map<size_t, vector<size_t>>>>>;
+        const double kLogZero = -numeric_limits<double>::infinity();
+
+        struct TailEntry {
+            vector<double> weights;             // Count of option i is weights[i] * e^logScale
+            double         total    = 0;        // Sum of the weights
+            double         logScale = 0;
+            double         logTotal = kLogZero; // Log of the sum of the counts
+        };
+
+        using TailTable = map<char32_t, map<size_t, map<const Production*, map<size_t, TailEntry>>>>;
 
         /* Representation of a grammar, optimized for fast lookups of productions for a nonterminal. */
         using McKenzieGrammar = map<char32_t, vector<Production>>;
 
+        /* Lengths of the strings a grammar generates, within a budget; see below. */
+        Languages::LengthSet lengthFilterFor(const CFG& cfg);
+
         struct McKenzieGenerator {
             McKenzieGenerator(const CFG& cfg);
             pair<bool, string> operator()(size_t) const;
 
+            /* Same, using the given source of randomness. */
+            pair<bool, string> generate(size_t n, mt19937& rng) const;
+
             /* Cleaned grammar; used for generation. It's stored this way because
              * we need the ability to index productions by number.
              */
             McKenzieGrammar grammar;
 
+            /* Lengths the grammar can produce, so we can skip the others outright. This
+             * is every length if the analysis would be too costly.
+             */
+            Languages::LengthSet lengths;
+
             /* Start symbol. */
             char32_t start;
 
@@ -1142,8 +1320,45 @@ namespace CFG {
                 return unitNormalForm(clean(epsilonNormalFormOf(input, nullable)));
             }
 
-            size_t sumOf(const vector<size_t>& input) {
-                return accumulate(input.begin(), input.end(), 0);
+            /* Given the logs of some counts, returns the log of their sum. */
+            double logSumOf(const vector<double>& input) {
+                double largest = kLogZero;
+                for (double x: input) {
+                    largest = max(largest, x);
+                }
+                if (largest == kLogZero) return kLogZero;
+
+                double total = 0;
+                for (double x: input) {
+                    total += exp(x - largest);
+                }
+                return largest + log(total);
+            }
+
+            /* Given the logs of two counts, returns the log of their sum. */
+            double logSumOf(double lhs, double rhs) {
+                if (lhs < rhs) swap(lhs, rhs);
+                if (rhs == kLogZero) return lhs;
+                return lhs + log1p(exp(rhs - lhs));
+            }
+
+            /* Builds a table entry from the logs of its counts, scaling them so the largest
+             * is one.
+             */
+            TailEntry tailEntryFor(const vector<double>& logCounts) {
+                double largest = kLogZero;
+                for (double x: logCounts) {
+                    largest = max(largest, x);
+                }
+
+                TailEntry result;
+                result.logScale = largest == kLogZero? 0 : largest;
+                for (double x: logCounts) {
+                    result.weights.push_back(exp(x - result.logScale));
+                    result.total += result.weights.back();
+                }
+                if (result.total != 0) result.logTotal = result.logScale + log(result.total);
+                return result;
             }
 
             /* Computes the table from the McKenzie paper.
@@ -1224,7 +1439,7 @@ namespace CFG {
             const bool kGeneratorVerbose = false;
 
             /* For debugging. */
-            string toString(const vector<size_t>& v) {
+            string toString(const vector<double>& v) {
                 ostringstream builder;
                 builder << "[ ";
                 for (auto i: v) {
@@ -1235,18 +1450,18 @@ namespace CFG {
             }
 
             /* Computes and returns Count[S][n]. */
-            vector<size_t> computeCount(TailTable& table, const McKenzieGrammar& grammar,
+            vector<double> computeCount(TailTable& table, const McKenzieGrammar& grammar,
                                         char32_t nonterminal, size_t n, size_t indent = 2);
 
             /* Computes and returns Tail[S][n][p][i]. */
-            const vector<size_t>& computeTail(TailTable& table,
+            const TailEntry& computeTail(TailTable& table,
                                               const McKenzieGrammar& grammar,
                                               char32_t nonterminal, size_t n,
                                               const Production* prod, size_t index,
                                               size_t indent = 2) {
                 /* Base case: Already known? Then just return it. */
                 auto& result = table[nonterminal][n][prod][index];
-                if (!result.empty()) return result;
+                if (!result.weights.empty()) return result;
 
 
                 /* Current production; just for simplicity. */
@@ -1260,15 +1475,15 @@ namespace CFG {
                     /* If we're at the end of the production, there's one way to do this (do nothing
                      * at all). If we aren't, then there is no way to do this.
                      */
-                    result = { index == p.size() };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
+                    result = tailEntryFor({ index == p.size()? 0.0 : kLogZero });
+                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result.weights) << endl;
                     return result;
                 }
 
                 /* Base case: past the end? Then we can't do this. */
                 if (index == p.size()) {
-                    result = { 0 };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
+                    result = tailEntryFor({ kLogZero });
+                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result.weights) << endl;
                     return result;
                 }
 
@@ -1280,8 +1495,8 @@ namespace CFG {
                  * to look at the indices, so we don't need to include them here.
                  */
                 if (p[index].type == Symbol::Type::TERMINAL) {
-                    result = { sumOf(computeTail(table, grammar, nonterminal, n - 1, prod, index + 1)) };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
+                    result = tailEntryFor({ computeTail(table, grammar, nonterminal, n - 1, prod, index + 1).logTotal });
+                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result.weights) << endl;
                     return result;
                 }
 
@@ -1307,30 +1522,31 @@ namespace CFG {
                  * the slot for zero.
                  */
                 if (index + 1 == p.size()) {
-                    result = { computeCount(table, grammar, p[index].ch, n) };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
+                    result = tailEntryFor(computeCount(table, grammar, p[index].ch, n));
+                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result.weights) << endl;
                     return result;
                 }
 
-                result.push_back(0); // No ways to make the empty string.
+                vector<double> logCounts = { kLogZero }; // No ways to make the empty string.
                 for (size_t k = 1; k + p.size() - index - 1 <= n; k++) {
-                    size_t me   = sumOf(computeCount(table, grammar, p[index].ch, k, indent + 4));
-                    size_t them = sumOf(computeTail(table, grammar, nonterminal, n - k, prod, index + 1, indent + 4));
-                    result.push_back(me * them);
+                    double me   = logSumOf(computeCount(table, grammar, p[index].ch, k, indent + 4));
+                    double them = computeTail(table, grammar, nonterminal, n - k, prod, index + 1, indent + 4).logTotal;
+                    logCounts.push_back(me + them);
                 }
+                result = tailEntryFor(logCounts);
 
-                if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
+                if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result.weights) << endl;
                 return result;
             }
 
-            vector<size_t> computeCount(TailTable& table, const McKenzieGrammar& grammar,
+            vector<double> computeCount(TailTable& table, const McKenzieGrammar& grammar,
                                         char32_t nonterminal, size_t n, size_t indent) {
                 if (kGeneratorVerbose) cout << string(indent, ' ') << "C[" << toUTF8(nonterminal) << "][" << n << "]" << endl;
 
                 /* Add up all the tail values. */
-                vector<size_t> result;
+                vector<double> result;
                 for (const auto& prod: grammar.at(nonterminal)) {
-                    result.push_back(sumOf(computeTail(table, grammar, nonterminal, n, &prod, 0, indent + 4)));
+                    result.push_back(computeTail(table, grammar, nonterminal, n, &prod, 0, indent + 4).logTotal);
                 }
                 if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
                 return result;
@@ -1345,72 +1561,105 @@ namespace CFG {
              *    it randomly. When you see a terminal, generate it.
              */
 
-            pair<bool, string> generateNonterminal(TailTable& table,
-                                                   const McKenzieGrammar& grammar,
-                                                   char32_t nonterminal,
-                                                   size_t n);
+            bool generateNonterminal(TailTable& table,
+                                     const McKenzieGrammar& grammar,
+                                     char32_t nonterminal,
+                                     size_t n,
+                                     mt19937& rng,
+                                     string& out);
+
+            /* Picks an index with probability proportional to its weight, given the sum of
+             * the weights. This does what discrete_distribution does, but without allocating
+             * anything, which matters when we're drawing lots of samples.
+             */
+            template <typename WeightFn>
+            size_t weightedChoice(size_t count, double total, WeightFn weightOf, mt19937& rng) {
+                double target = uniform_real_distribution<double>(0, total)(rng);
+                size_t last = 0;
+                for (size_t i = 0; i < count; i++) {
+                    double weight = weightOf(i);
+                    if (weight == 0) continue;
+
+                    if (target < weight) return i;
+                    target -= weight;
+                    last = i;
+                }
+
+                /* Rounding error took us past the end. */
+                return last;
+            }
 
-            pair<bool, string> generateProduction(TailTable& table,
-                                                  const McKenzieGrammar& grammar,
-                                                  char32_t nonterminal,
-                                                  size_t n,
-                                                  const Production* prod,
-                                                  size_t index) {
+            bool generateProduction(TailTable& table,
+                                    const McKenzieGrammar& grammar,
+                                    char32_t nonterminal,
+                                    size_t n,
+                                    const Production* prod,
+                                    size_t index,
+                                    mt19937& rng,
+                                    string& out) {
                 /* For convenience. */
                 auto& p = prod->replacement;
 
                 /* Base case: last character? */
                 if (index + 1 == p.size()) {
-                    /* Terminal? Just return it. */
+                    /* Terminal? Just write it. */
                     if (p[index].type == Symbol::Type::TERMINAL) {
                         if (n != 1) abort(); // Logic error!
-                        return make_pair(true, toUTF8(p[index].ch));
+                        out += toUTF8(p[index].ch);
+                        return true;
                     }
                     /* Nonterminal? Generate it. */
-                    return generateNonterminal(table, grammar, p[index].ch, n);
+                    return generateNonterminal(table, grammar, p[index].ch, n, rng, out);
                 }
 
                 /* Otherwise, there's more after us. */
                 if (p[index].type == Symbol::Type::TERMINAL) {
-                    auto result = generateProduction(table, grammar, nonterminal, n - 1, prod, index + 1);
-                    result.second = toUTF8(p[index].ch) + result.second;
-                    return result;
+                    out += toUTF8(p[index].ch);
+                    return generateProduction(table, grammar, nonterminal, n - 1, prod, index + 1, rng, out);
                 }
 
                 /* Select how many characters to read. */
                 auto& options = table[nonterminal][n][prod][index];
-                size_t k = discrete_distribution<size_t>(options.begin(), options.end())(theGenerator);
-
-                auto lhs = generateNonterminal(table, grammar, p[index].ch, k);
-                auto rhs = generateProduction(table, grammar, nonterminal, n - k, prod, index + 1);
-                return make_pair(lhs.first && rhs.first, lhs.second + rhs.second);
-            }
-
-            pair<bool, string> generateNonterminal(TailTable& table,
-                                                   const McKenzieGrammar& grammar,
-                                                   char32_t nonterminal,
-                                                   size_t n) {
-                /* Get the relative frequencies of each production. */
-                vector<size_t> weights;
-                for (const auto& p: grammar.at(nonterminal)) {
-                    /* Number of strings of this length is given by
-                     * sum(Tail[nonterminal][n][p][0]) because that counts the number of
-                     * strings of length n we can make using all characters of the
-                     * production.
-                     */
-                    weights.push_back(sumOf(computeTail(table, grammar, nonterminal, n, &p, 0)));
+                size_t k = weightedChoice(options.weights.size(), options.total, [&](size_t i) {
+                    return options.weights[i];
+                }, rng);
+
+                bool lhs = generateNonterminal(table, grammar, p[index].ch, k, rng, out);
+                bool rhs = generateProduction(table, grammar, nonterminal, n - k, prod, index + 1, rng, out);
+                return lhs && rhs;
+            }
+
+            bool generateNonterminal(TailTable& table,
+                                     const McKenzieGrammar& grammar,
+                                     char32_t nonterminal,
+                                     size_t n,
+                                     mt19937& rng,
+                                     string& out) {
+                /* Get the relative frequencies of each production. The number of strings of
+                 * this length is given by sum(Tail[nonterminal][n][p][0]) because that counts
+                 * the number of strings of length n we can make using all characters of the
+                 * production.
+                 */
+                const auto& productions = grammar.at(nonterminal);
+                auto logWeightOf = [&](size_t i) {
+                    return computeTail(table, grammar, nonterminal, n, &productions[i], 0).logTotal;
+                };
+
+                double logTotal = kLogZero;
+                for (size_t i = 0; i < productions.size(); i++) {
+                    logTotal = logSumOf(logTotal, logWeightOf(i));
                 }
 
                 /* If we can't make anything of this length, report an error. */
-                if (all_of(weights.begin(), weights.end(), [](size_t val) {
-                    return val == 0;
-                })) {
-                    return make_pair(false, "");
-                }
+                if (logTotal == kLogZero) return false;
 
-                /* Select a production, then generate it. */
-                auto* prod = &grammar.at(nonterminal)[discrete_distribution<size_t>(weights.begin(), weights.end())(theGenerator)];
-                return generateProduction(table, grammar, nonterminal, n, prod, 0);
+                /* Select a production, then generate it. Each weight is a fraction of the total,
+                 * so this is fine no matter how many strings there are.
+                 */
+                auto* prod = &productions[weightedChoice(productions.size(), 1.0, [&](size_t i) {
+                    return exp(logWeightOf(i) - logTotal);
+                }, rng)];
+                return generateProduction(table, grammar, nonterminal, n, prod, 0, rng, out);
             }
         }
 
@@ -1428,19 +1677,32 @@ namespace CFG {
 
             /* We can produce epsilon if the start symbol is nullable. */
             hasEpsilon = nullable.count(cfg.startSymbol);
+
+            lengths = lengthFilterFor(cfg);
         }
 
         pair<bool, string> McKenzieGenerator::operator()(size_t n) const {
-            /* Edge case: If the grammar is empty, return nothing. */
-            if (grammar.empty()) return make_pair(false, "");
+            return generate(n, theGenerator);
+        }
+
+        pair<bool, string> McKenzieGenerator::generate(size_t n, mt19937& rng) const {
+            /* Edge case: If we can't make anything of this length, don't try. */
+            if (!lengths.contains(n)) return make_pair(false, "");
 
             /* Edge case: If the length is zero, return epsilon iff the grammar
-             * can produce epsilon.
+             * can produce epsilon. (This has to come before the next check, since
+             * a grammar whose only string is epsilon is empty once we've removed
+             * its epsilon productions.)
              */
             if (n == 0) return make_pair(hasEpsilon, "");
 
+            /* Edge case: If the grammar is empty, return nothing. */
+            if (grammar.empty()) return make_pair(false, "");
+
             /* Otherwise, use the generator. */
-            return generateNonterminal(tail, grammar, start, n);
+            string result;
+            bool success = generateNonterminal(tail, grammar, start, n, rng, result);
+            return make_pair(success, success? result : "");
         }
     }
 
@@ -1795,7 +2057,7 @@ namespace CFG {
             return result = false;
         }
 
-        Matcher cykMatcherFor(const CFG& cfg) {
+        DecodedMatcher cykMatcherFor(const CFG& cfg) {
             /* Convert to weak CNF to ensure all RHS's have the
              * right sizes.
              */
@@ -1826,8 +2088,7 @@ namespace CFG {
             /* Start symbol. */
             char32_t start = weakCNF.startSymbol;
 
-            return [=](const string& str) mutable {
-                auto input = utf8Decode(str, weakCNF.alphabet);
+            return [=](const vector<char32_t>& input) mutable {
                 if (input.empty()) return hasEpsilon;
 
                 /* Wipe any previous memoization result. */
@@ -1836,6 +2097,426 @@ namespace CFG {
             };
         }
 
+        /**************************************************************************
+         **************************************************************************
+         ***                     Work-Stealing Scheduler                        ***
+         **************************************************************************
+         **************************************************************************
+
+         A small fork/join thread pool. Each worker owns a deque of tasks; it pushes
+         and pops work at the back of its own deque and, when that runs dry, steals
+         from the front of someone else's. Threads that aren't workers (for example,
+         the thread that called the matcher) submit into an extra shared deque.
+
+         Waiting on a TaskGroup never blocks outright: the waiting thread runs other
+         pending tasks until its group is finished. That keeps every core busy and
+         means tasks can themselves fork and wait on nested groups without deadlock.
+
+         *************************************************************************/
+
+        class WorkStealingPool {
+        public:
+            /* Process-wide pool, one worker per hardware thread beyond the caller's. */
+            static WorkStealingPool& instance() {
+                static WorkStealingPool pool(max(thread::hardware_concurrency(), 2u) - 1);
+                return pool;
+            }
+
+            ~WorkStealingPool() {
+                {
+                    lock_guard<mutex> lock(sleepLock);
+                    done = true;
+                }
+                wakeup.notify_all();
+                for (auto& worker: workers) {
+                    worker.join();
+                }
+            }
+
+            /* Number of threads that can run tasks at once, counting the caller. */
+            size_t concurrency() const {
+                return workers.size() + 1;
+            }
+
+            void submit(function<void()> task) {
+                /* Count the task before anyone can take it, so pending never dips below
+                 * zero. Doing that under sleepLock means a worker about to sleep either
+                 * sees the new count or is already waiting when we notify it.
+                 */
+                {
+                    lock_guard<mutex> lock(sleepLock);
+                    pending++;
+                }
+
+                size_t index = myIndex() == kNotAWorker? workers.size() : myIndex();
+                {
+                    lock_guard<mutex> lock(queues[index].lock);
+                    queues[index].tasks.push_back(std::move(task));
+                }
+                wakeup.notify_one();
+            }
+
+            /* Runs one pending task, if there is one. Returns whether anything ran. */
+            bool runOne() {
+                function<void()> task;
+                if (!take(task)) return false;
+
+                task();
+                return true;
+            }
+
+        private:
+            struct Queue {
+                mutex lock;
+                deque<function<void()>> tasks;
+            };
+
+            static constexpr size_t kNotAWorker = numeric_limits<size_t>::max();
+
+            /* One queue per worker, plus one for everyone else. */
+            vector<Queue>  queues;
+            vector<thread> workers;
+
+            atomic<size_t>     pending{0};
+            mutex              sleepLock;
+            condition_variable wakeup;
+            bool               done = false;
+
+            explicit WorkStealingPool(size_t numWorkers) : queues(numWorkers + 1) {
+                for (size_t i = 0; i < numWorkers; i++) {
+                    workers.emplace_back([this, i] {
+                        myIndex() = i;
+                        workerLoop();
+                    });
+                }
+            }
+
+            static size_t& myIndex() {
+                static thread_local size_t index = kNotAWorker;
+                return index;
+            }
+
+            /* Pops from our own queue's back, or steals from the front of another. */
+            bool take(function<void()>& task) {
+                if (pending == 0) return false;
+
+                size_t self = myIndex() == kNotAWorker? workers.size() : myIndex();
+                {
+                    lock_guard<mutex> lock(queues[self].lock);
+                    if (!queues[self].tasks.empty()) {
+                        task = std::move(queues[self].tasks.back());
+                        queues[self].tasks.pop_back();
+                        pending--;
+                        return true;
+                    }
+                }
+
+                for (size_t i = 1; i < queues.size(); i++) {
+                    auto& victim = queues[(self + i) % queues.size()];
+                    lock_guard<mutex> lock(victim.lock);
+                    if (!victim.tasks.empty()) {
+                        task = std::move(victim.tasks.front());
+                        victim.tasks.pop_front();
+                        pending--;
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void workerLoop() {
+                while (true) {
+                    if (runOne()) continue;
+
+                    unique_lock<mutex> lock(sleepLock);
+                    wakeup.wait(lock, [this] { return done || pending != 0; });
+                    if (done) return;
+                }
+            }
+        };
+
+        /* A set of tasks that can be waited on together. Exceptions thrown by a task
+         * are rethrown from wait().
+         */
+        class TaskGroup {
+        public:
+            TaskGroup(WorkStealingPool& pool = WorkStealingPool::instance()) : pool(pool) {}
+
+            ~TaskGroup() {
+                /* Tasks refer back to us, so we can't leave while any are outstanding. */
+                while (outstanding != 0) {
+                    if (!pool.runOne()) this_thread::yield();
+                }
+            }
+
+            void run(function<void()> task) {
+                outstanding++;
+                pool.submit([this, task] {
+                    try {
+                        task();
+                    } catch (...) {
+                        lock_guard<mutex> lock(errorLock);
+                        if (!error) error = current_exception();
+                    }
+                    outstanding--;
+                });
+            }
+
+            void wait() {
+                while (outstanding != 0) {
+                    if (!pool.runOne()) this_thread::yield();
+                }
+                if (error) {
+                    auto toThrow = error;
+                    error = nullptr;
+                    rethrow_exception(toThrow);
+                }
+            }
+
+        private:
+            WorkStealingPool&  pool;
+            atomic<size_t>     outstanding{0};
+            mutex              errorLock;
+            exception_ptr      error;
+        };
+
+        /* Calls fn(begin, end) on subranges of [begin, end) in parallel, splitting the
+         * range into chunks no smaller than grain. Small ranges run on the calling thread.
+         */
+        void parallelFor(size_t begin, size_t end, size_t grain,
+                         const function<void(size_t, size_t)>& fn) {
+            if (end <= begin) return;
+
+            auto& pool = WorkStealingPool::instance();
+            size_t chunks = min((end - begin + grain - 1) / grain, 4 * pool.concurrency());
+            if (chunks <= 1) {
+                fn(begin, end);
+                return;
+            }
+
+            TaskGroup group(pool);
+            size_t size = (end - begin + chunks - 1) / chunks;
+            for (size_t low = begin; low < end; low += size) {
+                size_t high = min(end, low + size);
+                group.run([&fn, low, high] {
+                    fn(low, high);
+                });
+            }
+            group.wait();
+        }
+
+        /**************************************************************************
+         **************************************************************************
+         ***                    Parallel CYK Implementation                     ***
+         **************************************************************************
+         **************************************************************************
+
+         A bottom-up CYK recognizer for grammars in (strong) CNF, designed for very
+         long inputs. Each chart cell holds the set of nonterminals deriving that
+         span as a bitset.
+
+         Every cell on a diagonal depends only on cells from shorter diagonals, so
+         we sweep the diagonals in order of length and fill each one in parallel on
+         the work-stealing pool. Early diagonals are long and cheap per cell; late
+         ones are short but each cell has many split points, which is why they're
+         chunked more finely.
+
+         A dense chart would need n(n + 1)/2 cells of at least one 64-bit word each,
+         which is about 10GB for an input of length 50,000. Most cells are usually
+         empty, though, so we only store the nonempty ones. For each position we
+         keep the lengths of the nonempty spans starting there and of those ending
+         there, in increasing order, along with where their bitsets live. The
+         useful split points of [i, j) are then found by looking up each span
+         starting at i (or each one ending at j, whichever list is shorter) in the
+         other list.
+
+         Memory use is therefore about ceil(|N| / 64) + 2 words per nonempty span.
+         For grammars where most spans derive something (highly ambiguous ones,
+         like S -> SS | a) that's still quadratic in n, and inputs much longer than
+         ten thousand characters won't fit in memory.
+
+         *************************************************************************/
+
+        /* Minimum number of split points to hand to a single task. */
+        const size_t kParallelCYKGrain = 4096;
+
+        struct ParallelCYKGrammar {
+            Languages::Alphabet alphabet;
+
+            /* Nonterminals are numbered 0, 1, 2, ..., and cells have this many words. */
+            size_t words;
+            size_t start;
+            bool   hasEpsilon;
+
+            /* For each terminal, the bitset of nonterminals producing it directly. */
+            map<char32_t, vector<uint64_t>> producers;
+
+            /* For each nonterminal B, all pairs (C, A) where A -> BC. */
+            vector<vector<pair<size_t, size_t>>> byLeft;
+        };
+
+        shared_ptr<ParallelCYKGrammar> parallelCYKGrammarFor(const CFG& cfg) {
+            auto cnf = toCNF(cfg);
+
+            auto result = make_shared<ParallelCYKGrammar>();
+            result->alphabet = cnf.alphabet;
+
+            map<char32_t, size_t> indices;
+            for (char32_t nonterminal: cnf.nonterminals) {
+                indices.insert(make_pair(nonterminal, indices.size()));
+            }
+
+            result->words      = (indices.size() + 63) / 64;
+            result->start      = indices.at(cnf.startSymbol);
+            result->hasEpsilon = false;
+            result->byLeft.resize(indices.size());
+
+            for (const auto& prod: cnf.productions) {
+                const auto& p = prod.replacement;
+                size_t lhs = indices.at(prod.nonterminal);
+
+                if (p.empty()) {
+                    result->hasEpsilon = true;
+                } else if (p.size() == 1 && p[0].type == Symbol::Type::TERMINAL) {
+                    auto& bits = result->producers[p[0].ch];
+                    bits.resize(result->words);
+                    include(bits, lhs);
+                } else if (p.size() == 2) {
+                    result->byLeft[indices.at(p[0].ch)].emplace_back(indices.at(p[1].ch), lhs);
+                } else {
+                    abort(); // Logic error!
+                }
+            }
+
+            return result;
+        }
+
+        /* Nonempty spans starting (or ending) at one position, by increasing length, with
+         * the offsets of their bitsets.
+         */
+        struct SpanList {
+            vector<uint32_t> lengths;
+            vector<size_t>   cells;
+        };
+
+        /* Bitsets for the nonempty cells of one stretch of a diagonal. */
+        struct DiagonalChunk {
+            vector<size_t>   starts;
+            vector<uint64_t> cells;
+        };
+
+        bool parallelCYK(const ParallelCYKGrammar& grammar, const vector<char32_t>& input) {
+            size_t n = input.size();
+            if (n == 0) return grammar.hasEpsilon;
+
+            const size_t words = grammar.words;
+            vector<uint64_t> cells;
+            vector<SpanList> from(n + 1), to(n + 1);
+
+            /* Cells are only ever added between diagonals, so tasks filling in a diagonal
+             * can read everything above without locking.
+             */
+            auto addCell = [&](size_t start, size_t length, const uint64_t* bits) {
+                size_t offset = cells.size();
+                cells.insert(cells.end(), bits, bits + words);
+                from[start].lengths.push_back(length);
+                from[start].cells.push_back(offset);
+                to[start + length].lengths.push_back(length);
+                to[start + length].cells.push_back(offset);
+            };
+
+            /* Length-one spans come straight from the terminal productions. */
+            for (size_t i = 0; i < n; i++) {
+                auto itr = grammar.producers.find(input[i]);
+                if (itr != grammar.producers.end()) addCell(i, 1, itr->second.data());
+            }
+
+            for (size_t length = 2; length <= n; length++) {
+                /* Each cell here does up to length - 1 splits, so size chunks by that. */
+                size_t grain = max<size_t>(1, kParallelCYKGrain / (length - 1));
+
+                mutex chunksLock;
+                vector<DiagonalChunk> chunks;
+                parallelFor(0, n - length + 1, grain, [&](size_t low, size_t high) {
+                    DiagonalChunk chunk;
+                    vector<uint64_t> result(words);
+
+                    /* Combines [start, mid) and [mid, end) into result. */
+                    auto combine = [&](size_t leftCell, size_t rightCell) {
+                        const uint64_t* left  = &cells[leftCell];
+                        const uint64_t* right = &cells[rightCell];
+
+                        bool nonempty = false;
+                        for (size_t w = 0; w < words; w++) {
+                            for (uint64_t bits = left[w]; bits != 0; bits &= bits - 1) {
+                                size_t b = w * 64 + __builtin_ctzll(bits);
+                                for (const auto& rule: grammar.byLeft[b]) {
+                                    if (right[rule.first / 64] & (uint64_t(1) << (rule.first % 64))) {
+                                        result[rule.second / 64] |= uint64_t(1) << (rule.second % 64);
+                                        nonempty = true;
+                                    }
+                                }
+                            }
+                        }
+                        return nonempty;
+                    };
+
+                    for (size_t start = low; start < high; start++) {
+                        const auto& starting = from[start];
+                        const auto& ending   = to[start + length];
+
+                        /* Everything in these lists is shorter than length, so every match
+                         * is a proper split.
+                         */
+                        bool useStarting = starting.lengths.size() <= ending.lengths.size();
+                        const auto& scan   = useStarting? starting : ending;
+                        const auto& lookup = useStarting? ending   : starting;
+
+                        bool nonempty = false;
+                        for (size_t k = 0; k < scan.lengths.size(); k++) {
+                            uint32_t other = length - scan.lengths[k];
+                            auto itr = lower_bound(lookup.lengths.begin(), lookup.lengths.end(), other);
+                            if (itr == lookup.lengths.end() || *itr != other) continue;
+
+                            size_t match = lookup.cells[itr - lookup.lengths.begin()];
+                            nonempty |= useStarting? combine(scan.cells[k], match) : combine(match, scan.cells[k]);
+                        }
+
+                        if (nonempty) {
+                            chunk.starts.push_back(start);
+                            chunk.cells.insert(chunk.cells.end(), result.begin(), result.end());
+                            fill(result.begin(), result.end(), 0);
+                        }
+                    }
+
+                    lock_guard<mutex> guard(chunksLock);
+                    chunks.push_back(std::move(chunk));
+                });
+
+                /* Record the new cells in order of position. */
+                sort(chunks.begin(), chunks.end(), [](const DiagonalChunk& lhs, const DiagonalChunk& rhs) {
+                    return !rhs.starts.empty() && (lhs.starts.empty() || lhs.starts[0] < rhs.starts[0]);
+                });
+                for (const auto& chunk: chunks) {
+                    for (size_t i = 0; i < chunk.starts.size(); i++) {
+                        addCell(chunk.starts[i], length, &chunk.cells[i * words]);
+                    }
+                }
+            }
+
+            /* The whole input is the longest span starting at 0, if it's there at all. */
+            const auto& whole = from[0];
+            if (whole.lengths.empty() || whole.lengths.back() != n) return false;
+            return cells[whole.cells.back() + grammar.start / 64] & (uint64_t(1) << (grammar.start % 64));
+        }
+
+        DecodedMatcher parallelCYKMatcherFor(const CFG& cfg) {
+            auto grammar = parallelCYKGrammarFor(cfg);
+            return [=](const vector<char32_t>& input) {
+                return parallelCYK(*grammar, input);
+            };
+        }
+
         /**************************************************************************
          **************************************************************************
          ***                LR(0)-Based Earley Implementtion                    ***
@@ -1910,39 +2591,141 @@ namespace CFG {
 
             /* Epsilon transition, if any. */
             LR0EState* epsilon;
+
+            /* Lookahead-filtered epsilon transitions, one per terminal, in alphabet order.
+             * Empty if there's no epsilon transition or if we aren't using lookahead.
+             */
+            vector<LR0EState*> epsilonOn;
+        };
+
+        /* Sentinel state number meaning "there's no state here." */
+        const uint32_t kNoState = numeric_limits<uint32_t>::max();
+
+        /* The GOTO table of an e-DFA is extremely sparse: most states only have
+         * transitions on a handful of symbols. Rather than storing the full
+         * |states| x |symbols| table, we pack the rows together using row
+         * displacement (a "comb vector"). Each row is assigned a base offset into
+         * a shared array of slots, chosen so that the nonempty entries of different
+         * rows never land in the same slot. Each slot records which row owns it,
+         * so a lookup is just one addition and one comparison.
+         */
+        struct CompressedTable {
+            struct Slot {
+                uint32_t owner = kNoState;
+                uint32_t target = kNoState;
+            };
+
+            /* Base offset for each row. */
+            vector<uint32_t> base;
+
+            /* Packed slots. */
+            vector<Slot> slots;
+
+            uint32_t lookup(uint32_t row, size_t column) const {
+                const auto& slot = slots[base[row] + column];
+                return slot.owner == row? slot.target : kNoState;
+            }
         };
 
+        /* Packs a set of sparse rows, given as (column, target) pairs, into a compressed
+         * table with the given number of columns. This uses first-fit packing, placing
+         * the densest rows first since they're the hardest to fit.
+         */
+        CompressedTable compress(const vector<vector<pair<size_t, uint32_t>>>& rows, size_t numColumns) {
+            CompressedTable result;
+            result.base.resize(rows.size());
+
+            vector<uint32_t> order(rows.size());
+            iota(order.begin(), order.end(), 0);
+            stable_sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+                return rows[lhs].size() > rows[rhs].size();
+            });
+
+            for (uint32_t row: order) {
+                /* Find the first base where everything fits. Pad the slot array so that a
+                 * lookup at any column from this base stays in bounds.
+                 */
+                size_t base = 0;
+                while (true) {
+                    if (result.slots.size() < base + numColumns) {
+                        result.slots.resize(base + numColumns);
+                    }
+                    if (all_of(rows[row].begin(), rows[row].end(), [&](const pair<size_t, uint32_t>& entry) {
+                        return result.slots[base + entry.first].owner == kNoState;
+                    })) break;
+
+                    base++;
+                }
+
+                result.base[row] = base;
+                for (const auto& entry: rows[row]) {
+                    result.slots[base + entry.first] = { row, entry.second };
+                }
+            }
+
+            return result;
+        }
+
         /* LR(0) e-DFA. This is the actual automaton representation, and it's designed to
          * be as fast as we can make it, potentially at the expense of readability.
+         *
+         * States are referred to by their 32-bit state numbers rather than by pointers,
+         * both to keep the tables small and so that the state objects themselves
+         * (which hold the full item sets) stay out of the hot loop.
          */
         struct LR0EDFA {
             /* Set of all states. */
             set<shared_ptr<LR0EState>> states;
 
+            /* Number of states in the automaton. After minimization this can be smaller
+             * than the number of state objects.
+             */
+            size_t numStates;
+
+            /* States by number. This is only used for debugging; when states have been
+             * merged, it holds one representative of each group.
+             */
+            vector<const LR0EState*> byIndex;
+
             /* Start state. */
-            LR0EState* start;
+            uint32_t start;
 
             /* A huge amount of our time is spent doing lookups of the form
              * "given state X and symbol Y, what's the successor state?" To speed
-             * this up, we build a flat vector representing a 2D "goto" table for
-             * our automaton. We will number the symbols we might encounter 0, 1
-             * 2, 3, ..., n-1, then build an array of the form [goto for state 0],
-             * [goto for state 1], etc. by linearizing everything.
+             * this up, we build a compressed 2D "goto" table for our automaton
+             * (see CompressedTable). We will number the symbols we might encounter
+             * 0, 1, 2, 3, ..., n-1 and use those as the column indices.
              *
              * To make this work, we first need a way of relabeling symbols with
              * numbers, which is this first table.
              */
             unordered_map<Symbol, size_t> toIndex;
 
-            /* Multiplier to use to go from a state number to a table index. */
-            /* TODO: Would it be better to use a shift here? */
+            /* Number of symbols (columns in the GOTO table). */
             size_t multiplier;
 
-            /* Next, we need that linearized GOTO table. */
-            vector<const LR0EState*> goTo;
+            /* Outgoing transitions of each state as (symbol index, state) pairs. This is
+             * the uncompressed form of the GOTO table and is discarded once that's built.
+             */
+            vector<vector<pair<size_t, uint32_t>>> transitions;
+
+            /* Next, we need that GOTO table. */
+            CompressedTable goTo;
+
+            /* Epsilon transition for each state, or kNoState if there isn't one. */
+            vector<uint32_t> epsilon;
 
             /* Map from state numbers to completed sets. */
             vector<vector<size_t>> completed;
+
+            /* Lookahead-filtered epsilon transitions, linearized with one slot per
+             * (state, terminal) pair. This is empty if we aren't using lookahead.
+             */
+            vector<uint32_t> epsilonOn;
+
+            /* Index of the first terminal in the symbol numbering, and the number of terminals. */
+            size_t firstTerminal;
+            size_t numTerminals;
         };
 
         /* Utility functions for working with LR(0) items. */
@@ -2153,33 +2936,87 @@ namespace CFG {
             return state.get();
         }
 
+        /* Adds lookahead filtering to the LR(0) e-DFA.
+         *
+         * The non-kernel state reached by an epsilon transition at position i holds the
+         * items predicted at position i. Those items are only ever useful if they can
+         * eventually read the character at position i, which they do by shifting the
+         * symbol after their dot. (Nulling out a symbol is accounted for by separate
+         * items where the dot has already been moved past it.) Items whose dot is at the
+         * end are also useless, since items that complete where they start are never
+         * processed by the completer.
+         *
+         * So for each epsilon transition and each terminal, we build a smaller non-kernel
+         * state holding just the items that could read that terminal. This can introduce
+         * new kernel states, which need their own filtered transitions, so we iterate
+         * until nothing changes.
+         */
+        void addFilteredEpsilons(const CFG& cfg,
+                                 const Nulls& nullable,
+                                 const Lookahead& lookahead,
+                                 map<set<LR0Item>, shared_ptr<LR0EState>>& states) {
+            while (true) {
+                /* Snapshot what needs processing, since we'll be adding states as we go. */
+                vector<LR0EState*> worklist;
+                for (const auto& entry: states) {
+                    if (entry.second->epsilon && entry.second->epsilonOn.empty()) {
+                        worklist.push_back(entry.second.get());
+                    }
+                }
+                if (worklist.empty()) return;
+
+                for (auto* state: worklist) {
+                    for (const auto& terminal: lookahead.terminals) {
+                        set<LR0Item> filtered;
+                        for (const auto& item: state->epsilon->items) {
+                            if (dotAtEnd(item)) continue;
+
+                            auto symbol = afterDot(item);
+                            if (symbol.type == Symbol::Type::TERMINAL? symbol.ch == terminal.first
+                                                                     : contains(lookahead.first.at(symbol.ch), terminal.second)) {
+                                filtered.insert(item);
+                            }
+                        }
+
+                        state->epsilonOn.push_back(filtered.empty()? nullptr : buildStateFor(filtered, ClosureType::NON_KERNEL, cfg, nullable, states));
+                    }
+                }
+            }
+        }
+
+        /* An e-DFA Earley item, packed into 64 bits. */
         struct EDFAEarleyItem {
-            const LR0EState* state;
-            size_t itemPos;
+            uint32_t state;
+            uint32_t itemPos;
         };
-    }
-}
-namespace std {
-    template <> struct hash<CFG::EDFAEarleyItem> {
-        size_t operator()(const CFG::EDFAEarleyItem& e) const {
-            return size_t(e.state) + e.itemPos * 0xFFFF;
-        }
-    };
-}
-namespace CFG {
-    namespace {
-        /* For debugging. */
-        ostream& operator<< (ostream& out, const EDFAEarleyItem& item) {
-            for (const auto& lri: item.state->items) {
-                out << lri << " @" << item.itemPos << endl;
+
+        /* Storage for the items in all columns. Columns are filled strictly in order,
+         * so they can all live back to back in one array, with column i occupying
+         * [columnStart[i], columnStart[i + 1]). The last column started runs to the
+         * end of the array.
+         */
+        struct ItemArena {
+            vector<EDFAEarleyItem> items;
+            vector<size_t>         columnStart;
+
+            void startColumn() {
+                columnStart.push_back(items.size());
             }
-            return out;
-        }
 
-        void printItems(const vector<vector<EDFAEarleyItem>>& items, size_t index) {
+            size_t begin(size_t column) const {
+                return columnStart[column];
+            }
+            size_t end(size_t column) const {
+                return column + 1 < columnStart.size()? columnStart[column + 1] : items.size();
+            }
+        };
+
+        /* For debugging. */
+        void printItems(const LR0EDFA& eDFA, const ItemArena& arena, size_t index) {
             cout << "=== Items at index " << index << " === " << endl;
-            for (const auto& item: items[index]) {
-                for (const auto& lri: item.state->items) {
+            for (size_t i = arena.begin(index); i < arena.end(index); i++) {
+                const auto& item = arena.items[i];
+                for (const auto& lri: eDFA.byIndex[item.state]->items) {
                     cout << "  " << lri << " @" << item.itemPos << endl;
                 }
                 cout << endl;
@@ -2210,66 +3047,287 @@ namespace CFG {
          * then we need about 4k memory, tops, to hold all of these combinations.
          *
          * As an optimization, we'll allocate that array and then use it instead of a
-         * hash table. We'll then use a simpler vector<vector<EDFAEarleyItem>> to hold
-         * the actual items, still letting us scan over things if we need them.
+         * hash table. We'll then use a simple ItemArena to hold the actual items,
+         * still letting us scan over things if we need them.
          */
         struct Bitmap3D {
-            vector<uint64_t> bits;
-            size_t widthMultiplier;
+            /* One slice per index, allocated the first time something lands there.
+             * Parses of bad strings usually die early, and this way they don't pay to
+             * zero out the slices they never reach.
+             */
+            vector<vector<uint64_t>> columns;
+            size_t columnWords;
             size_t depthMultiplier;
 
-            Bitmap3D(size_t w, size_t d, size_t h) : bits((w * d * h + 63) / 64),
-                                                     widthMultiplier(d * h),
+            Bitmap3D(size_t w, size_t d, size_t h) : columns(w),
+                                                     columnWords((d * h + 63) / 64),
                                                      depthMultiplier(h) {
-                // (w * d * h + 63) / 64 is ceil(wdh / 64).
-                // Index calculation is (x, y, z) -> x * d * h + y * h + z,
-                // so we store dh and h.
+                // (d * h + 63) / 64 is ceil(dh / 64).
+                // Index calculation is (x, y, z) -> slice x, bit y * h + z,
+                // so we store h.
             }
         };
 
-        bool insert(vector<vector<EDFAEarleyItem>>& items,
+        /* Adds an item to the given column, which must be the last one started. */
+        bool insert(ItemArena& arena,
                     Bitmap3D& bitmap,
                     size_t index, const EDFAEarleyItem& item) {
-            size_t   pos     = index * bitmap.widthMultiplier + item.state->index * bitmap.depthMultiplier + item.itemPos;
+            auto& column = bitmap.columns[index];
+            if (column.empty()) column.resize(bitmap.columnWords);
+
+            size_t   pos     = item.state * bitmap.depthMultiplier + item.itemPos;
             size_t   arrSlot = pos >> 6;                  // Pos / 64
             uint64_t bit     = uint64_t(1) << (pos & 63); // Pos % 64
 
             if (kParserVerbose) cout << "Attempting to add this item to slot " << index << ":" << endl;
-            if (kParserVerbose) cout << item << endl;
+            if (kParserVerbose) cout << "State " << item.state << " @" << item.itemPos << endl;
             if (kParserVerbose) cout << "Position: " << pos << endl;
             if (kParserVerbose) cout << "ArrSlot:  " << arrSlot << endl;
             if (kParserVerbose) cout << "Bit:      " << (pos & 63) << endl;
 
-            if (bitmap.bits[arrSlot] & bit) {
+            if (column[arrSlot] & bit) {
                 if (kParserVerbose) cout << "Already exists." << endl;
                 return false;
             }
 
             if (kParserVerbose) cout << "This is new, and is added." << endl;
 
-            bitmap.bits[arrSlot] |= bit;
-            items[index].push_back(item);
+            column[arrSlot] |= bit;
+            arena.items.push_back(item);
             return true;
         }
 
-        /* Runs the e-DFA-backed version of Earley. */
-        bool eDFAEarley(const LR0EDFA& eDFA, size_t startSymbol, const vector<size_t>& input) {
-            /* Item storage per slot. */
-            vector<vector<EDFAEarleyItem>> items(input.size() + 1);
+        /* Removes an item from the bitmap. (The caller handles removing it from the arena.) */
+        void erase(Bitmap3D& bitmap, size_t index, const EDFAEarleyItem& item) {
+            size_t pos = item.state * bitmap.depthMultiplier + item.itemPos;
+            bitmap.columns[index][pos >> 6] &= ~(uint64_t(1) << (pos & 63));
+        }
 
-            /* Bitmap, as described above. Dimensions are index / state # / item position. */
-            Bitmap3D bitmap(input.size() + 1, eDFA.states.size(), input.size() + 1);
+        /* Returns the epsilon transition to follow out of a state when predicting items
+         * that start at the given position.
+         */
+        uint32_t epsilonFor(const LR0EDFA& eDFA, uint32_t state,
+                            size_t pos, const vector<size_t>& input) {
+            if (eDFA.epsilonOn.empty()) return eDFA.epsilon[state];
+
+            /* Nothing predicted at the very end of the input can ever be completed. */
+            if (pos == input.size()) return kNoState;
+            return eDFA.epsilonOn[state * eDFA.numTerminals + input[pos] - eDFA.firstTerminal];
+        }
+
+        /* The three phases of processing column i of the e-DFA Earley chart. Note that
+         * the traditional roles of "scan," "complete," and "predict" have been fused
+         * together in several ways.
+         *
+         * The column must be the last one started in the arena. Each phase only looks
+         * at input[i], if that exists, so these can be run on a partial input.
+         */
+
+        /* "Predict" step for the items that were scanned into this column: follow their
+         * epsilon transitions, if any. Those items start here because they correspond to
+         * expanding out something that appears after a dot in a non-epsilon way.
+         */
+        void predictColumn(const LR0EDFA& eDFA, ItemArena& arena, Bitmap3D& bitmap,
+                           size_t i, const vector<size_t>& input) {
+            size_t end = arena.end(i);
+            for (size_t k = arena.begin(i); k < end; k++) {
+                auto epsilon = epsilonFor(eDFA, arena.items[k].state, i, input);
+                if (epsilon != kNoState) {
+                    if (kParserVerbose) cout << "This has an epsilon production in it." << endl;
+                    if (kParserVerbose) cout << eDFA.byIndex[epsilon]->items << endl;
+
+                    insert(arena, bitmap, i, { epsilon, uint32_t(i) });
+                }
+            }
+        }
+
+        /* "Complete" step. This is a bit different from usual. In particular:
+         *
+         * 1. We will be updating the CURRENT set, not the next one. The reason
+         *    for this is that we aren't doing explicit "predict" steps, meaning
+         *    that the sets we set up in the previous step might not have been
+         *    fully expanded out.
+         * 2. We have to factor in epsilon transitions in the automaton, which
+         *    represent that missing "predict" step.
+         * 3. We don't process any items that begin at the current location. The
+         *    reason for this is that any completed items that occur at the current
+         *    location correspond to items that were completed via nulling, and
+         *    we've already precomputed everything that's going to happen as a result.
+         *    (Plus, from an automaton perspective, we don't want to shift the
+         *    nonterminals here without having read something).
+         *
+         * The column itself serves as the worklist. The arena may grow as we go, so
+         * everything is accessed by index.
+         */
+        void completeColumn(const LR0EDFA& eDFA, ItemArena& arena, Bitmap3D& bitmap,
+                            size_t i, const vector<size_t>& input) {
+            for (size_t k = arena.begin(i); k < arena.items.size(); k++) {
+                auto curr = arena.items[k];
+                if (curr.itemPos == i) continue;
+
+                for (size_t completed: eDFA.completed[curr.state]) {
+                    if (kParserVerbose) cout << "Nonterminal index " << completed << " is completed." << endl;
+
+                    /* Find items to shift over. */
+                    for (size_t p = arena.begin(curr.itemPos); p < arena.end(curr.itemPos); p++) {
+                        auto prev = arena.items[p];
+
+                        /* See where to go; if the answer is "nowhere," skip this. */
+                        auto next = eDFA.goTo.lookup(prev.state, completed);
+                        if (next == kNoState) continue;
+
+                        /* Standard "complete" step: the item position hasn't
+                         * changed; we've just made more progress. New items may
+                         * need predicting.
+                         */
+                        if (insert(arena, bitmap, i, { next, prev.itemPos })) {
+                            auto epsilon = epsilonFor(eDFA, next, i, input);
+                            if (epsilon != kNoState) {
+                                insert(arena, bitmap, i, { epsilon, uint32_t(i) });
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        /* "Scan" step. Starts the next column and shifts each dot over input[i]. Returns
+         * whether anything survived.
+         */
+        bool scanColumn(const LR0EDFA& eDFA, ItemArena& arena, Bitmap3D& bitmap,
+                        size_t i, const vector<size_t>& input) {
+            arena.startColumn();
+            for (size_t k = arena.begin(i); k < arena.end(i); k++) {
+                auto curr = arena.items[k];
+
+                auto next = eDFA.goTo.lookup(curr.state, input[i]);
+                if (next == kNoState) continue;
 
-            /* Seed with the initial state, and its epsilon if it has one. */
-            insert(items, bitmap, 0, { eDFA.start, 0 });
-            //items[0].insert({ eDFA.start, 0 });
-            if (eDFA.start->epsilon) {
-                //items[0].insert({ eDFA.start->epsilon, 0 });
-                insert(items, bitmap, 0, { eDFA.start->epsilon, 0 });
+                if (kParserVerbose) cout << "Scanning produces this state:" << endl;
+                if (kParserVerbose) cout << eDFA.byIndex[next]->items << endl;
+
+                /* Item position hasn't changed; we're still scanning from the same
+                 * start position.
+                 */
+                insert(arena, bitmap, i + 1, { next, curr.itemPos });
+            }
+
+            return arena.begin(i + 1) != arena.end(i + 1);
+        }
+
+        /* Does column i contain an item completing the start symbol from position 0? */
+        bool columnAccepts(const LR0EDFA& eDFA, const ItemArena& arena, size_t i, size_t startSymbol) {
+            for (size_t k = arena.begin(i); k < arena.end(i); k++) {
+                const auto& item = arena.items[k];
+                if (item.itemPos == 0) {
+                    const auto& completed = eDFA.completed[item.state];
+                    if (find(completed.begin(), completed.end(), startSymbol) != completed.end()) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        /* Trie-batched Earley.
+         *
+         * Every string extending a given prefix sees the same chart for that prefix, so
+         * when matching many strings we can put them into a trie and walk it depth-first,
+         * parsing each shared prefix once. Going down an edge adds a column to the arena;
+         * coming back up pops it off again, clearing its bits in the bitmap.
+         *
+         * There's one wrinkle: with lookahead, what gets predicted in column i depends on
+         * the character at position i. Completion never looks at items predicted in the
+         * current column, though, so everything else in the column is the same for every
+         * outgoing edge. Each node settles its column once, without lookahead, and reads
+         * acceptance off of that. Each edge then only adds what its lookahead predicts,
+         * if the e-DFA uses lookahead, before scanning.
+         */
+        struct TrieNode {
+            map<size_t, size_t> children;  // Symbol index to child node
+            vector<size_t>      ends;      // Inputs that end here
+        };
+
+        /* Rolls the arena back so that it ends at position mark, which must be inside the
+         * given column, and drops any later columns.
+         */
+        void rollBack(ItemArena& arena, Bitmap3D& bitmap, size_t column, size_t mark) {
+            while (arena.columnStart.size() > column + 1) {
+                size_t last = arena.columnStart.size() - 1;
+                for (size_t k = arena.begin(last); k < arena.items.size(); k++) {
+                    erase(bitmap, last, arena.items[k]);
+                }
+                arena.items.resize(arena.begin(last));
+                arena.columnStart.pop_back();
+            }
+
+            for (size_t k = mark; k < arena.items.size(); k++) {
+                erase(bitmap, column, arena.items[k]);
+            }
+            arena.items.resize(mark);
+        }
+
+        /* Processes the given trie node. On entry, the arena holds the full chart for all
+         * columns before the node's, plus the items scanned into its column.
+         */
+        void trieEarley(const LR0EDFA& eDFA, size_t startSymbol,
+                        const vector<TrieNode>& trie, size_t node,
+                        ItemArena& arena, Bitmap3D& bitmap,
+                        vector<size_t>& path, vector<char>& matches) {
+            size_t i = path.size();
+
+            /* Settle the column. With the path ending here, there's no lookahead, so
+             * nothing is predicted that depends on the next character.
+             */
+            predictColumn(eDFA, arena, bitmap, i, path);
+            completeColumn(eDFA, arena, bitmap, i, path);
+            size_t mark = arena.items.size();
+
+            if (!trie[node].ends.empty()) {
+                bool accepts = columnAccepts(eDFA, arena, i, startSymbol);
+                for (size_t index: trie[node].ends) {
+                    matches[index] = accepts;
+                }
+            }
+
+            for (const auto& child: trie[node].children) {
+                path.push_back(child.first);
+                if (!eDFA.epsilonOn.empty()) predictColumn(eDFA, arena, bitmap, i, path);
+
+                /* If nothing survives, everything below here fails, which is the default. */
+                if (scanColumn(eDFA, arena, bitmap, i, path)) {
+                    trieEarley(eDFA, startSymbol, trie, child.second, arena, bitmap, path, matches);
+                }
+
+                rollBack(arena, bitmap, i, mark);
+                path.pop_back();
             }
+        }
+
+        /* Runs the e-DFA-backed version of Earley. The failure position in the result is
+         * an index into the input sequence.
+         *
+         * As soon as a column comes up empty the parse is dead, since nothing can ever be
+         * added to a column after we've moved past it. We stop there and report the
+         * character whose scan emptied it out.
+         */
+        MatchResult eDFAEarley(const LR0EDFA& eDFA, size_t startSymbol, const vector<size_t>& input) {
+            MatchResult result;
+
+            /* Item storage for all columns. */
+            ItemArena arena;
+            arena.columnStart.reserve(input.size() + 1);
+            arena.items.reserve(4 * (input.size() + 1));
 
-            /* Run the main loop. Note that the traditional roles of "scan," "complete,"
-             * and "predict" have been fused together in several ways.
+            /* Bitmap, as described above. Dimensions are index / state # / item position. */
+            Bitmap3D bitmap(input.size() + 1, eDFA.numStates, input.size() + 1);
+
+            /* Seed with the initial state. */
+            arena.startColumn();
+            insert(arena, bitmap, 0, { eDFA.start, 0 });
+
+            /* Run the main loop. Each column is predicted and completed in full before
+             * it's scanned into the next, which keeps each column contiguous in the arena.
              *
              * This loop is unusual in that it needs to run one more time than what
              * we'd usually expect to see, because some of the "predict" logic has been
@@ -2277,122 +3335,37 @@ namespace CFG {
              */
             for (size_t i = 0; i <= input.size(); i++) {
                 if (kParserVerbose) cout << "Before: " << endl;
-                if (kParserVerbose) printItems(items, i);
+                if (kParserVerbose) printItems(eDFA, arena, i);
 
-                /* Create a worklist of what we need to process in this column.
-                 *
-                 * TODO: This could conceivably be done by just iterating over the items in
-                 * the current column. In fact, that would probably be faster!
-                 */
-                queue<EDFAEarleyItem> worklist;
-                for (const auto& item: items[i]) {
-                    worklist.push(item);
-                }
+                predictColumn(eDFA, arena, bitmap, i, input);
+                completeColumn(eDFA, arena, bitmap, i, input);
 
-                while (!worklist.empty()) {
-                    auto curr = worklist.front();
-                    worklist.pop();
+                if (kParserVerbose) cout << "After: " << endl;
+                if (kParserVerbose) printItems(eDFA, arena, i);
 
-                    if (kParserVerbose) cout << "Processing this state:" << endl;
-                    if (kParserVerbose) cout << curr << endl;
-
-                    /* Do not do a scan step if we are in the last column. */
-                    if (i != input.size()) {
-                        /* "Scan" step. Shift each dot over the current symbol. */
-                        //auto* next = curr.state->transitions.at({ Symbol::Type::TERMINAL, input[i]});
-                        auto* next = eDFA.goTo.at(curr.state->index * eDFA.multiplier + input[i]);
-                        if (next != nullptr) {
-                            if (kParserVerbose) cout << "Scanning produces this state:" << endl;
-                            if (kParserVerbose) cout << next->items << endl;
-
-                            /* Item position hasn't changed; we're still scanning from the same
-                             * start position.
-                             */
-                            //items[i + 1].insert({ next, curr.itemPos });
-                            insert(items, bitmap, i + 1, { next, curr.itemPos });
-
-                            /* We may have an epsilon, too! If we do, this corresponds to a "predict"
-                             * step and the items start at the next position.
-                             */
-                            if (next->epsilon) {
-                                if (kParserVerbose) cout << "This has an epsilon production in it." << endl;
-                                if (kParserVerbose) cout << next->epsilon->items << endl;
-
-                                //items[i + 1].insert({ next->epsilon, i + 1 });
-                                insert(items, bitmap, i + 1, { next->epsilon, i + 1 });
-                            }
-                        } else {
-                            if (kParserVerbose) cout << "Nothing here transitions on " << toUTF8(input[i]) << endl;
-                        }
-                    }
+                result.columnsProcessed++;
+                result.itemsCreated += arena.end(i) - arena.begin(i);
 
-                    /* "Complete" step. This is a bit different from usual. In particular:
-                     *
-                     * 1. We will be updating the CURRENT set, not the next one. The reason
-                     *    for this is that we aren't doing explicit "predict" steps, meaning
-                     *    that the sets we set up in the previous step might not have been
-                     *    fully expanded out.
-                     * 2. We have to factor in epsilon transitions in the automaton, which
-                     *    represent that missing "predict" step.
-                     * 3. We don't process any items that begin at the current location. The
-                     *    reason for this is that any completed items that occur at the current
-                     *    location correspond to items that were completed via nulling, and
-                     *    we've already precomputed everything that's going to happen as a result.
-                     *    (Plus, from an automaton perspective, we don't want to shift the
-                     *    nonterminals here without having read something).
-                     */
-                    if (curr.itemPos == i) continue;
+                /* Do not do a scan step if we are in the last column. */
+                if (i == input.size()) break;
 
-                    if (kParserVerbose) cout << "Looking for completions." << endl;
-                    for (size_t completed: eDFA.completed[curr.state->index]) {
-                        if (kParserVerbose) cout << "Nonterminal index " << completed << " is completed." << endl;
-
-                        /* Find items to shift over. */
-                        for (const auto& prev: items[curr.itemPos]) {
-                            /* See where to go; if the answer is "nowhere," skip this. */
-                            //auto next = prev.state->transitions.at({Symbol::Type::NONTERMINAL, completed});
-
-                            auto next = eDFA.goTo.at(prev.state->index * eDFA.multiplier + completed);
-                            if (!next) continue;
-
-                            /* Standard "complete" step: the item position hasn't
-                             * changed; we've just made more progress.
-                             */
-                            //if (items[i].insert({ next, prev.itemPos }).second) {
-                            if (insert(items, bitmap, i, { next, prev.itemPos })) {
-                                worklist.push({ next, prev.itemPos });
-
-                                /* "Predict" step. Check if there's an epsilon and,
-                                 * if so, those items start here because they
-                                 * correspond to expanding out something that appears
-                                 * after a dot in a non-epsilon way.
-                                 */
-                                if (next->epsilon) {
-                                    //if (items[i].insert({ next->epsilon, i }).second) {
-                                    if (insert(items, bitmap, i, { next->epsilon, i })) {
-                                        worklist.push({ next->epsilon, i });
-                                    }
-                                }
-                            }
-                        }
-                    }
+                /* Nothing survived the scan? Then nothing ever will. */
+                if (!scanColumn(eDFA, arena, bitmap, i, input)) {
+                    if (kParserVerbose) cout << "No items survive scanning position " << i << "." << endl;
+                    result.failurePosition = i;
+                    return result;
                 }
-
-                if (kParserVerbose) cout << "After: " << endl;
-                if (kParserVerbose) printItems(items, i);
             }
 
             /* See if anything completes the start. */
-            for (const auto& item: items.back()) {
-                if (item.itemPos == 0) {
-                    const auto& completed = eDFA.completed.at(item.state->index);
-                    if (find(completed.begin(), completed.end(), startSymbol) != completed.end()) {
-                        return true;
-                    }
-                }
+            if (columnAccepts(eDFA, arena, input.size(), startSymbol)) {
+                result.matches = true;
+                return result;
             }
 
-            return false;
+            /* Everything was consumed, but the string ended too soon. */
+            result.failurePosition = input.size();
+            return result;
         }
 
         /* Builds the index used by the DFA matcher to translate from symbols to indices. */
@@ -2405,29 +3378,47 @@ namespace CFG {
                 eDFA.toIndex.insert(make_pair(Symbol{ Symbol::Type::TERMINAL, ch }, eDFA.toIndex.size()));
             }
 
-            eDFA.multiplier = eDFA.toIndex.size();
+            eDFA.multiplier    = eDFA.toIndex.size();
+            eDFA.firstTerminal = cfg.nonterminals.size();
+            eDFA.numTerminals  = cfg.alphabet.size();
         }
 
-        /* Builds the GOTO table for the given eDFA. This works by linearizing the individual
-         * transition tables based on the ordering given in the index.
+        /* Builds the transition table for the given eDFA. This collects each state's
+         * outgoing transitions, relabeled using the index. Along the way it fills in the
+         * per-state epsilon transitions and the table of states by number.
          */
-        void buildGoToTable(LR0EDFA& eDFA) {
-            /* We have one slot per symbol (eDFA.toIndex.size()) per state. */
-            eDFA.goTo.resize(eDFA.states.size() * eDFA.multiplier);
+        void buildTransitionTable(LR0EDFA& eDFA) {
+            eDFA.numStates = eDFA.states.size();
+            eDFA.transitions.resize(eDFA.numStates);
+            eDFA.byIndex.resize(eDFA.numStates);
+            eDFA.epsilon.resize(eDFA.numStates, kNoState);
+
             for (const auto& state: eDFA.states) {
-                for (const auto& entry: eDFA.toIndex) {
-                    size_t index = state->index * eDFA.multiplier + entry.second;
-                    eDFA.goTo.at(index) = state->transitions[entry.first];
+                eDFA.byIndex[state->index] = state.get();
+                if (state->epsilon) eDFA.epsilon[state->index] = state->epsilon->index;
+
+                for (const auto& transition: state->transitions) {
+                    if (transition.second) {
+                        eDFA.transitions[state->index].emplace_back(eDFA.toIndex.at(transition.first), transition.second->index);
+                    }
                 }
+                sort(eDFA.transitions[state->index].begin(), eDFA.transitions[state->index].end());
             }
         }
 
+        /* Builds the compressed GOTO table from the transition table. */
+        void buildGoToTable(LR0EDFA& eDFA) {
+            eDFA.goTo = compress(eDFA.transitions, eDFA.multiplier);
+            eDFA.transitions.clear();
+            eDFA.transitions.shrink_to_fit();
+        }
+
         /* Builds the 'completed' table for the given eDFA. This maps each state to the set
          * of nonterminals that end there. However, for efficiency each nonterminal is replaced
          * by an index.
          */
         void buildCompletedTable(LR0EDFA& eDFA) {
-            eDFA.completed.resize(eDFA.states.size());
+            eDFA.completed.resize(eDFA.numStates);
             for (const auto& state: eDFA.states) {
                 /* Look at all items here and find the completed ones. */
                 set<size_t> completed;
@@ -2442,12 +3433,158 @@ namespace CFG {
             }
         }
 
-        Matcher earleyLR0MatcherFor(const CFG& cfg) {
-            /* Clone the grammar so we have a persistent copy. */
-            auto ourCFG = make_shared<CFG>(addUniqueStartTo(cfg));
+        /* Builds the linearized table of lookahead-filtered epsilon transitions. */
+        void buildEpsilonTable(LR0EDFA& eDFA) {
+            eDFA.epsilonOn.resize(eDFA.numStates * eDFA.numTerminals, kNoState);
+            for (const auto& state: eDFA.states) {
+                for (size_t i = 0; i < state->epsilonOn.size(); i++) {
+                    if (state->epsilonOn[i]) {
+                        eDFA.epsilonOn[state->index * eDFA.numTerminals + i] = state->epsilonOn[i]->index;
+                    }
+                }
+            }
+        }
+
+        /* Minimizes the eDFA by merging states that the parser can't tell apart.
+         *
+         * Many distinct item sets behave identically as far as eDFAEarley is concerned:
+         * they complete the same nonterminals and their GOTO and epsilon transitions lead
+         * to states that also behave identically. We find the coarsest such partition with
+         * Moore-style partition refinement, starting from "same completed set" and
+         * splitting blocks on the blocks of their successors until nothing changes.
+         *
+         * We then renumber the merged states in breadth-first order from the start state,
+         * following transitions in symbol order, so that states used together sit near
+         * one another in the tables. This also drops any states that can't be reached,
+         * such as the unfiltered epsilon targets when lookahead is in use.
+         */
+        void minimize(LR0EDFA& eDFA) {
+            /* Number of filtered epsilon transitions per state. If we have these, the
+             * unfiltered epsilon transition is never followed and so doesn't matter.
+             */
+            size_t numEpsilons = eDFA.epsilonOn.empty()? 0 : eDFA.numTerminals;
+
+            /* Successors of a state, in a fixed order: epsilon(s), then each GOTO transition
+             * tagged with its symbol.
+             */
+            auto successorsOf = [&](uint32_t state, const vector<uint32_t>& block) {
+                auto blockOf = [&](uint32_t target) {
+                    return target == kNoState? kNoState : block[target];
+                };
+
+                vector<size_t> result;
+                if (numEpsilons == 0) result.push_back(blockOf(eDFA.epsilon[state]));
+                for (size_t i = 0; i < numEpsilons; i++) {
+                    result.push_back(blockOf(eDFA.epsilonOn[state * eDFA.numTerminals + i]));
+                }
+                for (const auto& transition: eDFA.transitions[state]) {
+                    result.push_back(transition.first);
+                    result.push_back(blockOf(transition.second));
+                }
+                return result;
+            };
+
+            /* Initial partition: by completed set. */
+            vector<uint32_t> block(eDFA.numStates);
+            size_t numBlocks;
+            {
+                map<vector<size_t>, uint32_t> blocks;
+                for (uint32_t state = 0; state < eDFA.numStates; state++) {
+                    block[state] = blocks.insert(make_pair(eDFA.completed[state], blocks.size())).first->second;
+                }
+                numBlocks = blocks.size();
+            }
+
+            /* Refine until stable. Each round's signature includes the old block, so blocks
+             * only ever split, and we're done once the count stops growing.
+             */
+            while (true) {
+                map<pair<uint32_t, vector<size_t>>, uint32_t> blocks;
+                vector<uint32_t> next(eDFA.numStates);
+                for (uint32_t state = 0; state < eDFA.numStates; state++) {
+                    auto key = make_pair(block[state], successorsOf(state, block));
+                    next[state] = blocks.insert(make_pair(key, blocks.size())).first->second;
+                }
+
+                block = std::move(next);
+                if (blocks.size() == numBlocks) break;
+                numBlocks = blocks.size();
+            }
+
+            /* Pick a representative for each block. */
+            vector<uint32_t> representative(numBlocks, kNoState);
+            for (uint32_t state = 0; state < eDFA.numStates; state++) {
+                if (representative[block[state]] == kNoState) representative[block[state]] = state;
+            }
+
+            /* Renumber blocks breadth-first from the start state. */
+            vector<uint32_t> newIndex(numBlocks, kNoState);
+            vector<uint32_t> order;
+            auto visit = [&](uint32_t state) {
+                if (state != kNoState && newIndex[block[state]] == kNoState) {
+                    newIndex[block[state]] = order.size();
+                    order.push_back(block[state]);
+                }
+            };
+            visit(eDFA.start);
+            for (size_t i = 0; i < order.size(); i++) {
+                uint32_t state = representative[order[i]];
+                if (numEpsilons == 0) visit(eDFA.epsilon[state]);
+                for (size_t j = 0; j < numEpsilons; j++) {
+                    visit(eDFA.epsilonOn[state * eDFA.numTerminals + j]);
+                }
+                for (const auto& transition: eDFA.transitions[state]) {
+                    visit(transition.second);
+                }
+            }
+
+            /* Rebuild all the tables in terms of the new numbering. */
+            auto translate = [&](uint32_t target) {
+                return target == kNoState? kNoState : newIndex[block[target]];
+            };
+            if (numEpsilons != 0) {
+                for (auto& epsilon: eDFA.epsilon) epsilon = kNoState;
+            }
+
+            LR0EDFA result;
+            result.numStates = order.size();
+            result.start = translate(eDFA.start);
+            for (uint32_t b: order) {
+                uint32_t state = representative[b];
+                result.byIndex.push_back(eDFA.byIndex[state]);
+                result.epsilon.push_back(translate(eDFA.epsilon[state]));
+                result.completed.push_back(eDFA.completed[state]);
+
+                result.transitions.emplace_back();
+                for (const auto& transition: eDFA.transitions[state]) {
+                    result.transitions.back().emplace_back(transition.first, translate(transition.second));
+                }
+                for (size_t j = 0; j < numEpsilons; j++) {
+                    result.epsilonOn.push_back(translate(eDFA.epsilonOn[state * eDFA.numTerminals + j]));
+                }
+            }
+
+            if (kParserVerbose) cout << "Minimized eDFA from " << eDFA.numStates << " to " << result.numStates << " states." << endl;
 
+            eDFA.numStates   = result.numStates;
+            eDFA.start       = result.start;
+            eDFA.byIndex     = std::move(result.byIndex);
+            eDFA.epsilon     = std::move(result.epsilon);
+            eDFA.completed   = std::move(result.completed);
+            eDFA.transitions = std::move(result.transitions);
+            eDFA.epsilonOn   = std::move(result.epsilonOn);
+        }
+
+        /* Builds the minimized LR(0) e-DFA for the given grammar, which should already
+         * have a unique start symbol. Everything is ready to go except for the compressed
+         * GOTO table, since some clients want the sparse transitions instead.
+         *
+         * The states refer back to the grammar's productions, so the grammar needs to
+         * outlive the automaton.
+         */
+        LR0EDFA uncompressedEDFAFor(const CFG& cfg) {
             /* Need to know what's nullable to do dot shifts. */
-            auto nulls = nullablesOf(*ourCFG);
+            auto nulls = nullablesOf(cfg);
 
             /* Map from LR(0) e-configurating sets to states. */
             map<set<LR0Item>, shared_ptr<LR0EState>> states;
@@ -2456,8 +3593,8 @@ namespace CFG {
              * symbol.
              */
             set<LR0Item> initial;
-            for (const auto& prod: ourCFG->productions) {
-                if (prod.nonterminal == ourCFG->startSymbol) {
+            for (const auto& prod: cfg.productions) {
+                if (prod.nonterminal == cfg.startSymbol) {
                     initial.insert({ &prod, 0 });
                 }
             }
@@ -2466,11 +3603,16 @@ namespace CFG {
              * the start configuration.
              */
             LR0EDFA eDFA;
-            eDFA.start = buildStateFor(closureOf(initial, *ourCFG, nulls, ClosureType::KERNEL),
+            eDFA.start = buildStateFor(closureOf(initial, cfg, nulls, ClosureType::KERNEL),
                                        ClosureType::KERNEL,
-                                       *ourCFG,
+                                       cfg,
                                        nulls,
-                                       states);
+                                       states)->index;
+
+            /* Add in lookahead filtering, if desired. */
+            if (kUseLookahead) {
+                addFilteredEpsilons(cfg, nulls, lookaheadFor(cfg, nulls), states);
+            }
 
             /* Form a proper automaton. Copy the states over. */
             for (const auto& entry: states) {
@@ -2478,95 +3620,4422 @@ namespace CFG {
             }
 
             /* Form the linear ordering used in the GOTO table. */
-            buildIndex(eDFA, *ourCFG);
+            buildIndex(eDFA, cfg);
 
-            /* Build the GOTO table. */
-            buildGoToTable(eDFA);
+            /* Build the transition table. */
+            buildTransitionTable(eDFA);
 
             /* And the completed table, too! */
             buildCompletedTable(eDFA);
 
-            return [=](const string& str) {
-                /* Translate input characters to their indices. */
-                vector<size_t> input;
-                for (char32_t terminal: utf8Decode(str, ourCFG->alphabet)) {
-                    input.push_back(eDFA.toIndex.at({ Symbol::Type::TERMINAL, terminal }));
-                }
-                return eDFAEarley(eDFA, eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, ourCFG->startSymbol }), input);
-            };
-        }
-    }
+            /* Plus lookahead, if we're using it. */
+            if (kUseLookahead) {
+                buildEpsilonTable(eDFA);
+            }
 
-    Matcher matcherFor(const CFG& cfg, MatcherType type) {
-        if (type == MatcherType::EARLEY) {
-            return earleyMatcherFor(cfg);
-        } else if (type == MatcherType::CYK) {
-            return cykMatcherFor(cfg);
-        } else if (type == MatcherType::EARLEY_LR0) {
-            return earleyLR0MatcherFor(cfg);
-        } else {
-            throw runtime_error("Unknown matcher type.");
+            /* Merge equivalent states. */
+            minimize(eDFA);
+            return eDFA;
         }
-    }
 
-    namespace {
-        /* Base index for Unicode characters for nonterminals. Just for fun, I've
-         * picked it to be near a bunch of cute symbols and emojis. :-)
+        /* Bit-parallel engine for small automata.
+         *
+         * If the e-DFA has at most 64 states, the items in column i with a given origin
+         * fit into a single 64-bit mask of states, and a column is just a list of
+         * (origin, mask) pairs for the origins it has items from. Every per-state
+         * operation in eDFAEarley then turns into a map from state masks to state
+         * masks: scanning a terminal, taking a GOTO on a nonterminal, and following
+         * epsilon transitions.
+         *
+         * Each of these maps distributes over OR, so we precompute them byte by byte: for
+         * each byte of the mask and each of its 256 values, the OR of the images of those
+         * states. Applying a map is then one table lookup per byte of the mask.
          */
-        const char32_t kBaseUnicode = 0x1F300;
-    }
-
-    /**************************************************************************
-     **************************************************************************
-     ***                Language Transform Implementations                  ***
-     **************************************************************************
-     **************************************************************************
-
-     Implementation of functions to compute various transformations on CFLs and
-     regular languages.
+        const size_t kMaxBitParallelStates = 64;
 
-     *************************************************************************/
+        struct BitParallelEDFA {
+            /* Bytes needed to hold a state mask, and so the number of slices per table. */
+            size_t numBytes;
 
-    /* Returns a new CFG that's the union of the two input CFGs. This works
-     * by assigning unique names to all the nonterminals in the two grammars,
-     * then adding a new start symbol S' with productions S' -> S_L | S_R.
-     */
-    CFG unionOf(const CFG& lhs, const CFG& rhs) {
-        if (lhs.alphabet != rhs.alphabet) throw runtime_error("Alphabets don't match.");
+            /* Byte-sliced maps, numBytes * 256 entries each. Terminal maps are indexed
+             * by terminal minus eDFA.firstTerminal.
+             */
+            vector<vector<uint64_t>> scan;
+            vector<vector<uint64_t>> goTo;
+            vector<vector<uint64_t>> predict;  // One per terminal, or just one without lookahead
 
-        CFG result;
-        result.alphabet = lhs.alphabet;
+            /* States completing each nonterminal, and the nonterminals anything completes. */
+            vector<uint64_t> completedBy;
+            vector<size_t>   completable;
 
-        /* Map old nonterminal names to new nonterminal names. */
-        map<char32_t, char32_t> replacements;
-        char32_t next = kBaseUnicode;
-        auto nameFor = [&](char32_t ch) {
-            if (!replacements.count(ch)) {
-                replacements[ch] = next;
-                result.nonterminals.insert(next);
-                next++;
-            }
-            return replacements[ch];
+            /* Start state, and the states that complete the start symbol. */
+            uint32_t start;
+            uint64_t accepting;
         };
 
-        /* Clone productions. */
-        for (auto prod: lhs.productions) { // Copy, not ref
-            prod.nonterminal = nameFor(prod.nonterminal);
-            for (auto& symbol: prod.replacement) {
-                if (symbol.type == Symbol::Type::NONTERMINAL) {
-                    symbol.ch = nameFor(symbol.ch);
-                }
+        uint64_t apply(const vector<uint64_t>& table, size_t numBytes, uint64_t mask) {
+            uint64_t result = 0;
+            for (size_t k = 0; k < numBytes && mask != 0; k++, mask >>= 8) {
+                result |= table[k * 256 + (mask & 0xFF)];
             }
-            result.productions.push_back(prod);
+            return result;
         }
-        for (auto prod: rhs.productions) { // Copy, not ref
-            prod.nonterminal = nameFor(prod.nonterminal);
-            for (auto& symbol: prod.replacement) {
-                if (symbol.type == Symbol::Type::NONTERMINAL) {
-                    symbol.ch = nameFor(symbol.ch);
+
+        /* Byte-slices the map taking each state to the given state (or to nothing). */
+        vector<uint64_t> sliceOf(size_t numStates, size_t numBytes, const function<uint32_t (uint32_t)>& map) {
+            vector<uint64_t> result(numBytes * 256);
+            for (size_t k = 0; k < numBytes; k++) {
+                for (size_t value = 1; value < 256; value++) {
+                    /* Build up from the value with its lowest bit cleared. */
+                    size_t   bit   = __builtin_ctzll(value);
+                    uint32_t state = k * 8 + bit;
+
+                    uint64_t image = 0;
+                    if (state < numStates && map(state) != kNoState) image = uint64_t(1) << map(state);
+                    result[k * 256 + value] = result[k * 256 + (value & (value - 1))] | image;
                 }
             }
-            result.productions.push_back(prod);
+            return result;
+        }
+
+        shared_ptr<BitParallelEDFA> bitParallelEDFAFor(const LR0EDFA& eDFA, size_t startSymbol) {
+            if (eDFA.numStates > kMaxBitParallelStates) return nullptr;
+
+            auto result = make_shared<BitParallelEDFA>();
+            result->numBytes = (eDFA.numStates + 7) / 8;
+            result->start    = eDFA.start;
+
+            for (size_t t = 0; t < eDFA.numTerminals; t++) {
+                result->scan.push_back(sliceOf(eDFA.numStates, result->numBytes, [&](uint32_t state) {
+                    return eDFA.goTo.lookup(state, eDFA.firstTerminal + t);
+                }));
+            }
+
+            result->completedBy.resize(eDFA.firstTerminal);
+            for (size_t a = 0; a < eDFA.firstTerminal; a++) {
+                result->goTo.push_back(sliceOf(eDFA.numStates, result->numBytes, [&](uint32_t state) {
+                    return eDFA.goTo.lookup(state, a);
+                }));
+            }
+            for (uint32_t state = 0; state < eDFA.numStates; state++) {
+                for (size_t a: eDFA.completed[state]) {
+                    result->completedBy[a] |= uint64_t(1) << state;
+                }
+            }
+            for (size_t a = 0; a < eDFA.firstTerminal; a++) {
+                if (result->completedBy[a] != 0) result->completable.push_back(a);
+            }
+            result->accepting = result->completedBy[startSymbol];
+
+            if (eDFA.epsilonOn.empty()) {
+                result->predict.push_back(sliceOf(eDFA.numStates, result->numBytes, [&](uint32_t state) {
+                    return eDFA.epsilon[state];
+                }));
+            } else {
+                for (size_t t = 0; t < eDFA.numTerminals; t++) {
+                    result->predict.push_back(sliceOf(eDFA.numStates, result->numBytes, [&](uint32_t state) {
+                        return eDFA.epsilonOn[state * eDFA.numTerminals + t];
+                    }));
+                }
+            }
+
+            return result;
+        }
+
+        /* Runs the bit-parallel engine. This computes exactly the same item sets as
+         * eDFAEarley does, just a whole origin's worth of states at a time.
+         */
+        MatchResult bitParallelEarley(const BitParallelEDFA& bp, size_t firstTerminal, const vector<size_t>& input) {
+            MatchResult result;
+            const size_t n = input.size();
+
+            /* States predicted at position pos from the given states. */
+            auto predicted = [&](uint64_t states, size_t pos) -> uint64_t {
+                if (bp.predict.size() == 1) return apply(bp.predict[0], bp.numBytes, states);
+                if (pos == n) return 0;
+                return apply(bp.predict[input[pos] - firstTerminal], bp.numBytes, states);
+            };
+
+            /* A column holds one entry for each origin with any states. Most columns only
+             * have a handful of live origins, so storing them densely would make the work
+             * per column grow with the input position.
+             */
+            struct Entry {
+                size_t   origin;
+                uint64_t states;
+            };
+            vector<vector<Entry>> columns(n + 1);
+            uint64_t start = uint64_t(1) << bp.start;
+            columns[0].push_back({ 0, start | predicted(start, 0) });
+
+            /* Where each origin lives in the current column, or kNoSlot if it's absent. */
+            const size_t kNoSlot = numeric_limits<size_t>::max();
+            vector<size_t> slotOf(n + 1, kNoSlot);
+
+            /* States per slot in the current column that haven't been completed yet,
+             * along with the slots that have any.
+             */
+            vector<uint64_t> pending;
+            vector<size_t>   worklist;
+
+            for (size_t i = 0; i <= n; i++) {
+                auto& column = columns[i];
+
+                /* Looks up the slot for an origin, making an empty one if there isn't one. */
+                auto slotFor = [&](size_t origin) {
+                    if (slotOf[origin] == kNoSlot) {
+                        slotOf[origin] = column.size();
+                        column.push_back({ origin, 0 });
+                        pending.push_back(0);
+                    }
+                    return slotOf[origin];
+                };
+
+                /* Everything starts out pending, except items that begin here, which were
+                 * nulled (see eDFAEarley).
+                 */
+                pending.assign(column.size(), 0);
+                for (size_t slot = 0; slot < column.size(); slot++) {
+                    slotOf[column[slot].origin] = slot;
+                    if (column[slot].origin < i) {
+                        pending[slot] = column[slot].states;
+                        worklist.push_back(slot);
+                    }
+                }
+
+                /* "Complete" step, run to a fixed point. Origins on the worklist always
+                 * precede i, so the columns we look back into are never this one.
+                 */
+                while (!worklist.empty()) {
+                    size_t slot = worklist.back();
+                    worklist.pop_back();
+
+                    size_t   origin = column[slot].origin;
+                    uint64_t states = pending[slot];
+                    pending[slot] = 0;
+
+                    for (size_t a: bp.completable) {
+                        if ((states & bp.completedBy[a]) == 0) continue;
+
+                        /* Shift over everything waiting on this nonterminal back at origin. */
+                        for (const auto& prev: columns[origin]) {
+                            uint64_t next = apply(bp.goTo[a], bp.numBytes, prev.states);
+                            if (slotOf[prev.origin] != kNoSlot) next &= ~column[slotOf[prev.origin]].states;
+                            if (next == 0) continue;
+
+                            size_t prevSlot = slotFor(prev.origin);
+                            column[prevSlot].states |= next;
+                            if (pending[prevSlot] == 0) worklist.push_back(prevSlot);
+                            pending[prevSlot] |= next;
+
+                            /* "Predict" step. */
+                            column[slotFor(i)].states |= predicted(next, i);
+                        }
+                    }
+                }
+
+                result.columnsProcessed++;
+                for (const auto& entry: column) {
+                    result.itemsCreated += __builtin_popcountll(entry.states);
+                }
+                for (const auto& entry: column) {
+                    slotOf[entry.origin] = kNoSlot;
+                }
+
+                if (i == n) break;
+
+                /* "Scan" step into the next column. */
+                const auto& scan = bp.scan[input[i] - firstTerminal];
+                auto& next = columns[i + 1];
+
+                uint64_t scanned = 0;
+                for (const auto& entry: column) {
+                    uint64_t states = apply(scan, bp.numBytes, entry.states);
+                    if (states == 0) continue;
+
+                    next.push_back({ entry.origin, states });
+                    scanned |= states;
+                }
+
+                /* Nothing survived the scan? Then nothing ever will. */
+                if (scanned == 0) {
+                    result.failurePosition = i;
+                    return result;
+                }
+
+                uint64_t predictedNext = predicted(scanned, i + 1);
+                if (predictedNext != 0) next.push_back({ i + 1, predictedNext });
+            }
+
+            for (const auto& entry: columns[n]) {
+                if (entry.origin == 0 && (entry.states & bp.accepting)) result.matches = true;
+            }
+            if (!result.matches) result.failurePosition = n;
+            return result;
+        }
+
+        /* Everything needed to run the e-DFA matcher, shared by the matchers built from it. */
+        struct EDFAMatcherState {
+            CFG     cfg;
+            LR0EDFA eDFA;
+            size_t  startSymbol;
+
+            /* Bit-parallel tables, if the automaton is small enough to use them. */
+            shared_ptr<BitParallelEDFA> bitParallel;
+        };
+
+        shared_ptr<EDFAMatcherState> eDFAMatcherStateFor(const CFG& cfg) {
+            auto result = make_shared<EDFAMatcherState>();
+            result->cfg = addUniqueStartTo(cfg);
+
+            /* Build the automaton, then pack the GOTO table. */
+            result->eDFA = uncompressedEDFAFor(result->cfg);
+            buildGoToTable(result->eDFA);
+
+            result->startSymbol = result->eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, result->cfg.startSymbol });
+            result->bitParallel = bitParallelEDFAFor(result->eDFA, result->startSymbol);
+            return result;
+        }
+
+        /* Translates input characters to their indices. */
+        vector<size_t> toSymbolIndices(const EDFAMatcherState& state, const string& str) {
+            vector<size_t> input;
+            for (char32_t terminal: utf8Decode(str, state.cfg.alphabet)) {
+                input.push_back(state.eDFA.toIndex.at({ Symbol::Type::TERMINAL, terminal }));
+            }
+            return input;
+        }
+
+        MatchResult eDFAMatch(const EDFAMatcherState& state, const vector<size_t>& input) {
+            if (state.bitParallel) {
+                return bitParallelEarley(*state.bitParallel, state.eDFA.firstTerminal, input);
+            }
+            return eDFAEarley(state.eDFA, state.startSymbol, input);
+        }
+
+        MatchResult eDFAMatch(const EDFAMatcherState& state, const string& str) {
+            return eDFAMatch(state, toSymbolIndices(state, str));
+        }
+
+        /* Given an index into the decoded input, returns the byte offset in the original
+         * string of that character, accounting for the whitespace utf8Decode skips.
+         */
+        size_t byteOffsetOf(const string& str, size_t index) {
+            size_t offset = 0;
+            for (char32_t ch: utf8Reader(str)) {
+                if (!isSpace(ch)) {
+                    if (index == 0) return offset;
+                    index--;
+                }
+                offset += toUTF8(ch).size();
+            }
+            return str.size();
+        }
+
+        DetailedMatcher earleyLR0DetailedMatcherFor(const CFG& cfg) {
+            auto state = eDFAMatcherStateFor(cfg);
+            return [=](const string& str) {
+                auto result = eDFAMatch(*state, str);
+                if (!result.matches) {
+                    result.failurePosition = byteOffsetOf(str, result.failurePosition);
+                }
+                return result;
+            };
+        }
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                  Lockstep (Bit-Sliced) Batch Matching               ***
+     **************************************************************************
+     **************************************************************************
+
+     When one grammar is matched against many short strings, we can run up to
+     64 of them through the e-DFA Earley loop at the same time. Each "lane" is
+     one input string, and instead of asking whether item (state, origin) is
+     in column i, we keep a 64-bit mask of which lanes have it. Scanning a
+     terminal becomes an AND with the mask of lanes reading that terminal, and
+     completing becomes an AND of the two items' masks, so one pass of the
+     loop does the work for the whole batch.
+
+     Completion within a column is run semi-naively: each item remembers which
+     lanes it gained since it was last processed, and only those are pushed
+     forward. Inputs are sorted by length before batching so that lanes in a
+     batch finish around the same time, and batches run in parallel.
+
+     *************************************************************************/
+    namespace {
+        /* Number of inputs processed in lockstep. */
+        const size_t kBatchLanes = 64;
+        using Lanes = uint64_t;
+
+        /* Item storage for one batch. Each item in the arena has a mask of the lanes
+         * that have it, stored alongside it, so the chart only grows with the number of
+         * items actually present.
+         */
+        const size_t kNoBatchSlot = numeric_limits<size_t>::max();
+
+        struct BatchChart {
+            size_t numStates;
+
+            /* As in eDFAEarley, columns are filled in order, so they share one arena.
+             * masks[k] is the mask for arena.items[k].
+             */
+            ItemArena     arena;
+            vector<Lanes> masks;
+
+            /* Where each (state, origin) pair of the last column lives in the arena. Each
+             * origin with items in that column gets a block of numStates slots, found
+             * through blockOf, and everything is reset when the next column starts.
+             */
+            vector<size_t> blockOf;
+            vector<size_t> slots;
+            vector<size_t> origins;
+
+            explicit BatchChart(size_t numStates) : numStates(numStates) {}
+
+            /* Empties the chart and makes room for inputs of the given length. */
+            void reset(size_t length) {
+                arena.items.clear();
+                arena.columnStart.clear();
+                masks.clear();
+                if (blockOf.size() < length + 1) blockOf.resize(length + 1, kNoBatchSlot);
+                startColumn();
+            }
+
+            void startColumn() {
+                for (size_t origin: origins) {
+                    blockOf[origin] = kNoBatchSlot;
+                }
+                origins.clear();
+                slots.clear();
+                arena.startColumn();
+            }
+
+            /* Adds lanes to an item in the last column started, returning which of them
+             * are new and setting index to the item's place in the arena.
+             */
+            Lanes add(uint32_t state, size_t origin, Lanes lanes, size_t& index) {
+                if (blockOf[origin] == kNoBatchSlot) {
+                    blockOf[origin] = slots.size();
+                    slots.resize(slots.size() + numStates, kNoBatchSlot);
+                    origins.push_back(origin);
+                }
+
+                size_t& slot = slots[blockOf[origin] + state];
+                if (slot == kNoBatchSlot) {
+                    slot = arena.items.size();
+                    arena.items.push_back({ state, uint32_t(origin) });
+                    masks.push_back(0);
+                }
+
+                index = slot;
+                Lanes added = lanes & ~masks[slot];
+                masks[slot] |= added;
+                return added;
+            }
+        };
+
+        /* Scratch space for batchEarley. Reusing one across batches for the same grammar
+         * saves reallocating the chart every time.
+         */
+        struct BatchWorkspace {
+            BatchChart     chart;
+            vector<Lanes>  pending;
+            vector<size_t> worklist;
+
+            explicit BatchWorkspace(const EDFAMatcherState& state) : chart(state.eDFA.numStates) {}
+        };
+
+        /* Runs one batch of at most 64 inputs, writing the results into matches. */
+        void batchEarley(const EDFAMatcherState& state,
+                         const vector<const vector<size_t>*>& inputs,
+                         vector<char>& matches,
+                         BatchWorkspace& workspace) {
+            const auto& eDFA = state.eDFA;
+
+            size_t length = 0;
+            for (const auto* input: inputs) {
+                length = max(length, input->size());
+            }
+
+            /* For each column, which lanes read which terminal there, and which lanes end there. */
+            vector<vector<pair<size_t, Lanes>>> reading(length + 1);
+            vector<Lanes> ending(length + 1);
+            for (size_t lane = 0; lane < inputs.size(); lane++) {
+                const auto& input = *inputs[lane];
+                for (size_t i = 0; i < input.size(); i++) {
+                    auto itr = find_if(reading[i].begin(), reading[i].end(), [&](const pair<size_t, Lanes>& entry) {
+                        return entry.first == input[i];
+                    });
+                    if (itr == reading[i].end()) {
+                        reading[i].emplace_back(input[i], 0);
+                        itr = prev(reading[i].end());
+                    }
+                    itr->second |= Lanes(1) << lane;
+                }
+                ending[input.size()] |= Lanes(1) << lane;
+            }
+
+            /* Does each state complete the start symbol? */
+            vector<bool> accepting(eDFA.numStates);
+            for (size_t s = 0; s < eDFA.numStates; s++) {
+                const auto& completed = eDFA.completed[s];
+                accepting[s] = find(completed.begin(), completed.end(), state.startSymbol) != completed.end();
+            }
+
+            auto& chart = workspace.chart;
+            chart.reset(length);
+
+            /* Lanes gained by each item in the current column that haven't been pushed
+             * forward yet, indexed by the item's offset in the column, plus a worklist of
+             * the arena indices of items with anything pending. Everything in pending is
+             * cleared out by the time we finish with a column.
+             */
+            auto& pending  = workspace.pending;
+            auto& worklist = workspace.worklist;
+            size_t columnBegin = 0;
+
+            auto queue = [&](size_t index, Lanes added) {
+                size_t offset = index - columnBegin;
+                if (offset >= pending.size()) pending.resize(offset + 1);
+                if (pending[offset] == 0) worklist.push_back(index);
+                pending[offset] |= added;
+            };
+
+            /* Predicts from the given state at position pos, which must be the last column
+             * started, for the given lanes. If track is set, new items are queued up for
+             * completion in the current column.
+             */
+            auto predict = [&](size_t pos, uint32_t from, Lanes lanes, bool track) {
+                auto addPrediction = [&](uint32_t to, Lanes predicted) {
+                    if (to == kNoState || predicted == 0) return;
+
+                    size_t index;
+                    Lanes added = chart.add(to, pos, predicted, index);
+                    if (track && added != 0) queue(index, added);
+                };
+
+                if (eDFA.epsilonOn.empty()) {
+                    addPrediction(eDFA.epsilon[from], lanes);
+                } else {
+                    for (const auto& entry: reading[pos]) {
+                        addPrediction(eDFA.epsilonOn[from * eDFA.numTerminals + entry.first - eDFA.firstTerminal],
+                                      lanes & entry.second);
+                    }
+                }
+            };
+
+            Lanes all = inputs.size() == kBatchLanes? ~Lanes(0) : (Lanes(1) << inputs.size()) - 1;
+            size_t startIndex;
+            chart.add(eDFA.start, 0, all, startIndex);
+            predict(0, eDFA.start, all, false);
+
+            Lanes accepted = 0;
+            for (size_t i = 0; i <= length; i++) {
+                /* Everything in the column starts out pending. */
+                columnBegin = chart.arena.begin(i);
+                worklist.clear();
+                for (size_t k = chart.arena.begin(i); k < chart.arena.end(i); k++) {
+                    queue(k, chart.masks[k]);
+                }
+
+                /* Complete to a fixed point. */
+                while (!worklist.empty()) {
+                    size_t index = worklist.back();
+                    worklist.pop_back();
+
+                    auto  curr  = chart.arena.items[index];
+                    Lanes lanes = pending[index - columnBegin];
+                    pending[index - columnBegin] = 0;
+
+                    /* Items that begin here were nulled; see eDFAEarley. */
+                    if (curr.itemPos == i) continue;
+
+                    for (size_t completed: eDFA.completed[curr.state]) {
+                        for (size_t p = chart.arena.begin(curr.itemPos); p < chart.arena.end(curr.itemPos); p++) {
+                            auto prev = chart.arena.items[p];
+                            auto next = eDFA.goTo.lookup(prev.state, completed);
+                            if (next == kNoState) continue;
+
+                            Lanes shifted = lanes & chart.masks[p];
+                            if (shifted == 0) continue;
+
+                            size_t nextIndex;
+                            Lanes added = chart.add(next, prev.itemPos, shifted, nextIndex);
+                            if (added == 0) continue;
+
+                            queue(nextIndex, added);
+                            predict(i, next, added, true);
+                        }
+                    }
+                }
+
+                /* Record results for lanes that end here. */
+                if (ending[i] != 0) {
+                    for (size_t k = chart.arena.begin(i); k < chart.arena.end(i); k++) {
+                        const auto& item = chart.arena.items[k];
+                        if (item.itemPos == 0 && accepting[item.state]) {
+                            accepted |= chart.masks[k] & ending[i];
+                        }
+                    }
+                }
+
+                if (i == length) break;
+
+                /* Scan into the next column. */
+                chart.startColumn();
+                for (size_t k = chart.arena.begin(i); k < chart.arena.end(i); k++) {
+                    auto  item = chart.arena.items[k];
+                    Lanes mask = chart.masks[k];
+                    for (const auto& entry: reading[i]) {
+                        Lanes lanes = mask & entry.second;
+                        if (lanes == 0) continue;
+
+                        auto next = eDFA.goTo.lookup(item.state, entry.first);
+                        if (next == kNoState) continue;
+
+                        size_t index;
+                        chart.add(next, item.itemPos, lanes, index);
+                        predict(i + 1, next, lanes, false);
+                    }
+                }
+
+                /* Every lane still running is dead. */
+                if (chart.arena.begin(i + 1) == chart.arena.end(i + 1)) break;
+            }
+
+            for (size_t lane = 0; lane < inputs.size(); lane++) {
+                matches[lane] = (accepted >> lane) & 1;
+            }
+        }
+
+        BatchMatcher earleyLR0BatchMatcherFor(const CFG& cfg) {
+            auto state = eDFAMatcherStateFor(cfg);
+            return [=](const vector<string>& strs) {
+                /* Translate everything up front, so bad characters are reported right away. */
+                vector<vector<size_t>> inputs;
+                for (const auto& str: strs) {
+                    inputs.push_back(toSymbolIndices(*state, str));
+                }
+
+                /* Group similar lengths together. */
+                vector<size_t> order(inputs.size());
+                iota(order.begin(), order.end(), 0);
+                stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+                    return inputs[lhs].size() < inputs[rhs].size();
+                });
+
+                /* vector<bool> packs bits, so it can't be written to from several threads. */
+                vector<char> matches(inputs.size());
+                size_t numBatches = (inputs.size() + kBatchLanes - 1) / kBatchLanes;
+                parallelFor(0, numBatches, 1, [&](size_t low, size_t high) {
+                    BatchWorkspace workspace(*state);
+                    for (size_t batch = low; batch < high; batch++) {
+                        vector<const vector<size_t>*> lanes;
+                        for (size_t i = batch * kBatchLanes; i < min(inputs.size(), (batch + 1) * kBatchLanes); i++) {
+                            lanes.push_back(&inputs[order[i]]);
+                        }
+
+                        vector<char> result(lanes.size());
+                        batchEarley(*state, lanes, result, workspace);
+                        for (size_t i = 0; i < lanes.size(); i++) {
+                            matches[order[batch * kBatchLanes + i]] = result[i];
+                        }
+                    }
+                });
+
+                return vector<bool>(matches.begin(), matches.end());
+            };
+        }
+
+        BatchMatcher earleyLR0TrieBatchMatcherFor(const CFG& cfg) {
+            auto state = eDFAMatcherStateFor(cfg);
+            return [=](const vector<string>& strs) {
+                /* Build the trie, translating as we go so bad characters are reported up front. */
+                vector<TrieNode> trie(1);
+                size_t length = 0;
+                for (size_t index = 0; index < strs.size(); index++) {
+                    size_t node = 0;
+                    auto input = toSymbolIndices(*state, strs[index]);
+                    for (size_t symbol: input) {
+                        auto itr = trie[node].children.find(symbol);
+                        if (itr == trie[node].children.end()) {
+                            itr = trie[node].children.insert(make_pair(symbol, trie.size())).first;
+                            trie.emplace_back();
+                        }
+                        node = itr->second;
+                    }
+                    trie[node].ends.push_back(index);
+                    length = max(length, input.size());
+                }
+
+                ItemArena arena;
+                Bitmap3D  bitmap(length + 1, state->eDFA.numStates, length + 1);
+                arena.startColumn();
+                insert(arena, bitmap, 0, { state->eDFA.start, 0 });
+
+                vector<char>   matches(strs.size());
+                vector<size_t> path;
+                trieEarley(state->eDFA, state->startSymbol, trie, 0, arena, bitmap, path, matches);
+
+                return vector<bool>(matches.begin(), matches.end());
+            };
+        }
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                 Bounded Equivalence Checking                       ***
+     **************************************************************************
+     **************************************************************************
+
+     Equivalence of CFGs is undecidable, but we can check two grammars against
+     each other on every string up to some length. Rather than matching each
+     string from scratch, we walk the tree of all strings depth-first, running
+     both grammars' e-DFA Earley charts incrementally just as the trie-batched
+     matcher does, so each prefix is only ever parsed once. If both charts die
+     at some prefix, nothing below it is in either language and we skip the
+     whole subtree.
+
+     For parallelism, the top few levels of the tree are walked on the calling
+     thread, and each subtree below them becomes a separate task that replays
+     its prefix into fresh charts and carries on from there.
+
+     We want the shortest counterexample, and among those the first in
+     alphabetical order. Every task shares the length of the best one found so
+     far and never looks at anything longer, so once we have a counterexample,
+     the rest of the search only covers strings that could beat it.
+
+     *************************************************************************/
+
+    namespace {
+        /* Search state shared among all the tasks. */
+        struct EquivalenceSearch {
+            size_t maxLength;
+            size_t numTerminals;
+
+            /* Length of the best counterexample so far, or one past maxLength if none. */
+            atomic<size_t> bestLength;
+
+            mutex          lock;
+            bool           found = false;
+            vector<size_t> bestRanks;   // Terminal ranks in alphabet order
+            bool           bestInLHS = false;
+
+            atomic<size_t> stringsChecked{0};
+            atomic<size_t> subtreesPruned{0};
+            atomic<size_t> columnsBuilt{0};
+
+            void report(const vector<size_t>& ranks, bool inLHS) {
+                lock_guard<mutex> guard(lock);
+                if (!found || ranks.size() < bestRanks.size() ||
+                    (ranks.size() == bestRanks.size() && ranks < bestRanks)) {
+                    found     = true;
+                    bestRanks = ranks;
+                    bestInLHS = inLHS;
+                    bestLength = ranks.size();
+                }
+            }
+        };
+
+        /* One grammar's chart in a bounded equivalence check. */
+        struct EnumerationChart {
+            const EDFAMatcherState& state;
+            const vector<size_t>&   symbolFor;   // Terminal rank to e-DFA symbol index
+            ItemArena               arena;
+            Bitmap3D                bitmap;
+            vector<size_t>          path;
+
+            EnumerationChart(const EDFAMatcherState& state, const vector<size_t>& symbolFor, size_t maxLength)
+                : state(state), symbolFor(symbolFor), bitmap(maxLength + 1, state.eDFA.numStates, maxLength + 1) {
+                arena.startColumn();
+                insert(arena, bitmap, 0, { state.eDFA.start, 0 });
+            }
+
+            /* Fills in the last column with everything that doesn't depend on what comes
+             * next, returning the arena size afterwards. Completion never looks at items
+             * predicted in the current column, so the only part left out is what the
+             * lookahead predicts, if the e-DFA uses lookahead. This has to be done once
+             * before accepts() or advance().
+             */
+            size_t settle() {
+                size_t i = path.size();
+                predictColumn(state.eDFA, arena, bitmap, i, path);
+                completeColumn(state.eDFA, arena, bitmap, i, path);
+                return arena.items.size();
+            }
+
+            /* Does the string so far match? */
+            bool accepts() const {
+                return columnAccepts(state.eDFA, arena, path.size(), state.startSymbol);
+            }
+
+            /* Extends the settled chart by one character, returning whether it's still alive. */
+            bool advance(size_t rank) {
+                size_t i = path.size();
+                path.push_back(symbolFor[rank]);
+                if (!state.eDFA.epsilonOn.empty()) predictColumn(state.eDFA, arena, bitmap, i, path);
+                return scanColumn(state.eDFA, arena, bitmap, i, path);
+            }
+
+            /* Undoes an advance, given the arena size from settling before it. */
+            void retreat(size_t mark) {
+                path.pop_back();
+                rollBack(arena, bitmap, path.size(), mark);
+            }
+        };
+
+        /* Explores everything below the current prefix, whose ranks are given. alive[g]
+         * says whether chart g hasn't died yet. If tasks is non-null, then instead of
+         * exploring prefixes of length splitDepth we record them there.
+         */
+        void exploreEquivalence(EquivalenceSearch& search, EnumerationChart* charts[2], const bool alive[2],
+                                vector<size_t>& ranks, size_t splitDepth, vector<vector<size_t>>* tasks) {
+            size_t i = ranks.size();
+            if (i > search.bestLength) return;
+
+            if (tasks && i == splitDepth) {
+                tasks->push_back(ranks);
+                return;
+            }
+
+            /* Check the string itself. The settled column is shared by every extension. */
+            bool   accepts[2];
+            size_t mark[2] = { 0, 0 };
+            for (size_t g = 0; g < 2; g++) {
+                if (alive[g]) mark[g] = charts[g]->settle();
+                accepts[g] = alive[g] && charts[g]->accepts();
+            }
+            search.stringsChecked++;
+
+            if (accepts[0] != accepts[1]) {
+                search.report(ranks, accepts[0]);
+                return;
+            }
+
+            if (i == search.maxLength) return;
+
+            /* Check everything that extends it. */
+            for (size_t rank = 0; rank < search.numTerminals; rank++) {
+                if (i + 1 > search.bestLength) return;
+
+                bool next[2];
+                for (size_t g = 0; g < 2; g++) {
+                    next[g] = alive[g] && charts[g]->advance(rank);
+                    if (alive[g]) search.columnsBuilt++;
+                }
+
+                ranks.push_back(rank);
+                if (next[0] || next[1]) {
+                    exploreEquivalence(search, charts, next, ranks, splitDepth, tasks);
+                } else {
+                    search.subtreesPruned++;
+                }
+                ranks.pop_back();
+
+                for (size_t g = 0; g < 2; g++) {
+                    if (alive[g]) charts[g]->retreat(mark[g]);
+                }
+            }
+        }
+    }
+
+    BoundedEquivalenceResult checkEquivalenceUpTo(const CFG& lhs, const CFG& rhs, size_t maxLength) {
+        if (lhs.alphabet != rhs.alphabet) throw runtime_error("Alphabets don't match.");
+        auto startTime = chrono::steady_clock::now();
+
+        shared_ptr<EDFAMatcherState> states[2] = { eDFAMatcherStateFor(lhs), eDFAMatcherStateFor(rhs) };
+        vector<char32_t> terminals(lhs.alphabet.begin(), lhs.alphabet.end());
+
+        vector<size_t> symbolFor[2];
+        for (size_t g = 0; g < 2; g++) {
+            for (char32_t ch: terminals) {
+                symbolFor[g].push_back(states[g]->eDFA.toIndex.at({ Symbol::Type::TERMINAL, ch }));
+            }
+        }
+
+        EquivalenceSearch search;
+        search.maxLength    = maxLength;
+        search.numTerminals = terminals.size();
+        search.bestLength   = maxLength + 1;
+
+        /* Split deep enough to give every thread several subtrees to work on. */
+        size_t splitDepth = 0;
+        size_t numSubtrees = 1;
+        while (splitDepth < maxLength && terminals.size() > 1 &&
+               numSubtrees < 8 * WorkStealingPool::instance().concurrency()) {
+            numSubtrees *= terminals.size();
+            splitDepth++;
+        }
+
+        /* Walk the top of the tree here. */
+        vector<vector<size_t>> tasks;
+        {
+            EnumerationChart lhsChart(*states[0], symbolFor[0], maxLength);
+            EnumerationChart rhsChart(*states[1], symbolFor[1], maxLength);
+            EnumerationChart* charts[2] = { &lhsChart, &rhsChart };
+            bool alive[2] = { true, true };
+
+            vector<size_t> ranks;
+            exploreEquivalence(search, charts, alive, ranks, splitDepth, &tasks);
+        }
+
+        /* Then everything below it in parallel. */
+        parallelFor(0, tasks.size(), 1, [&](size_t low, size_t high) {
+            for (size_t task = low; task < high; task++) {
+                if (tasks[task].size() > search.bestLength) continue;
+
+                EnumerationChart lhsChart(*states[0], symbolFor[0], maxLength);
+                EnumerationChart rhsChart(*states[1], symbolFor[1], maxLength);
+                EnumerationChart* charts[2] = { &lhsChart, &rhsChart };
+                bool alive[2] = { true, true };
+
+                /* Replay the prefix. */
+                for (size_t rank: tasks[task]) {
+                    for (size_t g = 0; g < 2; g++) {
+                        if (alive[g]) charts[g]->settle();
+                        alive[g] = alive[g] && charts[g]->advance(rank);
+                    }
+                }
+                search.columnsBuilt += 2 * tasks[task].size();
+
+                auto ranks = tasks[task];
+                exploreEquivalence(search, charts, alive, ranks, splitDepth, nullptr);
+            }
+        });
+
+        BoundedEquivalenceResult result;
+        result.equivalent = !search.found;
+        if (search.found) {
+            for (size_t rank: search.bestRanks) {
+                result.counterexample += toUTF8(terminals[rank]);
+            }
+            result.inLHS = search.bestInLHS;
+        }
+
+        result.stringsChecked = search.stringsChecked;
+        result.subtreesPruned = search.subtreesPruned;
+        result.columnsBuilt   = search.columnsBuilt;
+        result.seconds        = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        result.stringsPerSecond = result.seconds > 0? result.stringsChecked / result.seconds : 0;
+        return result;
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                 Randomized Equivalence Checking                    ***
+     **************************************************************************
+     **************************************************************************
+
+     Past the lengths where checking every string is feasible, we can still
+     compare two grammars by sampling. For each length, we draw strings of
+     that length uniformly at random from each grammar using the McKenzie
+     generator and run them through the other grammar's matcher. A string
+     one grammar generates and the other rejects is a counterexample; if none
+     turns up after k samples, then with 95% confidence the fraction of that
+     grammar's strings the other one misses is below 1 - 0.05^(1/k), or about
+     3/k.
+
+     (The McKenzie generator is uniform over derivations rather than over
+     strings, so for ambiguous grammars the bound is really with respect to
+     derivations. Strings with more parse trees get sampled more often.)
+
+     Samples are drawn and matched in batches of 64, which is the width of the
+     lockstep Earley matcher, and since every sample in a batch has the same
+     length, the lanes all finish together. Batches run in parallel. Each
+     batch seeds its own random number generator from the caller's seed, the
+     length, the grammar and the batch number, so the outcome doesn't depend
+     on how many threads there are or how the batches get scheduled.
+
+     The generator's tail table is populated lazily and isn't safe to share
+     across threads, so each task checks out a generator from a pool, along
+     with a matcher workspace, and returns them afterwards. Tables filled in
+     for one length are therefore reused for all the later ones.
+
+     *************************************************************************/
+
+    namespace {
+        /* Fastest special-purpose matcher for a grammar and its type; see below. */
+        pair<MatcherType, Matcher> fastMatcherFor(const CFG& cfg);
+
+        /* Confidence level for the reported bounds. */
+        const double kSamplingConfidence = 0.95;
+
+        /* Per-task resources: generators and Earley workspaces for both grammars. */
+        struct SamplingWorker {
+            McKenzieGenerator generators[2];
+            BatchWorkspace    workspaces[2];
+
+            /* The prototypes mustn't have generated anything yet. Their tail tables
+             * are keyed by pointers into their own grammars, which wouldn't carry over.
+             */
+            SamplingWorker(const McKenzieGenerator* prototypes, const shared_ptr<EDFAMatcherState>* states)
+                : generators{ prototypes[0], prototypes[1] }, workspaces{ BatchWorkspace(*states[0]), BatchWorkspace(*states[1]) } {}
+        };
+
+        /* Everything the sampling tasks share. */
+        struct SamplingSearch {
+            McKenzieGenerator            prototypes[2];
+            shared_ptr<EDFAMatcherState> states[2];
+
+            /* Matchers to use instead of lockstep Earley, for grammars with linear-time ones. */
+            Matcher fastMatchers[2];
+
+            uint64_t seed;
+
+            mutex                               lock;
+            vector<unique_ptr<SamplingWorker>> idle;
+
+            /* Smallest (grammar, batch) key with a counterexample at the current length. */
+            atomic<size_t> bestKey;
+            string         bestString;
+
+            atomic<size_t> samplesChecked{0};
+
+            SamplingSearch(const CFG& lhs, const CFG& rhs, uint64_t seed)
+                : prototypes{ McKenzieGenerator(lhs), McKenzieGenerator(rhs) },
+                  states{ eDFAMatcherStateFor(lhs), eDFAMatcherStateFor(rhs) },
+                  seed(seed) {
+                fastMatchers[0] = fastMatcherFor(lhs).second;
+                fastMatchers[1] = fastMatcherFor(rhs).second;
+            }
+
+            unique_ptr<SamplingWorker> acquire() {
+                {
+                    lock_guard<mutex> guard(lock);
+                    if (!idle.empty()) {
+                        auto result = std::move(idle.back());
+                        idle.pop_back();
+                        return result;
+                    }
+                }
+                return unique_ptr<SamplingWorker>(new SamplingWorker(prototypes, states));
+            }
+
+            void release(unique_ptr<SamplingWorker> worker) {
+                lock_guard<mutex> guard(lock);
+                idle.push_back(std::move(worker));
+            }
+
+            void report(size_t key, const string& str) {
+                lock_guard<mutex> guard(lock);
+                if (key < bestKey) {
+                    bestKey    = key;
+                    bestString = str;
+                }
+            }
+        };
+
+        /* Draws one batch of strings of length n from grammar g and checks them against
+         * the other grammar. Returns the index of the first one the other grammar
+         * rejects, or kNotFound if there isn't one.
+         */
+        const size_t kNotFound = numeric_limits<size_t>::max();
+
+        size_t checkSampleBatch(SamplingSearch& search, SamplingWorker& worker,
+                                size_t n, size_t g, size_t batch, size_t count,
+                                vector<string>& samples) {
+            seed_seq seq{ uint32_t(search.seed), uint32_t(search.seed >> 32), uint32_t(n), uint32_t(n >> 32),
+                          uint32_t(g), uint32_t(batch), uint32_t(batch >> 32) };
+            mt19937 rng(seq);
+
+            samples.clear();
+            for (size_t i = 0; i < count; i++) {
+                auto result = worker.generators[g].generate(n, rng);
+                if (!result.first) abort(); // Logic error!
+                samples.push_back(std::move(result.second));
+            }
+            search.samplesChecked += count;
+
+            size_t other = 1 - g;
+            if (search.fastMatchers[other]) {
+                for (size_t i = 0; i < count; i++) {
+                    if (!search.fastMatchers[other](samples[i])) return i;
+                }
+                return kNotFound;
+            }
+
+            vector<vector<size_t>> inputs;
+            vector<const vector<size_t>*> lanes;
+            for (const auto& sample: samples) {
+                inputs.push_back(toSymbolIndices(*search.states[other], sample));
+            }
+            for (const auto& input: inputs) {
+                lanes.push_back(&input);
+            }
+
+            vector<char> matches(count);
+            batchEarley(*search.states[other], lanes, matches, worker.workspaces[other]);
+            for (size_t i = 0; i < count; i++) {
+                if (!matches[i]) return i;
+            }
+            return kNotFound;
+        }
+    }
+
+    SampledEquivalenceResult checkEquivalenceBySampling(const CFG& lhs, const CFG& rhs,
+                                                        size_t minLength, size_t maxLength,
+                                                        size_t samplesPerLength, uint64_t seed) {
+        if (lhs.alphabet != rhs.alphabet) throw runtime_error("Alphabets don't match.");
+        auto startTime = chrono::steady_clock::now();
+
+        SamplingSearch search(lhs, rhs, seed);
+        size_t numBatches = (samplesPerLength + kBatchLanes - 1) / kBatchLanes;
+
+        SampledEquivalenceResult result;
+        for (size_t n = minLength; n <= maxLength && result.equivalent; n++) {
+            SampledEquivalenceResult::LengthReport report;
+            report.length = n;
+
+            bool canGenerate[2];
+            for (size_t g = 0; g < 2; g++) {
+                canGenerate[g] = search.prototypes[g].lengths.contains(n);
+            }
+            report.lhsSamples = canGenerate[0]? samplesPerLength : 0;
+            report.rhsSamples = canGenerate[1]? samplesPerLength : 0;
+
+            /* Batches for the left grammar are numbered first, so that when both
+             * directions turn up counterexamples we consistently report the same one.
+             */
+            search.bestKey = kNotFound;
+            parallelFor(0, 2 * numBatches, 1, [&](size_t low, size_t high) {
+                auto worker = search.acquire();
+                vector<string> samples;
+                for (size_t key = low; key < high && key < search.bestKey; key++) {
+                    size_t g = key / numBatches, batch = key % numBatches;
+                    if (!canGenerate[g]) continue;
+
+                    size_t count = min(kBatchLanes, samplesPerLength - batch * kBatchLanes);
+                    size_t index = checkSampleBatch(search, *worker, n, g, batch, count, samples);
+                    if (index != kNotFound) search.report(key, samples[index]);
+                }
+                search.release(std::move(worker));
+            });
+
+            if (search.bestKey != kNotFound) {
+                result.equivalent     = false;
+                result.counterexample = search.bestString;
+                result.inLHS          = search.bestKey < numBatches;
+            } else {
+                /* No misses in k samples means the miss rate p has (1 - p)^k >= 1 - confidence. */
+                for (size_t g = 0; g < 2; g++) {
+                    if (!canGenerate[g] || samplesPerLength == 0) continue;
+                    double bound = 1 - pow(1 - kSamplingConfidence, 1.0 / samplesPerLength);
+                    if (g == 0) report.lhsMissBound = bound;
+                    else        report.rhsMissBound = bound;
+                }
+            }
+            result.lengths.push_back(report);
+        }
+
+        result.samplesChecked   = search.samplesChecked;
+        result.seconds          = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        result.samplesPerSecond = result.seconds > 0? result.samplesChecked / result.seconds : 0;
+        return result;
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                 Recognizer Source Code Generation                  ***
+     **************************************************************************
+     **************************************************************************
+
+     Emits a standalone C++ source file that recognizes one particular grammar
+     using the same e-DFA Earley algorithm as the EARLEY_LR0 matcher. All the
+     tables are baked in as constexpr data, GOTO lookups are a switch over the
+     state and symbol, and there's no std::function or other indirection.
+
+     The e-DFA is minimized and renumbered canonically before it's written out,
+     and everything is emitted in sorted order, so the same grammar always gives
+     byte-for-byte the same output.
+
+     *************************************************************************/
+    namespace {
+        /* Reserved words, which can't be used as a namespace name. */
+        const set<string> kCPPKeywords = {
+            "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+            "bool", "break", "case", "catch", "char", "char8_t", "char16_t", "char32_t",
+            "class", "compl", "concept", "const", "consteval", "constexpr", "constinit",
+            "const_cast", "continue", "co_await", "co_return", "co_yield", "decltype",
+            "default", "delete", "do", "double", "dynamic_cast", "else", "enum", "explicit",
+            "export", "extern", "false", "float", "for", "friend", "goto", "if", "inline",
+            "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+            "nullptr", "operator", "or", "or_eq", "private", "protected", "public",
+            "register", "reinterpret_cast", "requires", "return", "short", "signed",
+            "sizeof", "static", "static_assert", "static_cast", "struct", "switch",
+            "template", "this", "thread_local", "throw", "true", "try", "typedef",
+            "typeid", "typename", "union", "unsigned", "using", "virtual", "void",
+            "volatile", "wchar_t", "while", "xor", "xor_eq"
+        };
+
+        bool isIdentifier(const string& name) {
+            if (name.empty() || !(isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_')) return false;
+            if (kCPPKeywords.count(name)) return false;
+            return all_of(name.begin(), name.end(), [](char ch) {
+                return isalnum(static_cast<unsigned char>(ch)) || ch == '_';
+            });
+        }
+
+        /* Writes out the contents of a constexpr array, several entries per line. */
+        void writeArray(ostream& out, const string& name, const vector<uint32_t>& values) {
+            /* Zero-length arrays aren't legal, so pad empty ones. */
+            auto contents = values.empty()? vector<uint32_t>{ 0 } : values;
+
+            out << "    constexpr std::uint32_t " << name << "[" << contents.size() << "] = {";
+            for (size_t i = 0; i < contents.size(); i++) {
+                if (i % 12 == 0) out << "\n       ";
+                if (contents[i] == kNoState) {
+                    out << " kNoState,";
+                } else {
+                    out << " " << contents[i] << ",";
+                }
+            }
+            out << "\n    };\n\n";
+        }
+    }
+
+    void writeRecognizerSource(const CFG& cfg, ostream& out, const string& nameSpace) {
+        if (!isIdentifier(nameSpace)) {
+            throw runtime_error("Not a valid C++ identifier: " + nameSpace);
+        }
+
+        auto ourCFG = addUniqueStartTo(cfg);
+        auto eDFA   = uncompressedEDFAFor(ourCFG);
+
+        bool lookahead = !eDFA.epsilonOn.empty();
+
+        /* Productions can contain any terminal, including * and /, so they go in line
+         * comments rather than a block comment.
+         */
+        out << "// Recognizer generated from the following grammar. Do not edit.\n"
+            << "//\n";
+        for (const auto& prod: cfg.productions) {
+            ostringstream line;
+            line << prod;
+
+            /* A trailing backslash would splice the next line into the comment. */
+            string text = line.str();
+            if (!text.empty() && text.back() == '\\') text += " (ends in a backslash)";
+            out << "//   " << text << "\n";
+        }
+        out << "\n"
+            << "#include <cstddef>\n"
+            << "#include <cstdint>\n"
+            << "#include <stdexcept>\n"
+            << "#include <string>\n"
+            << "#include <vector>\n"
+            << "\n"
+            << "namespace " << nameSpace << " {\n"
+            << "namespace detail {\n"
+            << "    constexpr std::uint32_t kNoState       = 0xFFFFFFFFu;\n"
+            << "    constexpr std::size_t   kNumStates     = " << eDFA.numStates << ";\n"
+            << "    constexpr std::size_t   kNumTerminals  = " << eDFA.numTerminals << ";\n"
+            << "    constexpr std::uint32_t kFirstTerminal = " << eDFA.firstTerminal << ";\n"
+            << "    constexpr std::uint32_t kStart         = " << eDFA.start << ";\n"
+            << "    constexpr std::uint32_t kStartSymbol   = "
+            << eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, ourCFG.startSymbol }) << ";\n"
+            << "\n";
+
+        /* Completed nonterminals for state s are kCompleted[kCompletedBegin[s] .. kCompletedBegin[s + 1]). */
+        vector<uint32_t> completedBegin, completed;
+        for (const auto& entry: eDFA.completed) {
+            completedBegin.push_back(completed.size());
+            completed.insert(completed.end(), entry.begin(), entry.end());
+        }
+        completedBegin.push_back(completed.size());
+
+        writeArray(out, "kCompletedBegin", completedBegin);
+        writeArray(out, "kCompleted", completed);
+        if (lookahead) {
+            writeArray(out, "kEpsilonOn", eDFA.epsilonOn);
+        } else {
+            writeArray(out, "kEpsilon", eDFA.epsilon);
+        }
+
+        /* Terminal translation. The alphabet is a sorted set, so this is deterministic. */
+        out << "    constexpr std::uint32_t terminalIndex(char32_t ch) {\n"
+            << "        switch (ch) {\n";
+        for (char32_t ch: ourCFG.alphabet) {
+            out << "            case " << uint32_t(ch) << ": return "
+                << eDFA.toIndex.at({ Symbol::Type::TERMINAL, ch }) << ";\n";
+        }
+        out << "            default: return kNoState;\n"
+            << "        }\n"
+            << "    }\n"
+            << "\n";
+
+        /* GOTO table, as a switch over states and then symbols. */
+        out << "    constexpr std::uint32_t goTo(std::uint32_t state, std::uint32_t symbol) {\n"
+            << "        switch (state) {\n";
+        for (size_t state = 0; state < eDFA.numStates; state++) {
+            if (eDFA.transitions[state].empty()) continue;
+
+            out << "            case " << state << ":\n"
+                << "                switch (symbol) {\n";
+            for (const auto& transition: eDFA.transitions[state]) {
+                out << "                    case " << transition.first << ": return " << transition.second << ";\n";
+            }
+            out << "                    default: return kNoState;\n"
+                << "                }\n";
+        }
+        out << "            default: return kNoState;\n"
+            << "        }\n"
+            << "    }\n"
+            << "\n";
+
+        out << "    inline bool isSpace(char32_t ch) {\n"
+            << "        return ch == U' ' || ch == U'\\t' || ch == U'\\n' || ch == U'\\v' || ch == U'\\f' || ch == U'\\r';\n"
+            << "    }\n"
+            << "\n"
+            << "    /* Decodes the UTF-8 character starting at pos, advancing pos past it. */\n"
+            << "    inline char32_t decode(const std::string& text, std::size_t& pos) {\n"
+            << "        unsigned char lead = text[pos++];\n"
+            << "        if (lead < 0x80) return lead;\n"
+            << "\n"
+            << "        std::size_t extra = lead >= 0xF0? 3 : lead >= 0xE0? 2 : 1;\n"
+            << "        char32_t result = lead & (0x3F >> extra);\n"
+            << "        for (std::size_t i = 0; i < extra && pos < text.size(); i++) {\n"
+            << "            result = (result << 6) | (static_cast<unsigned char>(text[pos++]) & 0x3F);\n"
+            << "        }\n"
+            << "        return result;\n"
+            << "    }\n"
+            << "\n"
+            << "    struct Item {\n"
+            << "        std::uint32_t state;\n"
+            << "        std::size_t   origin;\n"
+            << "    };\n"
+            << "}\n"
+            << "\n"
+            << "bool matches(const std::string& text) {\n"
+            << "    using namespace detail;\n"
+            << "\n"
+            << "    std::vector<std::uint32_t> input;\n"
+            << "    for (std::size_t pos = 0; pos < text.size(); ) {\n"
+            << "        char32_t ch = decode(text, pos);\n"
+            << "        if (isSpace(ch)) continue;\n"
+            << "\n"
+            << "        std::uint32_t terminal = terminalIndex(ch);\n"
+            << "        if (terminal == kNoState) throw std::runtime_error(\"Invalid character.\");\n"
+            << "        input.push_back(terminal);\n"
+            << "    }\n"
+            << "    const std::size_t n = input.size();\n"
+            << "\n"
+            << "    /* Items per column, deduplicated by a (column, state, origin) bitmap. */\n"
+            << "    std::vector<std::vector<Item>> items(n + 1);\n"
+            << "    std::vector<std::uint64_t> seen(((n + 1) * kNumStates * (n + 1) + 63) / 64);\n"
+            << "    auto insert = [&](std::size_t column, std::uint32_t state, std::size_t origin) {\n"
+            << "        std::size_t   index = (column * kNumStates + state) * (n + 1) + origin;\n"
+            << "        std::uint64_t bit   = std::uint64_t(1) << (index % 64);\n"
+            << "        if (seen[index / 64] & bit) return false;\n"
+            << "\n"
+            << "        seen[index / 64] |= bit;\n"
+            << "        items[column].push_back({ state, origin });\n"
+            << "        return true;\n"
+            << "    };\n"
+            << "    auto epsilonFor = [&](std::uint32_t state, std::size_t pos) -> std::uint32_t {\n";
+        if (lookahead) {
+            out << "        if (pos == n) return kNoState;\n"
+                << "        return kEpsilonOn[state * kNumTerminals + input[pos] - kFirstTerminal];\n";
+        } else {
+            out << "        (void) pos;\n"
+                << "        return kEpsilon[state];\n";
+        }
+        out << "    };\n"
+            << "\n"
+            << "    insert(0, kStart, 0);\n"
+            << "    if (epsilonFor(kStart, 0) != kNoState) insert(0, epsilonFor(kStart, 0), 0);\n"
+            << "\n"
+            << "    for (std::size_t i = 0; i <= n; i++) {\n"
+            << "        /* The column doubles as the worklist. */\n"
+            << "        for (std::size_t k = 0; k < items[i].size(); k++) {\n"
+            << "            Item curr = items[i][k];\n"
+            << "\n"
+            << "            if (i != n) {\n"
+            << "                std::uint32_t next = goTo(curr.state, input[i]);\n"
+            << "                if (next != kNoState) {\n"
+            << "                    insert(i + 1, next, curr.origin);\n"
+            << "                    std::uint32_t epsilon = epsilonFor(next, i + 1);\n"
+            << "                    if (epsilon != kNoState) insert(i + 1, epsilon, i + 1);\n"
+            << "                }\n"
+            << "            }\n"
+            << "\n"
+            << "            if (curr.origin == i) continue;\n"
+            << "\n"
+            << "            for (std::uint32_t c = kCompletedBegin[curr.state]; c < kCompletedBegin[curr.state + 1]; c++) {\n"
+            << "                const auto& prevs = items[curr.origin];\n"
+            << "                for (std::size_t p = 0; p < prevs.size(); p++) {\n"
+            << "                    std::uint32_t next = goTo(prevs[p].state, kCompleted[c]);\n"
+            << "                    if (next == kNoState) continue;\n"
+            << "\n"
+            << "                    if (insert(i, next, prevs[p].origin)) {\n"
+            << "                        std::uint32_t epsilon = epsilonFor(next, i);\n"
+            << "                        if (epsilon != kNoState) insert(i, epsilon, i);\n"
+            << "                    }\n"
+            << "                }\n"
+            << "            }\n"
+            << "        }\n"
+            << "    }\n"
+            << "\n"
+            << "    for (const auto& item: items[n]) {\n"
+            << "        if (item.origin != 0) continue;\n"
+            << "        for (std::uint32_t c = kCompletedBegin[item.state]; c < kCompletedBegin[item.state + 1]; c++) {\n"
+            << "            if (kCompleted[c] == kStartSymbol) return true;\n"
+            << "        }\n"
+            << "    }\n"
+            << "    return false;\n"
+            << "}\n"
+            << "}\n";
+    }
+
+    namespace {
+        /* Base index for Unicode characters for nonterminals. Just for fun, I've
+         * picked it to be near a bunch of cute symbols and emojis. :-)
+         */
+        const char32_t kBaseUnicode = 0x1F300;
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                 Regular Superset Approximation                     ***
+     **************************************************************************
+     **************************************************************************
+
+     Most strings a grammar rejects can be rejected by something much cheaper
+     than a parser. Following Mohri and Nederhof ("Regular Approximation of
+     Context-Free Grammars through Transformation"), we build a finite automaton
+     whose language is a superset of the grammar's language and run it before
+     the Earley parser. Anything the automaton rejects can't be in the grammar's
+     language, so we can say "no" without parsing at all.
+
+     The construction groups the nonterminals into strongly connected components
+     of the "appears on the right-hand side of" relation. A recursive component
+     whose productions only ever mention the component at their right end (or
+     only at their left end) already generates a regular language relative to
+     the other components, and Nederhof's make_fa construction turns it into an
+     NFA directly. Every other recursive component gets rewritten into that
+     form first: for each nonterminal A in the component we add a fresh A'
+     standing for "whatever follows A," and each production
+
+         A -> a0 B1 a1 B2 ... Bm am      (each Bi in the component)
+
+     is split into A -> a0 B1, B1' -> a1 B2, ..., Bm' -> am A', along with the
+     production A' -> epsilon. This forgets which B's a given A is nested in,
+     which is where the approximation comes from, but never loses a string.
+
+     The NFA is then determinized and minimized into a flat transition table
+     indexed by terminal. Each of these steps can blow up on large grammars, so
+     we work within a fixed budget and give up (meaning "no filter," or the
+     automaton for Sigma* if someone asked for it) when it's exceeded.
+
+     If no group needed rewriting, the grammar is "strongly regular" and the
+     automaton is exact rather than an approximation. Before grouping we drop
+     every nonterminal that can only ever derive epsilon, which doesn't change
+     the language; once that's done, a grammar is strongly regular exactly when
+     it's free of self-embedding (A =>* xAy with x and y nonempty), so this also
+     catches grammars that are only "accidentally" nonlinear. Strongly regular
+     grammars are matched by walking the DFA table directly.
+
+     *************************************************************************/
+
+    namespace {
+        /* Budgets for the approximation. */
+        const size_t kMaxApproximationNFAStates      = 1 << 14;
+        const size_t kMaxApproximationNFATransitions = 1 << 16;
+        const size_t kMaxApproximationDFAStates      = 1 << 10;
+
+        const bool kApproximationVerbose = false;
+
+        /* Thrown internally when we run over budget. */
+        struct ApproximationTooLarge {};
+
+        /* Flat DFA, used both as a prefilter and as a matcher. State 0 is the start
+         * state, and transitions are indexed by state * numTerminals + the terminal's
+         * rank in the alphabet, which matches the order of terminals in the e-DFA.
+         * Missing transitions are kNoState, which rejects.
+         */
+        struct FlatDFA {
+            size_t           numTerminals;
+            vector<uint32_t> next;
+            vector<bool>     accepting;
+        };
+
+        /* How a group of mutually recursive nonterminals refers to itself. */
+        enum class Recursion {
+            NONE,         // Not recursive.
+            RIGHT_LINEAR, // Only ever at the right end of a production.
+            LEFT_LINEAR,  // Only ever at the left end of a production.
+            GENERAL       // Anything else. Needs rewriting before make_fa.
+        };
+
+        /* Grammar with its nonterminals grouped into strongly connected components. */
+        struct ApproximationGrammar {
+            char32_t start;
+            map<char32_t, vector<vector<Symbol>>> productions;
+
+            vector<set<char32_t>> groups;
+            vector<Recursion>     recursion;
+            map<char32_t, size_t> groupOf;
+        };
+
+        /* Classifies a strongly connected component. */
+        Recursion recursionOf(const ApproximationGrammar& grammar, const set<char32_t>& group, bool isRecursive) {
+            if (!isRecursive) return Recursion::NONE;
+
+            auto inGroup = [&](const Symbol& symbol) {
+                return symbol.type == Symbol::Type::NONTERMINAL && group.count(symbol.ch);
+            };
+
+            bool right = true, left = true;
+            for (char32_t member: group) {
+                for (const auto& rhs: grammar.productions.at(member)) {
+                    size_t count = count_if(rhs.begin(), rhs.end(), inGroup);
+                    if (count > 1) return Recursion::GENERAL;
+                    if (count == 1) {
+                        right &= inGroup(rhs.back());
+                        left  &= inGroup(rhs.front());
+                    }
+                }
+            }
+
+            if (right) return Recursion::RIGHT_LINEAR;
+            if (left)  return Recursion::LEFT_LINEAR;
+            return Recursion::GENERAL;
+        }
+
+        /* Applies the Mohri-Nederhof transformation to the given group, making it
+         * right-linear.
+         */
+        void makeRightLinear(ApproximationGrammar& grammar, size_t group, char32_t& nextName) {
+            auto members = grammar.groups[group];
+
+            map<char32_t, char32_t> primeOf;
+            for (char32_t member: members) {
+                while (grammar.productions.count(nextName)) nextName++;
+                primeOf[member] = nextName;
+
+                /* A' -> epsilon */
+                grammar.productions[nextName].push_back({ });
+                grammar.groups[group].insert(nextName);
+                grammar.groupOf[nextName] = group;
+            }
+
+            for (char32_t member: members) {
+                auto old = std::move(grammar.productions[member]);
+                grammar.productions[member].clear();
+
+                for (const auto& rhs: old) {
+                    /* Cut after each occurrence of a group member B, continuing from B'. */
+                    char32_t lhs = member;
+                    vector<Symbol> piece;
+                    for (const auto& symbol: rhs) {
+                        piece.push_back(symbol);
+                        if (symbol.type == Symbol::Type::NONTERMINAL && members.count(symbol.ch)) {
+                            grammar.productions[lhs].push_back(piece);
+                            lhs = primeOf[symbol.ch];
+                            piece.clear();
+                        }
+                    }
+                    piece.push_back(nonterminal(primeOf[member]));
+                    grammar.productions[lhs].push_back(piece);
+                }
+            }
+
+            grammar.recursion[group] = Recursion::RIGHT_LINEAR;
+            if (kApproximationVerbose) cout << "Rewrote a group of " << members.size() << " nonterminals into right-linear form." << endl;
+        }
+
+        /* Returns the set of nonterminals that can derive at least one nonempty string.
+         * Assumes the grammar is clean.
+         */
+        set<char32_t> nonemptyNonterminalsIn(const CFG& cfg) {
+            set<char32_t> result;
+
+            bool changed;
+            do {
+                changed = false;
+                for (const auto& prod: cfg.productions) {
+                    if (result.count(prod.nonterminal)) continue;
+
+                    for (const auto& symbol: prod.replacement) {
+                        if (symbol.type == Symbol::Type::TERMINAL || result.count(symbol.ch)) {
+                            result.insert(prod.nonterminal);
+                            changed = true;
+                            break;
+                        }
+                    }
+                }
+            } while (changed);
+
+            return result;
+        }
+
+        /* Cleans the grammar, drops nonterminals that only derive epsilon, and groups
+         * what's left into strongly connected components.
+         */
+        ApproximationGrammar groupedGrammarFor(const CFG& input) {
+            auto cfg      = clean(input);
+            auto nonempty = nonemptyNonterminalsIn(cfg);
+
+            ApproximationGrammar result;
+            result.start = cfg.startSymbol;
+            result.productions[cfg.startSymbol];
+            for (char32_t nonterminal: cfg.nonterminals) {
+                result.productions[nonterminal];
+            }
+            for (const auto& prod: cfg.productions) {
+                vector<Symbol> rhs;
+                for (const auto& symbol: prod.replacement) {
+                    if (symbol.type == Symbol::Type::TERMINAL || nonempty.count(symbol.ch)) {
+                        rhs.push_back(symbol);
+                    }
+                }
+                result.productions[prod.nonterminal].push_back(rhs);
+            }
+
+            /* Number the nonterminals and find their successors. */
+            vector<char32_t> names;
+            map<char32_t, size_t> indexOf;
+            for (const auto& entry: result.productions) {
+                indexOf.insert(make_pair(entry.first, names.size()));
+                names.push_back(entry.first);
+            }
+
+            vector<vector<size_t>> successors(names.size());
+            vector<bool> isRecursive(names.size());
+            for (size_t i = 0; i < names.size(); i++) {
+                for (const auto& rhs: result.productions.at(names[i])) {
+                    for (const auto& symbol: rhs) {
+                        if (symbol.type != Symbol::Type::NONTERMINAL) continue;
+
+                        size_t j = indexOf.at(symbol.ch);
+                        successors[i].push_back(j);
+                        if (i == j) isRecursive[i] = true;
+                    }
+                }
+            }
+
+            /* Tarjan's algorithm, iteratively, since chains of nonterminals can be long. */
+            const size_t kUnvisited = numeric_limits<size_t>::max();
+            vector<size_t> index(names.size(), kUnvisited), lowlink(names.size());
+            vector<bool>   onStack(names.size());
+            vector<size_t> stack;
+            vector<set<char32_t>> components;
+            size_t counter = 0;
+
+            for (size_t root = 0; root < names.size(); root++) {
+                if (index[root] != kUnvisited) continue;
+
+                /* Each frame is a nonterminal and how many of its successors we've tried. */
+                vector<pair<size_t, size_t>> frames = { make_pair(root, size_t(0)) };
+                index[root] = lowlink[root] = counter++;
+                stack.push_back(root);
+                onStack[root] = true;
+
+                while (!frames.empty()) {
+                    size_t curr = frames.back().first;
+                    size_t& tried = frames.back().second;
+
+                    if (tried < successors[curr].size()) {
+                        size_t next = successors[curr][tried++];
+                        if (index[next] == kUnvisited) {
+                            index[next] = lowlink[next] = counter++;
+                            stack.push_back(next);
+                            onStack[next] = true;
+                            frames.push_back(make_pair(next, size_t(0)));
+                        } else if (onStack[next]) {
+                            lowlink[curr] = min(lowlink[curr], index[next]);
+                        }
+                        continue;
+                    }
+
+                    frames.pop_back();
+                    if (!frames.empty()) {
+                        size_t parent = frames.back().first;
+                        lowlink[parent] = min(lowlink[parent], lowlink[curr]);
+                    }
+
+                    if (lowlink[curr] == index[curr]) {
+                        set<char32_t> component;
+                        size_t member;
+                        do {
+                            member = stack.back();
+                            stack.pop_back();
+                            onStack[member] = false;
+                            component.insert(names[member]);
+                        } while (member != curr);
+                        components.push_back(std::move(component));
+                    }
+                }
+            }
+
+            /* Number the groups in order of their first members. */
+            sort(components.begin(), components.end(), [](const set<char32_t>& lhs, const set<char32_t>& rhs) {
+                return *lhs.begin() < *rhs.begin();
+            });
+            for (auto& group: components) {
+                for (char32_t member: group) {
+                    result.groupOf[member] = result.groups.size();
+                }
+
+                bool recursive = group.size() > 1 || isRecursive[indexOf.at(*group.begin())];
+                result.recursion.push_back(recursionOf(result, group, recursive));
+                result.groups.push_back(std::move(group));
+            }
+
+            return result;
+        }
+
+        /* Whether make_fa gives the grammar's exact language. */
+        bool isStronglyRegular(const ApproximationGrammar& grammar) {
+            return find(grammar.recursion.begin(), grammar.recursion.end(), Recursion::GENERAL) == grammar.recursion.end();
+        }
+
+        /* Rewrites every group that isn't left- or right-linear, after which make_fa
+         * gives a regular superset of the grammar's language.
+         */
+        void makeStronglyRegular(ApproximationGrammar& grammar) {
+            char32_t nextName = kBaseUnicode;
+            for (size_t group = 0; group < grammar.groups.size(); group++) {
+                if (grammar.recursion[group] == Recursion::GENERAL) {
+                    makeRightLinear(grammar, group, nextName);
+                }
+            }
+        }
+
+        /* NFA built by make_fa. Epsilon transitions use Automata::EPSILON_TRANSITION. */
+        struct ApproximationNFA {
+            vector<vector<pair<char32_t, uint32_t>>> transitions;
+            size_t numTransitions = 0;
+
+            uint32_t start;
+            uint32_t accept;
+
+            uint32_t newState() {
+                if (transitions.size() == kMaxApproximationNFAStates) throw ApproximationTooLarge();
+                transitions.emplace_back();
+                return transitions.size() - 1;
+            }
+
+            void addTransition(uint32_t from, char32_t ch, uint32_t to) {
+                if (++numTransitions > kMaxApproximationNFATransitions) throw ApproximationTooLarge();
+                transitions[from].emplace_back(ch, to);
+            }
+        };
+
+        void makeFA(const ApproximationGrammar& grammar, ApproximationNFA& nfa, uint32_t from,
+                    vector<Symbol>::const_iterator begin, vector<Symbol>::const_iterator end, uint32_t to);
+
+        /* Nederhof's make_fa for a single symbol: adds states and transitions so that
+         * the strings taking us from "from" to "to" are (a superset of) those the
+         * symbol derives.
+         */
+        void makeFA(const ApproximationGrammar& grammar, ApproximationNFA& nfa, uint32_t from,
+                    const Symbol& symbol, uint32_t to) {
+            if (symbol.type == Symbol::Type::TERMINAL) {
+                nfa.addTransition(from, symbol.ch, to);
+                return;
+            }
+
+            size_t group = grammar.groupOf.at(symbol.ch);
+            const auto& members = grammar.groups[group];
+
+            /* Nonrecursive: just expand each production in place. */
+            if (grammar.recursion[group] == Recursion::NONE) {
+                for (const auto& rhs: grammar.productions.at(symbol.ch)) {
+                    makeFA(grammar, nfa, from, rhs.begin(), rhs.end(), to);
+                }
+                return;
+            }
+
+            /* Recursive: one state per group member. */
+            map<char32_t, uint32_t> stateFor;
+            for (char32_t member: members) {
+                stateFor[member] = nfa.newState();
+            }
+            auto inGroup = [&](const Symbol& other) {
+                return other.type == Symbol::Type::NONTERMINAL && members.count(other.ch);
+            };
+
+            /* In the right-linear case, state q_B means "B still to be derived." */
+            if (grammar.recursion[group] == Recursion::RIGHT_LINEAR) {
+                nfa.addTransition(from, Automata::EPSILON_TRANSITION, stateFor[symbol.ch]);
+                for (char32_t member: members) {
+                    for (const auto& rhs: grammar.productions.at(member)) {
+                        if (!rhs.empty() && inGroup(rhs.back())) {
+                            makeFA(grammar, nfa, stateFor[member], rhs.begin(), rhs.end() - 1, stateFor[rhs.back().ch]);
+                        } else {
+                            makeFA(grammar, nfa, stateFor[member], rhs.begin(), rhs.end(), to);
+                        }
+                    }
+                }
+            }
+            /* In the left-linear case, state q_B means "B has been derived." */
+            else if (grammar.recursion[group] == Recursion::LEFT_LINEAR) {
+                nfa.addTransition(stateFor[symbol.ch], Automata::EPSILON_TRANSITION, to);
+                for (char32_t member: members) {
+                    for (const auto& rhs: grammar.productions.at(member)) {
+                        if (!rhs.empty() && inGroup(rhs.front())) {
+                            makeFA(grammar, nfa, stateFor[rhs.front().ch], rhs.begin() + 1, rhs.end(), stateFor[member]);
+                        } else {
+                            makeFA(grammar, nfa, from, rhs.begin(), rhs.end(), stateFor[member]);
+                        }
+                    }
+                }
+            }
+            /* Everything else was rewritten away. */
+            else {
+                abort(); // Logic error!
+            }
+        }
+
+        /* make_fa for a sequence of symbols, chaining through fresh intermediate states. */
+        void makeFA(const ApproximationGrammar& grammar, ApproximationNFA& nfa, uint32_t from,
+                    vector<Symbol>::const_iterator begin, vector<Symbol>::const_iterator end, uint32_t to) {
+            if (begin == end) {
+                nfa.addTransition(from, Automata::EPSILON_TRANSITION, to);
+                return;
+            }
+
+            for (; begin + 1 != end; ++begin) {
+                uint32_t mid = nfa.newState();
+                makeFA(grammar, nfa, from, *begin, mid);
+                from = mid;
+            }
+            makeFA(grammar, nfa, from, *begin, to);
+        }
+
+        /* Runs make_fa on the start symbol, which must be strongly regular. */
+        ApproximationNFA nfaFor(const ApproximationGrammar& grammar) {
+            ApproximationNFA result;
+            result.start  = result.newState();
+            result.accept = result.newState();
+            makeFA(grammar, result, result.start, nonterminal(grammar.start), result.accept);
+
+            if (kApproximationVerbose) cout << "Approximating NFA has " << result.transitions.size() << " states." << endl;
+            return result;
+        }
+
+        /* Subset construction into a flat table. The empty set of states becomes kNoState. */
+        FlatDFA determinize(const ApproximationNFA& nfa, const Languages::Alphabet& alphabet) {
+            map<char32_t, size_t> rankOf;
+            for (char32_t ch: alphabet) {
+                rankOf.insert(make_pair(ch, rankOf.size()));
+            }
+
+            /* Epsilon closure, as a sorted list of NFA states. */
+            vector<bool> seen(nfa.transitions.size());
+            auto closureOf = [&](vector<uint32_t> states) {
+                for (uint32_t state: states) seen[state] = true;
+                for (size_t i = 0; i < states.size(); i++) {
+                    for (const auto& transition: nfa.transitions[states[i]]) {
+                        if (transition.first == Automata::EPSILON_TRANSITION && !seen[transition.second]) {
+                            seen[transition.second] = true;
+                            states.push_back(transition.second);
+                        }
+                    }
+                }
+                for (uint32_t state: states) seen[state] = false;
+
+                sort(states.begin(), states.end());
+                return states;
+            };
+
+            map<vector<uint32_t>, uint32_t> indexOf;
+            vector<vector<uint32_t>> subsets;
+            auto indexFor = [&](vector<uint32_t> states) {
+                states.erase(unique(states.begin(), states.end()), states.end());
+                if (states.empty()) return kNoState;
+
+                auto closure = closureOf(std::move(states));
+                auto result = indexOf.insert(make_pair(closure, uint32_t(subsets.size())));
+                if (result.second) {
+                    if (subsets.size() == kMaxApproximationDFAStates) throw ApproximationTooLarge();
+                    subsets.push_back(closure);
+                }
+                return result.first->second;
+            };
+
+            FlatDFA result;
+            result.numTerminals = alphabet.size();
+
+            indexFor({ nfa.start });
+            for (size_t i = 0; i < subsets.size(); i++) {
+                auto subset = subsets[i];
+                vector<vector<uint32_t>> moves(result.numTerminals);
+                for (uint32_t state: subset) {
+                    for (const auto& transition: nfa.transitions[state]) {
+                        if (transition.first != Automata::EPSILON_TRANSITION) {
+                            moves[rankOf.at(transition.first)].push_back(transition.second);
+                        }
+                    }
+                }
+
+                result.accepting.push_back(binary_search(subset.begin(), subset.end(), nfa.accept));
+                for (auto& move: moves) {
+                    sort(move.begin(), move.end());
+                    result.next.push_back(indexFor(std::move(move)));
+                }
+            }
+
+            return result;
+        }
+
+        /* Moore-style minimization, as with the e-DFA. We add an explicit dead state so
+         * that states that can never accept merge with it and become kNoState, which
+         * lets the filter reject as early as possible.
+         */
+        void minimize(FlatDFA& dfa) {
+            const uint32_t numStates = dfa.accepting.size();
+            const uint32_t dead      = numStates;
+
+            auto successor = [&](uint32_t state, size_t terminal) {
+                if (state == dead) return dead;
+                uint32_t target = dfa.next[state * dfa.numTerminals + terminal];
+                return target == kNoState? dead : target;
+            };
+
+            vector<uint32_t> block(numStates + 1);
+            for (uint32_t state = 0; state < numStates; state++) {
+                block[state] = dfa.accepting[state]? 1 : 0;
+            }
+            size_t numBlocks = 0;
+
+            /* Refine until stable; see the e-DFA version above for why this terminates. */
+            while (true) {
+                map<vector<uint32_t>, uint32_t> blocks;
+                vector<uint32_t> next(numStates + 1);
+                for (uint32_t state = 0; state <= numStates; state++) {
+                    vector<uint32_t> key = { block[state] };
+                    for (size_t terminal = 0; terminal < dfa.numTerminals; terminal++) {
+                        key.push_back(block[successor(state, terminal)]);
+                    }
+                    next[state] = blocks.insert(make_pair(key, blocks.size())).first->second;
+                }
+
+                block = std::move(next);
+                if (blocks.size() == numBlocks) break;
+                numBlocks = blocks.size();
+            }
+
+            /* Renumber breadth-first from the start state, which stays state 0 even if
+             * it's dead (meaning the language is empty).
+             */
+            vector<uint32_t> representative(numBlocks, kNoState);
+            for (uint32_t state = 0; state < numStates; state++) {
+                if (representative[block[state]] == kNoState) representative[block[state]] = state;
+            }
+
+            vector<uint32_t> newIndex(numBlocks, kNoState);
+            vector<uint32_t> order;
+            auto visit = [&](uint32_t state) {
+                if (newIndex[block[state]] == kNoState) {
+                    newIndex[block[state]] = order.size();
+                    order.push_back(block[state]);
+                }
+            };
+            auto translate = [&](uint32_t state) {
+                return block[state] == block[dead]? kNoState : newIndex[block[state]];
+            };
+
+            visit(0);
+            for (size_t i = 0; i < order.size(); i++) {
+                uint32_t state = representative[order[i]];
+                for (size_t terminal = 0; terminal < dfa.numTerminals; terminal++) {
+                    uint32_t target = successor(state, terminal);
+                    if (block[target] != block[dead]) visit(target);
+                }
+            }
+
+            FlatDFA result;
+            result.numTerminals = dfa.numTerminals;
+            for (uint32_t b: order) {
+                uint32_t state = representative[b];
+                result.accepting.push_back(dfa.accepting[state]);
+                for (size_t terminal = 0; terminal < dfa.numTerminals; terminal++) {
+                    result.next.push_back(translate(successor(state, terminal)));
+                }
+            }
+
+            if (kApproximationVerbose) cout << "Minimized prefilter from " << numStates << " to " << order.size() << " states." << endl;
+            dfa = std::move(result);
+        }
+
+        /* Builds the minimal DFA for a strongly regular grammar, or returns null if
+         * it's over budget.
+         */
+        shared_ptr<FlatDFA> flatDFAFor(const ApproximationGrammar& grammar, const Languages::Alphabet& alphabet) {
+            try {
+                auto result = make_shared<FlatDFA>(determinize(nfaFor(grammar), alphabet));
+                minimize(*result);
+                return result;
+            } catch (const ApproximationTooLarge &) {
+                if (kApproximationVerbose) cout << "Regular approximation is over budget." << endl;
+                return nullptr;
+            }
+        }
+
+        /* Builds the prefilter for a grammar, or returns null if it's over budget. */
+        shared_ptr<FlatDFA> regularPrefilterFor(const CFG& cfg) {
+            auto grammar = groupedGrammarFor(cfg);
+            makeStronglyRegular(grammar);
+            return flatDFAFor(grammar, cfg.alphabet);
+        }
+
+        /* Builds an exact DFA for a grammar, or returns null if the grammar isn't
+         * strongly regular or the DFA is over budget.
+         */
+        shared_ptr<FlatDFA> regularDFAFor(const CFG& cfg) {
+            auto grammar = groupedGrammarFor(cfg);
+            if (!isStronglyRegular(grammar)) return nullptr;
+            return flatDFAFor(grammar, cfg.alphabet);
+        }
+
+        /* Whether the filter accepts every string, in which case it's not worth running. */
+        bool acceptsEverything(const FlatDFA& filter) {
+            return all_of(filter.accepting.begin(), filter.accepting.end(), [](bool b) { return b; }) &&
+                   find(filter.next.begin(), filter.next.end(), kNoState) == filter.next.end();
+        }
+
+        /* Runs the filter over input already translated to e-DFA symbol indices. */
+        bool prefilterAccepts(const FlatDFA& filter, const vector<size_t>& input, size_t firstTerminal) {
+            uint32_t state = 0;
+            for (size_t symbol: input) {
+                state = filter.next[state * filter.numTerminals + (symbol - firstTerminal)];
+                if (state == kNoState) return false;
+            }
+            return filter.accepting[state];
+        }
+
+        /* Table-walking matcher for strongly regular grammars. */
+        Matcher dfaMatcherFor(const Languages::Alphabet& alphabet, shared_ptr<const FlatDFA> dfa) {
+            map<char32_t, size_t> rankOf;
+            for (char32_t ch: alphabet) {
+                rankOf.insert(make_pair(ch, rankOf.size()));
+            }
+
+            return [=](const string& str) {
+                uint32_t state = 0;
+                for (char32_t ch: utf8Decode(str, alphabet)) {
+                    state = dfa->next[state * dfa->numTerminals + rankOf.at(ch)];
+                    if (state == kNoState) return false;
+                }
+                return bool(dfa->accepting[state]);
+            };
+        }
+
+        Matcher dfaMatcherFor(const CFG& cfg) {
+            auto dfa = regularDFAFor(cfg);
+            if (!dfa) throw runtime_error("Grammar is not regular, or its DFA is too large.");
+            return dfaMatcherFor(cfg.alphabet, dfa);
+        }
+    }
+
+    Automata::DFA regularSupersetOf(const CFG& cfg) {
+        auto filter = regularPrefilterFor(cfg);
+
+        /* Over budget? Then all we know is Sigma*. */
+        if (!filter) {
+            filter = make_shared<FlatDFA>();
+            filter->numTerminals = cfg.alphabet.size();
+            filter->next.assign(filter->numTerminals, 0);
+            filter->accepting.push_back(true);
+        }
+
+        Automata::DFA result;
+        result.alphabet = cfg.alphabet;
+
+        vector<Automata::State*> states;
+        for (size_t i = 0; i < filter->accepting.size(); i++) {
+            states.push_back(result.newState("q" + to_string(i), i == 0, filter->accepting[i]));
+        }
+
+        /* Missing transitions go to an explicit dead state, since DFAs are complete. */
+        Automata::State* dead = nullptr;
+        for (size_t i = 0; i < states.size(); i++) {
+            size_t terminal = 0;
+            for (char32_t ch: cfg.alphabet) {
+                uint32_t target = filter->next[i * filter->numTerminals + terminal];
+                if (target == kNoState) {
+                    if (!dead) {
+                        dead = result.newState("dead");
+                        for (char32_t other: cfg.alphabet) {
+                            dead->transitions.insert(make_pair(other, dead));
+                        }
+                    }
+                    states[i]->transitions.insert(make_pair(ch, dead));
+                } else {
+                    states[i]->transitions.insert(make_pair(ch, states[target]));
+                }
+                terminal++;
+            }
+        }
+
+        return result;
+    }
+
+    bool isStronglyRegular(const CFG& cfg) {
+        return isStronglyRegular(groupedGrammarFor(cfg));
+    }
+
+    Automata::NFA toNFA(const CFG& cfg) {
+        auto grammar = groupedGrammarFor(cfg);
+        if (!isStronglyRegular(grammar)) throw runtime_error("Grammar is not strongly regular.");
+
+        ApproximationNFA nfa;
+        try {
+            nfa = nfaFor(grammar);
+        } catch (const ApproximationTooLarge &) {
+            throw runtime_error("Grammar is too large to convert to an NFA.");
+        }
+
+        Automata::NFA result;
+        result.alphabet = cfg.alphabet;
+
+        vector<Automata::State*> states;
+        for (uint32_t i = 0; i < nfa.transitions.size(); i++) {
+            states.push_back(result.newState("q" + to_string(i), i == nfa.start, i == nfa.accept));
+        }
+        for (uint32_t i = 0; i < nfa.transitions.size(); i++) {
+            for (const auto& transition: nfa.transitions[i]) {
+                states[i]->transitions.insert(make_pair(transition.first, states[transition.second]));
+            }
+        }
+
+        return result;
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                    Length Set Analysis                             ***
+     **************************************************************************
+     **************************************************************************
+
+     By Parikh's theorem, the set of lengths of the strings a grammar generates
+     is ultimately periodic, which lets us answer "can this grammar produce a
+     string of length n?" in constant time. Matchers use that to reject inputs
+     of impossible lengths without parsing, and the generator uses it to skip
+     building tail tables for lengths it can't produce.
+
+     Only lengths matter here, so each nonterminal's length set is the least
+     solution of a system of equations over length sets, with union for
+     alternation and pairwise sums for concatenation. That's a commutative,
+     idempotent semiring, and over such semirings Newton's method finds the
+     least solution of a system in at most as many steps as it has variables
+     (Hopkins and Kozen; Esparza, Kiefer, and Luttenberger), and usually far
+     fewer, so we stop as soon as a step changes nothing. We solve one strongly
+     connected group of nonterminals at a time, bottom-up, so each system is
+     only as large as a single group.
+
+     Each Newton step solves a linear system. Rather than closing a matrix of
+     length sets, which is cubic in the size of the group, we treat the system
+     as an automaton over a one-letter alphabet and read the lengths of all the
+     group's nonterminals off of a single subset simulation, which takes time
+     roughly linear in the size of the grammar per length it has to look at.
+
+     The lengths of most grammars have small periods and thresholds, but not
+     all: a union of cycles whose lengths are the first k primes has a period
+     that's exponential in k, and LengthSet refuses to represent sets that
+     large. Matchers and the generator only use the lengths to reject inputs
+     early, so they give up past a budget proportional to the size of the
+     grammar, counting both the simulation and the work on length sets, since
+     by then the analysis would likely cost more than what it's guarding. In
+     either case they fall back to allowing every length.
+
+     *************************************************************************/
+
+    namespace {
+        using Languages::LengthSet;
+
+        /* Budget for the length filter on a matcher or generator, in units of work per
+         * symbol in the grammar. A unit is an automaton state visited or a bit of a length
+         * set read or written.
+         */
+        const size_t kLengthFilterWorkPerSymbol = 1 << 6;
+
+        /* Thrown internally when the length analysis runs over budget. */
+        struct LengthsTooCostly {};
+
+        void charge(size_t& budget, size_t work) {
+            if (work > budget) throw LengthsTooCostly();
+            budget -= work;
+        }
+
+        /* Lengths of the strings a sequence of symbols derives, given the lengths for
+         * each nonterminal. If skip is given, that position is left out.
+         */
+        LengthSet lengthsOf(const vector<Symbol>& symbols, const map<char32_t, LengthSet>& lengths,
+                            size_t& budget, size_t skip = numeric_limits<size_t>::max()) {
+            auto result = Languages::singletonLength(0);
+            size_t terminals = 0;
+            for (size_t i = 0; i < symbols.size(); i++) {
+                if (i == skip) continue;
+
+                if (symbols[i].type == Symbol::Type::TERMINAL) {
+                    terminals++;
+                } else {
+                    const auto& theirs = lengths.at(symbols[i].ch);
+                    charge(budget, result.bits.size() + theirs.bits.size());
+                    result = sumOf(result, theirs);
+                }
+            }
+            charge(budget, result.bits.size() + terminals);
+            return sumOf(result, Languages::singletonLength(terminals));
+        }
+
+        /* One step of the system: the union, over each nonterminal's productions, of
+         * the lengths of those productions.
+         */
+        LengthSet lengthsOf(const ApproximationGrammar& grammar, char32_t nonterminal,
+                            const map<char32_t, LengthSet>& lengths, size_t& budget) {
+            LengthSet result;
+            for (const auto& rhs: grammar.productions.at(nonterminal)) {
+                auto ours = lengthsOf(rhs, lengths, budget);
+                charge(budget, result.bits.size() + ours.bits.size());
+                result = unionOf(result, ours);
+            }
+            return result;
+        }
+
+        /* Least solution of the linear system x = Mx + c, where matrix[i] holds the
+         * nonempty entries of row i of M.
+         *
+         * Think of this as an automaton over a one-letter alphabet, where variable i
+         * can move to variable j along a path with any length in M[i][j], or to a
+         * final state along a path with any length in c[i]. Each of those length sets
+         * becomes a lasso of states, one per bit. Then x[i] is the set of lengths of
+         * paths from i to the final state. Stepping backwards from the final state, the
+         * states that reach it in n + 1 steps are the ones with a step into those that
+         * reach it in n, and once that sequence of sets repeats, so does every x[i].
+         */
+        vector<LengthSet> solveLinear(const vector<map<size_t, LengthSet>>& matrix,
+                                      const vector<LengthSet>& constant, size_t& budget) {
+            const size_t kNone = numeric_limits<size_t>::max();
+            const size_t numVariables = constant.size();
+            const size_t final = numVariables;
+
+            /* Each state has at most one outgoing letter transition. Epsilon transitions
+             * are stored in reverse, since that's the direction we walk them.
+             */
+            vector<size_t>         next(numVariables + 1, kNone);
+            vector<vector<size_t>> epsilonInto(numVariables + 1);
+
+            auto addPaths = [&](size_t from, size_t to, const LengthSet& lengths) {
+                size_t first = next.size();
+                size_t count = lengths.threshold + lengths.period;
+                charge(budget, count);
+
+                for (size_t k = 0; k < count; k++) {
+                    next.push_back(first + k + 1);
+                    epsilonInto.emplace_back();
+                    if (lengths.bits[k]) epsilonInto[to].push_back(first + k);
+                }
+                next.back() = first + lengths.threshold;
+                epsilonInto[first].push_back(from);
+            };
+
+            for (size_t i = 0; i < numVariables; i++) {
+                for (const auto& entry: matrix[i]) {
+                    if (!isEmpty(entry.second)) addPaths(i, entry.first, entry.second);
+                }
+                if (!isEmpty(constant[i])) addPaths(i, final, constant[i]);
+            }
+
+            const size_t numStates = next.size();
+            auto has = [](const vector<uint64_t>& states, size_t state) {
+                return (states[state / 64] >> (state % 64)) & 1;
+            };
+            auto add = [](vector<uint64_t>& states, size_t state) {
+                states[state / 64] |= uint64_t(1) << (state % 64);
+            };
+            auto closeUnderEpsilons = [&](vector<uint64_t>& states) {
+                vector<size_t> worklist;
+                for (size_t state = 0; state < numStates; state++) {
+                    if (has(states, state)) worklist.push_back(state);
+                }
+                while (!worklist.empty()) {
+                    size_t state = worklist.back();
+                    worklist.pop_back();
+                    for (size_t source: epsilonInto[state]) {
+                        if (!has(states, source)) {
+                            add(states, source);
+                            worklist.push_back(source);
+                        }
+                    }
+                }
+            };
+
+            vector<uint64_t> curr((numStates + 63) / 64);
+            add(curr, final);
+            closeUnderEpsilons(curr);
+
+            map<vector<uint64_t>, size_t> seen;
+            vector<vector<uint64_t>> history;
+            while (!seen.count(curr)) {
+                if (history.size() >= Languages::kMaxLengthSetSize) throw Languages::LengthSetTooLarge();
+                charge(budget, numStates);
+
+                seen[curr] = history.size();
+                history.push_back(curr);
+
+                vector<uint64_t> prev(curr.size());
+                for (size_t state = 0; state < numStates; state++) {
+                    if (next[state] != kNone && has(curr, next[state])) add(prev, state);
+                }
+                closeUnderEpsilons(prev);
+                curr = std::move(prev);
+            }
+
+            vector<LengthSet> result;
+            for (size_t i = 0; i < numVariables; i++) {
+                vector<bool> bits;
+                for (const auto& states: history) {
+                    bits.push_back(has(states, i));
+                }
+                result.push_back(Languages::makeLengthSet(bits, seen[curr]));
+            }
+            return result;
+        }
+
+        /* Solves for the lengths of the nonterminals in one group, assuming everything
+         * the group depends on is already solved.
+         */
+        void solveGroup(const ApproximationGrammar& grammar, size_t group, map<char32_t, LengthSet>& lengths,
+                        size_t& budget) {
+            vector<char32_t> members(grammar.groups[group].begin(), grammar.groups[group].end());
+            map<char32_t, size_t> indexOf;
+            for (char32_t member: members) {
+                indexOf.insert(make_pair(member, indexOf.size()));
+                lengths[member] = LengthSet();
+            }
+
+            /* Nonrecursive? Then one step does it. */
+            if (grammar.recursion[group] == Recursion::NONE) {
+                lengths[members[0]] = lengthsOf(grammar, members[0], lengths, budget);
+                return;
+            }
+
+            /* Newton's method, starting from f(0). Each step linearizes the system
+             * around the current values (the derivative of a production with respect
+             * to one occurrence of a member is everything else in the production) and
+             * solves the linear system exactly. The values only ever grow, and once
+             * a step leaves them alone we're at the least solution.
+             */
+            auto step = [&] {
+                vector<LengthSet> next;
+                for (char32_t member: members) {
+                    next.push_back(lengthsOf(grammar, member, lengths, budget));
+                }
+                return next;
+            };
+
+            auto values = step();
+            for (size_t round = 0; round < members.size(); round++) {
+                bool changed = false;
+                for (size_t i = 0; i < members.size(); i++) {
+                    if (lengths[members[i]] != values[i]) changed = true;
+                    lengths[members[i]] = values[i];
+                }
+                if (!changed) return;
+
+                vector<map<size_t, LengthSet>> derivative(members.size());
+                for (size_t i = 0; i < members.size(); i++) {
+                    for (const auto& rhs: grammar.productions.at(members[i])) {
+                        for (size_t pos = 0; pos < rhs.size(); pos++) {
+                            if (rhs[pos].type == Symbol::Type::NONTERMINAL && indexOf.count(rhs[pos].ch)) {
+                                auto& entry = derivative[i][indexOf[rhs[pos].ch]];
+                                auto ours = lengthsOf(rhs, lengths, budget, pos);
+                                charge(budget, entry.bits.size() + ours.bits.size());
+                                entry = unionOf(entry, ours);
+                            }
+                        }
+                    }
+                }
+                values = solveLinear(derivative, step(), budget);
+            }
+
+            for (size_t i = 0; i < members.size(); i++) {
+                lengths[members[i]] = values[i];
+            }
+        }
+
+        /* Lengths of the strings the grammar generates, throwing LengthsTooCostly if
+         * that takes more than the given budget, or LengthSetTooLarge if the lengths of
+         * some nonterminal can't be represented.
+         */
+        LengthSet lengthsOf(const CFG& cfg, size_t budget) {
+            auto grammar = groupedGrammarFor(cfg);
+
+            /* Solve groups bottom-up. */
+            map<char32_t, LengthSet> lengths;
+            vector<bool> solved(grammar.groups.size());
+            function<void(size_t)> solve = [&](size_t group) {
+                if (solved[group]) return;
+                solved[group] = true;
+
+                for (char32_t member: grammar.groups[group]) {
+                    for (const auto& rhs: grammar.productions.at(member)) {
+                        for (const auto& symbol: rhs) {
+                            if (symbol.type == Symbol::Type::NONTERMINAL) solve(grammar.groupOf.at(symbol.ch));
+                        }
+                    }
+                }
+                solveGroup(grammar, group, lengths, budget);
+            };
+            solve(grammar.groupOf.at(grammar.start));
+
+            return lengths.at(grammar.start);
+        }
+
+        /* Lengths for a matcher or generator to filter by, or every length if working
+         * that out isn't worth it.
+         */
+        LengthSet lengthFilterFor(const CFG& cfg) {
+            size_t symbols = 0;
+            for (const auto& prod: cfg.productions) {
+                symbols += prod.replacement.size() + 1;
+            }
+
+            try {
+                return lengthsOf(cfg, symbols * kLengthFilterWorkPerSymbol);
+            } catch (const LengthsTooCostly &) {
+                return Languages::makeLengthSet({ true }, 0);
+            } catch (const Languages::LengthSetTooLarge &) {
+                return Languages::makeLengthSet({ true }, 0);
+            }
+        }
+
+        /* Wraps a matcher on decoded input so that it decodes each string once and
+         * rejects strings of impossible lengths before running the matcher.
+         */
+        Matcher lengthCheckedMatcherFor(const CFG& cfg, DecodedMatcher matcher) {
+            auto lengths  = lengthFilterFor(cfg);
+            auto alphabet = cfg.alphabet;
+            return [=](const string& str) {
+                auto input = utf8Decode(str, alphabet);
+                return lengths.contains(input.size()) && matcher(input);
+            };
+        }
+
+        /* LR(0) e-DFA Earley matcher that only parses strings that have a possible
+         * length and that the prefilter lets through.
+         */
+        Matcher prefilteredEarleyLR0MatcherFor(const CFG& cfg) {
+            auto lengths = lengthFilterFor(cfg);
+            auto filter  = regularPrefilterFor(cfg);
+            if (filter && acceptsEverything(*filter)) filter = nullptr;
+
+            auto state = eDFAMatcherStateFor(cfg);
+            return [=](const string& str) {
+                auto input = toSymbolIndices(*state, str);
+                if (!lengths.contains(input.size())) return false;
+                if (filter && !prefilterAccepts(*filter, input, state->eDFA.firstTerminal)) return false;
+                return eDFAMatch(*state, input).matches;
+            };
+        }
+    }
+
+    Languages::LengthSet lengthsOf(const CFG& cfg) {
+        return lengthsOf(cfg, numeric_limits<size_t>::max());
+    }
+
+    bool canGenerateLength(const CFG& cfg, size_t length) {
+        return lengthsOf(cfg).contains(length);
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                        Shortest Strings                            ***
+     **************************************************************************
+     **************************************************************************
+
+     To find a shortest string in a grammar's language, we use Knuth's
+     generalization of Dijkstra's algorithm ("A Generalization of Dijkstra's
+     Algorithm," 1977). Think of each production A -> X1 X2 ... Xk as a
+     function giving a length for A in terms of lengths for the Xi: the sum of
+     them, plus one for each terminal. Those functions are superior, in that
+     their result is never less than any argument, and that's all Dijkstra's
+     algorithm needs to work.
+
+     Each nonterminal gets its shortest length finalized in increasing order
+     of length. A production becomes a candidate for its nonterminal once all
+     the nonterminals in it are finalized, and we keep a priority queue of
+     candidates. Every production is examined once per nonterminal in it, so
+     this takes time O(|G| log |G|).
+
+     Recording which production gave each nonterminal its shortest length lets
+     us write out a shortest string afterwards. Each such production only uses
+     nonterminals finalized before its own, so expanding them always
+     terminates. Nonterminals that never get finalized are unproductive, and
+     in particular the language is empty exactly when the start symbol is one
+     of them.
+
+     *************************************************************************/
+
+    namespace {
+        /* Shortest length derivable from each productive nonterminal, and a
+         * production achieving it.
+         */
+        struct ShortestDerivations {
+            unordered_map<char32_t, size_t>            length;
+            unordered_map<char32_t, const Production*> best;
+        };
+
+        /* Lengths can grow exponentially in the size of the grammar, so we saturate. */
+        const size_t kTooLong = numeric_limits<size_t>::max();
+
+        /* Longest shortest string, in characters, that we're willing to write out. A grammar
+         * with A0 -> A1 A1, A1 -> A2 A2, ..., An -> a has a single string of length 2^n, so
+         * this is easy to pass with a small grammar.
+         */
+        const size_t kMaxShortestStringLength = 1 << 24;
+
+        size_t saturatingAdd(size_t lhs, size_t rhs) {
+            return lhs > kTooLong - rhs? kTooLong : lhs + rhs;
+        }
+
+        ShortestDerivations shortestDerivationsIn(const CFG& cfg) {
+            /* For each nonterminal, the productions it appears in, once per appearance. */
+            unordered_map<char32_t, vector<size_t>> uses;
+
+            /* For each production, how many nonterminal appearances aren't finalized yet,
+             * and the length so far counting those that are.
+             */
+            vector<size_t> remaining(cfg.productions.size());
+            vector<size_t> length(cfg.productions.size());
+
+            /* Candidates, as (length, production index), shortest first. */
+            priority_queue<pair<size_t, size_t>, vector<pair<size_t, size_t>>, greater<pair<size_t, size_t>>> candidates;
+
+            for (size_t i = 0; i < cfg.productions.size(); i++) {
+                for (const auto& symbol: cfg.productions[i].replacement) {
+                    if (symbol.type == Symbol::Type::TERMINAL) {
+                        length[i]++;
+                    } else {
+                        remaining[i]++;
+                        uses[symbol.ch].push_back(i);
+                    }
+                }
+                if (remaining[i] == 0) candidates.push(make_pair(length[i], i));
+            }
+
+            ShortestDerivations result;
+            while (!candidates.empty()) {
+                auto curr = candidates.top();
+                candidates.pop();
+
+                const auto& production = cfg.productions[curr.second];
+                if (result.length.count(production.nonterminal)) continue;
+
+                result.length[production.nonterminal] = curr.first;
+                result.best[production.nonterminal]   = &production;
+
+                for (size_t use: uses[production.nonterminal]) {
+                    length[use] = saturatingAdd(length[use], curr.first);
+                    if (--remaining[use] == 0) candidates.push(make_pair(length[use], use));
+                }
+            }
+
+            return result;
+        }
+
+        /* Appends a shortest string derivable from the given productive nonterminal. */
+        void writeShortestString(const ShortestDerivations& derivations, char32_t nonterminal, string& out) {
+            for (const auto& symbol: derivations.best.at(nonterminal)->replacement) {
+                if (symbol.type == Symbol::Type::TERMINAL) {
+                    out += toUTF8(symbol.ch);
+                } else {
+                    writeShortestString(derivations, symbol.ch, out);
+                }
+            }
+        }
+    }
+
+    bool shortestStringIn(const CFG& cfg, string& result) {
+        auto derivations = shortestDerivationsIn(cfg);
+
+        auto itr = derivations.length.find(cfg.startSymbol);
+        if (itr == derivations.length.end()) return false;
+        if (itr->second > kMaxShortestStringLength) throw runtime_error("Shortest string is too long to write out.");
+
+        result.clear();
+        writeShortestString(derivations, cfg.startSymbol, result);
+        return true;
+    }
+
+    bool isEmpty(const CFG& cfg) {
+        return !shortestDerivationsIn(cfg).length.count(cfg.startSymbol);
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***             Deterministic (LL(1) / LALR(1)) Recognizers            ***
+     **************************************************************************
+     **************************************************************************
+
+     Many of the grammars we work with are actually deterministic, in which case
+     there's no need to fire up a general-purpose parser. The logic here
+     classifies grammars as LL(1) or LALR(1) and, when they are, builds a
+     table-driven recognizer that runs in linear time and stores just a single
+     integer per stack frame.
+
+     The LL(1) tables come from the usual FIRST/FOLLOW computation. The LALR(1)
+     tables are formed by building the canonical LR(0) automaton and then
+     propagating lookaheads through it with a worklist. This gives the same
+     result as building the LR(1) automaton and merging states with the same
+     core, but without ever building the (much larger) LR(1) automaton. The LR(0)
+     automaton itself can be exponentially large, so we give up on grammars
+     whose automata run past a fixed budget and treat them as not LALR(1).
+
+     Both constructions work on the cleaned version of the grammar, since
+     useless rules can introduce conflicts that can never actually arise.
+
+     *************************************************************************/
+
+    namespace {
+        /* Terminal used to represent the end of the input. This lies outside the
+         * range of valid Unicode characters, so it can't collide with anything.
+         */
+        const char32_t kEndMarker = 0x110000;
+
+        /* FOLLOW sets for each nonterminal. The end of the input is represented by
+         * kEndMarker.
+         */
+        TerminalSets followSetsOf(const CFG& cfg, const Nulls& nullable, const TerminalSets& first) {
+            TerminalSets result;
+            for (char32_t nonterminal: cfg.nonterminals) {
+                (void) result[nonterminal];
+            }
+            result[cfg.startSymbol].insert(kEndMarker);
+
+            bool changed;
+            do {
+                changed = false;
+                for (const auto& p: cfg.productions) {
+                    for (auto itr = p.replacement.begin(); itr != p.replacement.end(); ++itr) {
+                        if (itr->type == Symbol::Type::TERMINAL) continue;
+
+                        /* For A -> alpha B beta, FOLLOW(B) includes FIRST(beta), plus FOLLOW(A)
+                         * if beta is nullable.
+                         */
+                        auto& ours = result[itr->ch];
+                        size_t oldSize = ours.size();
+                        if (addFirstOf(itr + 1, p.replacement.end(), first, nullable, ours)) {
+                            const auto& theirs = result[p.nonterminal];
+                            ours.insert(theirs.begin(), theirs.end());
+                        }
+                        changed |= (ours.size() != oldSize);
+                    }
+                }
+            } while (changed);
+
+            return result;
+        }
+
+        /* Numbering of terminals used by the deterministic recognizers. Terminals are
+         * numbered 0, 1, 2, ..., in alphabet order, and the end marker comes last.
+         */
+        map<char32_t, uint32_t> terminalIndicesFor(const CFG& cfg) {
+            map<char32_t, uint32_t> result;
+            for (char32_t ch: cfg.alphabet) {
+                result.insert(make_pair(ch, uint32_t(result.size())));
+            }
+            result.insert(make_pair(kEndMarker, uint32_t(result.size())));
+            return result;
+        }
+
+        /* Translates an input string into terminal indices, appending the end marker. */
+        vector<uint32_t> toTerminalIndices(const string& str,
+                                           const Languages::Alphabet& alphabet,
+                                           const map<char32_t, uint32_t>& indices) {
+            vector<uint32_t> result;
+            for (char32_t ch: utf8Decode(str, alphabet)) {
+                result.push_back(indices.at(ch));
+            }
+            result.push_back(indices.at(kEndMarker));
+            return result;
+        }
+
+        /* Sentinel used in the tables below to mean "there's nothing here." */
+        const uint32_t kNoEntry = numeric_limits<uint32_t>::max();
+
+        /* LL(1) parsing table. Symbols on the stack are encoded as integers: terminals
+         * use their terminal indices, and nonterminal k is encoded as numTerminals + k.
+         */
+        struct LL1Table {
+            map<char32_t, uint32_t> terminals;
+            uint32_t numTerminals;
+            uint32_t numNonterminals;
+            uint32_t start;
+
+            /* Encoded right-hand sides, stored reversed so they can be pushed in order. */
+            vector<vector<uint32_t>> productions;
+
+            /* Nonterminal x terminal -> production index (or kNoEntry) */
+            vector<uint32_t> table;
+        };
+
+        /* Attempts to build an LL(1) table for the given grammar, returning whether
+         * the grammar was LL(1).
+         */
+        bool buildLL1Table(const CFG& input, LL1Table& result) {
+            auto cfg      = clean(input);
+            auto nullable = nullablesOf(cfg);
+            auto first    = firstSetsOf(cfg, nullable);
+            auto follow   = followSetsOf(cfg, nullable, first);
+
+            result.terminals    = terminalIndicesFor(cfg);
+            result.numTerminals = result.terminals.size();
+
+            /* Number the nonterminals. */
+            map<char32_t, uint32_t> nonterminals;
+            for (char32_t ch: cfg.nonterminals) {
+                nonterminals.insert(make_pair(ch, uint32_t(nonterminals.size())));
+            }
+            result.numNonterminals = nonterminals.size();
+            result.start = result.numTerminals + nonterminals.at(cfg.startSymbol);
+
+            result.table.assign(result.numNonterminals * result.numTerminals, kNoEntry);
+            for (const auto& p: cfg.productions) {
+                /* Encode the production. */
+                vector<uint32_t> encoded;
+                for (auto itr = p.replacement.rbegin(); itr != p.replacement.rend(); ++itr) {
+                    encoded.push_back(itr->type == Symbol::Type::TERMINAL? result.terminals.at(itr->ch)
+                                                                         : result.numTerminals + nonterminals.at(itr->ch));
+                }
+                uint32_t index = result.productions.size();
+                result.productions.push_back(encoded);
+
+                /* Predict this production on FIRST(alpha), plus FOLLOW(A) if alpha is nullable. */
+                set<char32_t> predict;
+                if (addFirstOf(p.replacement.begin(), p.replacement.end(), first, nullable, predict)) {
+                    predict.insert(follow.at(p.nonterminal).begin(), follow.at(p.nonterminal).end());
+                }
+
+                for (char32_t ch: predict) {
+                    auto& entry = result.table[nonterminals.at(p.nonterminal) * result.numTerminals + result.terminals.at(ch)];
+                    if (entry != kNoEntry) return false; // Conflict!
+                    entry = index;
+                }
+            }
+
+            return true;
+        }
+
+        /* Table-driven LL(1) recognizer. */
+        bool ll1Accepts(const LL1Table& table, const vector<uint32_t>& input) {
+            vector<uint32_t> stack = { table.numTerminals - 1, table.start }; // End marker, then start symbol
+            size_t pos = 0;
+
+            while (!stack.empty()) {
+                uint32_t top = stack.back();
+                stack.pop_back();
+
+                /* Terminals must match the input. */
+                if (top < table.numTerminals) {
+                    if (top != input[pos]) return false;
+                    pos++;
+                }
+                /* Nonterminals get expanded. */
+                else {
+                    uint32_t prod = table.table[(top - table.numTerminals) * table.numTerminals + input[pos]];
+                    if (prod == kNoEntry) return false;
+                    stack.insert(stack.end(), table.productions[prod].begin(), table.productions[prod].end());
+                }
+            }
+
+            return pos == input.size();
+        }
+
+        /* LALR(1) parsing tables. Actions are encoded as integers:
+         *
+         *   kNoEntry:      error
+         *   kAccept:       accept
+         *   even values:   shift to state (value / 2)
+         *   odd values:    reduce by production (value / 2)
+         */
+        struct LALR1Table {
+            map<char32_t, uint32_t> terminals;
+            uint32_t numTerminals;
+            uint32_t numNonterminals;
+
+            /* State x terminal -> action. */
+            vector<uint32_t> action;
+
+            /* State x nonterminal -> state (or kNoEntry) */
+            vector<uint32_t> goTo;
+
+            /* Length and (numbered) left-hand side of each production. */
+            vector<uint32_t> length;
+            vector<uint32_t> lhs;
+        };
+
+        const uint32_t kAccept = kNoEntry - 1;
+
+        /* Budgets for the LR(0) automaton. Some small grammars have exponentially many
+         * LR(0) states (for example, S -> A | B with A -> aaA | eps and B -> aaaB | eps
+         * and more cycles with coprime lengths), so past these we just report that the
+         * grammar isn't LALR(1) and let the caller fall back on a general parser.
+         */
+        const size_t kMaxLALRStates = 1 << 12;
+        const size_t kMaxLALRItems  = 1 << 20; // Kernel and closure items over all states
+
+        /* Attempts to build LALR(1) tables for the given grammar, returning whether the
+         * grammar was LALR(1) and within budget.
+         *
+         * LR(0) items are numbered consecutively, production by production, and each
+         * state is identified by its sorted list of kernel items. Lookaheads live on the
+         * nodes of a propagation graph, which has one node per kernel item of each state
+         * and one per nonterminal transition (that is, per nonterminal predicted in each
+         * state), as in DeRemer and Pennello's construction. Every closure item
+         * B -> .gamma in a state gets the lookaheads of that state's node for B, and
+         * edges carry lookaheads along shifts and predictions. Terminals that are
+         * spontaneously generated (FIRST of what follows a predicted nonterminal) seed
+         * the nodes, and a worklist pushes bitsets along the edges. Since lookaheads only
+         * ever grow, we can check for conflicts as they arrive and stop at the first one.
+         */
+        bool buildLALR1Table(const CFG& input, LALR1Table& result) {
+            /* The augmented grammar S' -> S. We keep this in a local, since the items below
+             * hold pointers into it.
+             */
+            auto cfg      = addUniqueStartTo(clean(input));
+            auto nullable = nullablesOf(cfg);
+            auto first    = firstSetsOf(cfg, nullable);
+
+            result.terminals    = terminalIndicesFor(cfg);
+            result.numTerminals = result.terminals.size();
+            const size_t numWords = (result.numTerminals + 63) / 64;
+
+            map<char32_t, uint32_t> nonterminals;
+            for (char32_t ch: cfg.nonterminals) {
+                nonterminals.insert(make_pair(ch, uint32_t(nonterminals.size())));
+            }
+            result.numNonterminals = nonterminals.size();
+
+            /* Productions of each nonterminal, and the numbering of the LR(0) items. Item
+             * itemBase[p] + k is production p with the dot before symbol k.
+             */
+            vector<vector<uint32_t>> byLHS(result.numNonterminals);
+            vector<uint32_t> itemBase, itemProd;
+            for (const auto& p: cfg.productions) {
+                uint32_t index = result.length.size();
+                result.length.push_back(p.replacement.size());
+                result.lhs.push_back(nonterminals.at(p.nonterminal));
+                byLHS[result.lhs.back()].push_back(index);
+
+                itemBase.push_back(itemProd.size());
+                itemProd.insert(itemProd.end(), p.replacement.size() + 1, index);
+            }
+            const uint32_t acceptProd = byLHS[nonterminals.at(cfg.startSymbol)][0];
+
+            /* Symbols are numbered as in the LL(1) table: terminals first, then nonterminals. */
+            auto symbolOf = [&](uint32_t item) {
+                const auto& symbol = cfg.productions[itemProd[item]].replacement[item - itemBase[itemProd[item]]];
+                return symbol.type == Symbol::Type::TERMINAL? result.terminals.at(symbol.ch)
+                                                            : result.numTerminals + nonterminals.at(symbol.ch);
+            };
+            auto atEnd = [&](uint32_t item) {
+                return item - itemBase[itemProd[item]] == result.length[itemProd[item]];
+            };
+
+            /* For each item A -> alpha . X beta, FIRST(beta) and whether beta is nullable. */
+            vector<uint64_t> suffixFirst(itemProd.size() * numWords);
+            vector<bool>     suffixNullable(itemProd.size());
+            for (uint32_t prod = 0; prod < cfg.productions.size(); prod++) {
+                const auto& rhs = cfg.productions[prod].replacement;
+                TerminalBitset bits(numWords);
+                bool isNullable = true;
+                for (size_t k = rhs.size(); k > 0; k--) {
+                    uint32_t item = itemBase[prod] + k - 1;
+                    copy(bits.begin(), bits.end(), suffixFirst.begin() + item * numWords);
+                    suffixNullable[item] = isNullable;
+
+                    const auto& symbol = rhs[k - 1];
+                    if (symbol.type == Symbol::Type::TERMINAL) {
+                        fill(bits.begin(), bits.end(), 0);
+                        include(bits, result.terminals.at(symbol.ch));
+                        isNullable = false;
+                    } else {
+                        if (!nullable.count(symbol.ch)) {
+                            fill(bits.begin(), bits.end(), 0);
+                            isNullable = false;
+                        }
+                        for (char32_t ch: first[symbol.ch]) {
+                            include(bits, result.terminals.at(ch));
+                        }
+                    }
+                }
+            }
+
+            /* Build the canonical LR(0) automaton. For each state we store its kernel and
+             * the nonterminals it predicts; the closure items are the productions of the
+             * predicted nonterminals with the dot at the start.
+             */
+            vector<vector<uint32_t>> kernels, predicted;
+            vector<map<uint32_t, uint32_t>> transitions; // Symbol -> state
+            map<vector<uint32_t>, uint32_t> known;
+            size_t totalItems = 0;
+
+            vector<uint32_t> stamp(result.numNonterminals, kNoEntry);
+            auto stateFor = [&](vector<uint32_t> kernel) {
+                auto itr = known.find(kernel);
+                if (itr != known.end()) return itr->second;
+
+                uint32_t index = kernels.size();
+                known.insert(make_pair(kernel, index));
+                kernels.push_back(std::move(kernel));
+                transitions.emplace_back();
+
+                /* Find the predicted nonterminals. */
+                vector<uint32_t> ours;
+                auto predict = [&](uint32_t item) {
+                    if (atEnd(item)) return;
+                    uint32_t symbol = symbolOf(item);
+                    if (symbol < result.numTerminals) return;
+
+                    uint32_t nonterminal = symbol - result.numTerminals;
+                    if (stamp[nonterminal] != index && !byLHS[nonterminal].empty()) {
+                        stamp[nonterminal] = index;
+                        ours.push_back(nonterminal);
+                    }
+                };
+                for (uint32_t item: kernels.back()) {
+                    predict(item);
+                }
+                for (size_t i = 0; i < ours.size(); i++) {
+                    for (uint32_t prod: byLHS[ours[i]]) {
+                        predict(itemBase[prod]);
+                        totalItems++;
+                    }
+                }
+                totalItems += kernels.back().size();
+                predicted.push_back(std::move(ours));
+                return index;
+            };
+
+            stateFor({ itemBase[acceptProd] });
+            for (uint32_t state = 0; state < kernels.size(); state++) {
+                if (kernels.size() > kMaxLALRStates || totalItems > kMaxLALRItems) return false;
+
+                /* Group items by the symbol after the dot. */
+                map<uint32_t, vector<uint32_t>> successors;
+                auto shift = [&](uint32_t item) {
+                    if (!atEnd(item)) successors[symbolOf(item)].push_back(item + 1);
+                };
+                for (uint32_t item: kernels[state]) {
+                    shift(item);
+                }
+                for (uint32_t nonterminal: predicted[state]) {
+                    for (uint32_t prod: byLHS[nonterminal]) {
+                        shift(itemBase[prod]);
+                    }
+                }
+
+                for (auto& entry: successors) {
+                    sort(entry.second.begin(), entry.second.end());
+                    uint32_t next = stateFor(std::move(entry.second));
+                    transitions[state][entry.first] = next;
+                }
+            }
+
+            /* Number the nodes of the propagation graph: first the kernel items of each
+             * state, then its predicted nonterminals.
+             */
+            vector<uint32_t> kernelNodes(kernels.size() + 1), predictedNodes(kernels.size());
+            for (uint32_t state = 0; state < kernels.size(); state++) {
+                kernelNodes[state + 1] = kernelNodes[state] + kernels[state].size();
+            }
+            uint32_t numNodes = kernelNodes.back();
+            for (uint32_t state = 0; state < kernels.size(); state++) {
+                predictedNodes[state] = numNodes;
+                numNodes += predicted[state].size();
+            }
+
+            /* Node for the kernel item in the given state. */
+            auto kernelNodeFor = [&](uint32_t state, uint32_t item) {
+                const auto& kernel = kernels[state];
+                return kernelNodes[state] + uint32_t(lower_bound(kernel.begin(), kernel.end(), item) - kernel.begin());
+            };
+
+            /* Edges of the graph, lookaheads seeded on each node, and reductions: a node, a
+             * state, and a production to reduce there on the node's lookaheads.
+             */
+            vector<pair<uint32_t, uint32_t>> edges;
+            vector<uint64_t> seeds(size_t(numNodes) * numWords);
+            struct Reduction {
+                uint32_t node, state, production;
+            };
+            vector<Reduction> reductions;
+
+            vector<uint32_t> slot(result.numNonterminals);
+            for (uint32_t state = 0; state < kernels.size(); state++) {
+                for (uint32_t i = 0; i < predicted[state].size(); i++) {
+                    slot[predicted[state][i]] = predictedNodes[state] + i;
+                }
+
+                /* An item with lookaheads at the given node: it shifts into the successor
+                 * state, predicts the nonterminal after the dot, or reduces.
+                 */
+                auto link = [&](uint32_t node, uint32_t item) {
+                    if (atEnd(item)) {
+                        reductions.push_back({ node, state, itemProd[item] });
+                        return;
+                    }
+
+                    uint32_t symbol = symbolOf(item);
+                    edges.emplace_back(node, kernelNodeFor(transitions[state].at(symbol), item + 1));
+
+                    if (symbol >= result.numTerminals && !byLHS[symbol - result.numTerminals].empty()) {
+                        uint32_t target = slot[symbol - result.numTerminals];
+                        for (size_t w = 0; w < numWords; w++) {
+                            seeds[target * numWords + w] |= suffixFirst[item * numWords + w];
+                        }
+                        if (suffixNullable[item]) edges.emplace_back(node, target);
+                    }
+                };
+
+                for (uint32_t i = 0; i < kernels[state].size(); i++) {
+                    link(kernelNodes[state] + i, kernels[state][i]);
+                }
+                for (uint32_t i = 0; i < predicted[state].size(); i++) {
+                    for (uint32_t prod: byLHS[predicted[state][i]]) {
+                        link(predictedNodes[state] + i, itemBase[prod]);
+                    }
+                }
+            }
+            include(seeds, result.terminals.at(kEndMarker)); // The first node is S' -> .S in the start state.
+
+            /* Edges in compressed sparse row form, and reductions by node. */
+            vector<uint32_t> edgeStart(numNodes + 1), edgeTargets(edges.size());
+            for (const auto& edge: edges) {
+                edgeStart[edge.first + 1]++;
+            }
+            partial_sum(edgeStart.begin(), edgeStart.end(), edgeStart.begin());
+            {
+                auto next = edgeStart;
+                for (const auto& edge: edges) {
+                    edgeTargets[next[edge.first]++] = edge.second;
+                }
+            }
+
+            vector<uint32_t> reductionStart(numNodes + 1);
+            sort(reductions.begin(), reductions.end(), [](const Reduction& lhs, const Reduction& rhs) {
+                return lhs.node < rhs.node;
+            });
+            for (const auto& reduction: reductions) {
+                reductionStart[reduction.node + 1]++;
+            }
+            partial_sum(reductionStart.begin(), reductionStart.end(), reductionStart.begin());
+
+            /* Terminals each state shifts, and terminals it already reduces on. */
+            vector<uint64_t> shifts(kernels.size() * numWords), claimed(kernels.size() * numWords);
+            for (uint32_t state = 0; state < kernels.size(); state++) {
+                for (const auto& entry: transitions[state]) {
+                    if (entry.first < result.numTerminals) {
+                        shifts[state * numWords + entry.first / 64] |= uint64_t(1) << (entry.first % 64);
+                    }
+                }
+            }
+
+            /* Propagate. Each node's lookaheads are added to its reductions' states the
+             * moment they arrive, which is where conflicts show up.
+             */
+            vector<uint64_t> lookaheads(size_t(numNodes) * numWords);
+            vector<bool> queued(numNodes);
+            queue<uint32_t> worklist;
+            vector<uint64_t> added(numWords);
+
+            auto addTo = [&](uint32_t node, const uint64_t* bits) {
+                bool any = false;
+                for (size_t w = 0; w < numWords; w++) {
+                    added[w] = bits[w] & ~lookaheads[node * numWords + w];
+                    lookaheads[node * numWords + w] |= added[w];
+                    any |= (added[w] != 0);
+                }
+                if (!any) return true;
+
+                for (uint32_t r = reductionStart[node]; r < reductionStart[node + 1]; r++) {
+                    uint32_t state = reductions[r].state;
+                    for (size_t w = 0; w < numWords; w++) {
+                        if (added[w] & (shifts[state * numWords + w] | claimed[state * numWords + w])) {
+                            return false; // Shift/reduce or reduce/reduce conflict!
+                        }
+                        claimed[state * numWords + w] |= added[w];
+                    }
+                }
+
+                if (!queued[node]) {
+                    queued[node] = true;
+                    worklist.push(node);
+                }
+                return true;
+            };
+
+            for (uint32_t node = 0; node < numNodes; node++) {
+                if (!addTo(node, &seeds[node * numWords])) return false;
+            }
+            while (!worklist.empty()) {
+                uint32_t node = worklist.front();
+                worklist.pop();
+                queued[node] = false;
+
+                for (uint32_t e = edgeStart[node]; e < edgeStart[node + 1]; e++) {
+                    if (!addTo(edgeTargets[e], &lookaheads[node * numWords])) return false;
+                }
+            }
+
+            /* Fill in the tables. There are no conflicts left to find. */
+            result.action.assign(kernels.size() * result.numTerminals, kNoEntry);
+            result.goTo.assign(kernels.size() * result.numNonterminals, kNoEntry);
+
+            for (uint32_t state = 0; state < kernels.size(); state++) {
+                for (const auto& entry: transitions[state]) {
+                    if (entry.first < result.numTerminals) {
+                        result.action[state * result.numTerminals + entry.first] = 2 * entry.second;
+                    } else {
+                        result.goTo[state * result.numNonterminals + entry.first - result.numTerminals] = entry.second;
+                    }
+                }
+            }
+
+            for (const auto& reduction: reductions) {
+                /* Reducing S' -> S at the end of the input means we're done. */
+                uint32_t value = reduction.production == acceptProd? kAccept : 2 * reduction.production + 1;
+                for (uint32_t terminal = 0; terminal < result.numTerminals; terminal++) {
+                    if (lookaheads[reduction.node * numWords + terminal / 64] & (uint64_t(1) << (terminal % 64))) {
+                        result.action[reduction.state * result.numTerminals + terminal] = value;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        /* Table-driven LALR(1) recognizer. */
+        bool lalr1Accepts(const LALR1Table& table, const vector<uint32_t>& input) {
+            vector<uint32_t> stack = { 0 };
+
+            for (uint32_t symbol: input) {
+                while (true) {
+                    uint32_t action = table.action[stack.back() * table.numTerminals + symbol];
+                    if (action == kNoEntry) return false;
+                    if (action == kAccept)  return true;
+
+                    /* Shift: consume this symbol, move to the next. */
+                    if (action % 2 == 0) {
+                        stack.push_back(action / 2);
+                        break;
+                    }
+
+                    /* Reduce: pop the right-hand side, then follow the GOTO. */
+                    uint32_t prod = action / 2;
+                    stack.resize(stack.size() - table.length[prod]);
+
+                    uint32_t next = table.goTo[stack.back() * table.numNonterminals + table.lhs[prod]];
+                    if (next == kNoEntry) abort(); // Logic error!
+                    stack.push_back(next);
+                }
+            }
+
+            /* We can't run out of input without accepting or rejecting first, since the
+             * end marker never gets shifted.
+             */
+            abort(); // Logic error!
+        }
+
+        Matcher ll1MatcherFor(const Languages::Alphabet& alphabet, shared_ptr<const LL1Table> table) {
+            return [=](const string& str) {
+                return ll1Accepts(*table, toTerminalIndices(str, alphabet, table->terminals));
+            };
+        }
+
+        Matcher lalr1MatcherFor(const Languages::Alphabet& alphabet, shared_ptr<const LALR1Table> table) {
+            return [=](const string& str) {
+                return lalr1Accepts(*table, toTerminalIndices(str, alphabet, table->terminals));
+            };
+        }
+
+        Matcher ll1MatcherFor(const CFG& cfg) {
+            auto table = make_shared<LL1Table>();
+            if (!buildLL1Table(cfg, *table)) throw runtime_error("Grammar is not LL(1).");
+            return ll1MatcherFor(cfg.alphabet, table);
+        }
+
+        Matcher lalr1MatcherFor(const CFG& cfg) {
+            auto table = make_shared<LALR1Table>();
+            if (!buildLALR1Table(cfg, *table)) throw runtime_error("Grammar is not LALR(1).");
+            return lalr1MatcherFor(cfg.alphabet, table);
+        }
+
+        /* Picks the fastest special-purpose matcher that works for the grammar, returning
+         * its type along with the matcher, so the tables only get built once. If none of
+         * them work, the type is EARLEY_LR0 and the matcher is empty.
+         */
+        pair<MatcherType, Matcher> fastMatcherFor(const CFG& cfg) {
+            auto dfa = regularDFAFor(cfg);
+            if (dfa) return make_pair(MatcherType::DFA, dfaMatcherFor(cfg.alphabet, dfa));
+
+            auto ll1 = make_shared<LL1Table>();
+            if (buildLL1Table(cfg, *ll1)) return make_pair(MatcherType::LL1, ll1MatcherFor(cfg.alphabet, ll1));
+
+            auto lalr1 = make_shared<LALR1Table>();
+            if (buildLALR1Table(cfg, *lalr1)) return make_pair(MatcherType::LALR1, lalr1MatcherFor(cfg.alphabet, lalr1));
+
+            return make_pair(MatcherType::EARLEY_LR0, Matcher());
+        }
+
+        /* Picks the fastest matcher that works for the grammar. */
+        Matcher automaticMatcherFor(const CFG& cfg) {
+            auto fast = fastMatcherFor(cfg);
+            if (fast.second) return fast.second;
+
+            return prefilteredEarleyLR0MatcherFor(cfg);
+        }
+    }
+
+    bool isLL1(const CFG& cfg) {
+        LL1Table table;
+        return buildLL1Table(cfg, table);
+    }
+
+    bool isLALR1(const CFG& cfg) {
+        LALR1Table table;
+        return buildLALR1Table(cfg, table);
+    }
+
+    MatcherType matcherTypeFor(const CFG& cfg) {
+        return fastMatcherFor(cfg).first;
+    }
+
+    ostream& operator<< (ostream& out, MatcherType type) {
+        switch (type) {
+            case MatcherType::AUTOMATIC:    return out << "Automatic";
+            case MatcherType::LL1:          return out << "LL(1)";
+            case MatcherType::LALR1:        return out << "LALR(1)";
+            case MatcherType::EARLEY_LR0:   return out << "Earley (LR(0) e-DFA)";
+            case MatcherType::EARLEY:       return out << "Earley";
+            case MatcherType::CYK:          return out << "CYK";
+            case MatcherType::PARALLEL_CYK: return out << "Parallel CYK";
+            case MatcherType::DFA:          return out << "DFA";
+            default:                        return out << "Unknown";
+        }
+    }
+
+    DetailedMatcher detailedMatcherFor(const CFG& cfg) {
+        return earleyLR0DetailedMatcherFor(cfg);
+    }
+
+    BatchMatcher batchMatcherFor(const CFG& cfg) {
+        return earleyLR0BatchMatcherFor(cfg);
+    }
+
+    BatchMatcher trieBatchMatcherFor(const CFG& cfg) {
+        return earleyLR0TrieBatchMatcherFor(cfg);
+    }
+
+    namespace {
+        Matcher uncachedMatcherFor(const CFG& cfg, MatcherType type) {
+            if (type == MatcherType::AUTOMATIC) {
+                return automaticMatcherFor(cfg);
+            } else if (type == MatcherType::LL1) {
+                return ll1MatcherFor(cfg);
+            } else if (type == MatcherType::LALR1) {
+                return lalr1MatcherFor(cfg);
+            } else if (type == MatcherType::EARLEY) {
+                return lengthCheckedMatcherFor(cfg, earleyMatcherFor(cfg));
+            } else if (type == MatcherType::CYK) {
+                return lengthCheckedMatcherFor(cfg, cykMatcherFor(cfg));
+            } else if (type == MatcherType::PARALLEL_CYK) {
+                return lengthCheckedMatcherFor(cfg, parallelCYKMatcherFor(cfg));
+            } else if (type == MatcherType::EARLEY_LR0) {
+                return prefilteredEarleyLR0MatcherFor(cfg);
+            } else if (type == MatcherType::DFA) {
+                return dfaMatcherFor(cfg);
+            } else {
+                throw runtime_error("Unknown matcher type.");
+            }
+        }
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                  Canonical Forms and Hashing                       ***
+     **************************************************************************
+     **************************************************************************
+
+     Two grammars that differ only in what their nonterminals are called, the
+     order of their productions, or rules that can never be used ought to be
+     treated as the same grammar. The canonical form of a grammar is obtained
+     by cleaning it, naming its nonterminals in the order a traversal from the
+     start symbol first sees them, and sorting what's left.
+
+     The hard part is making that traversal independent of the original names,
+     since it has to decide what order to look at each nonterminal's
+     productions in. We use color refinement, as in graph canonization: every
+     nonterminal starts out the same color (apart from the start symbol), and
+     then each round recolors every nonterminal by its old color along with
+     the sorted list of its productions written in terms of the old colors,
+     until the number of colors stops changing. Colors are numbered in sorted
+     order of what they stand for, so they never depend on names. The
+     traversal then visits productions in order of their colored form.
+
+     Refinement can't tell apart nonterminals that are distinct but perfectly
+     symmetric, in which case the traversal falls back on the input order
+     among them. That takes a fairly contrived grammar; for anything else,
+     grammars that are the same up to renaming and reordering have identical
+     canonical forms.
+
+     The hash is MurmurHash3 (x64, 128-bit) of a byte serialization of the
+     canonical form, which is written out in little-endian order so that the
+     hash is the same on every platform.
+
+     *************************************************************************/
+
+    namespace {
+        /* Appends a character to a serialization, as four little-endian bytes. */
+        void serializeChar(string& out, char32_t ch) {
+            for (size_t i = 0; i < 4; i++) {
+                out += char((ch >> (8 * i)) & 0xFF);
+            }
+        }
+
+        /* Byte serialization of a grammar's alphabet, nonterminals, start symbol, and
+         * sorted, deduplicated productions. Lists end with a value that can't be a
+         * character.
+         */
+        string serializationOf(const CFG& cfg) {
+            const char32_t kEndOfList = numeric_limits<char32_t>::max();
+
+            string result;
+            for (char32_t ch: cfg.alphabet) serializeChar(result, ch);
+            serializeChar(result, kEndOfList);
+            for (char32_t ch: cfg.nonterminals) serializeChar(result, ch);
+            serializeChar(result, kEndOfList);
+            serializeChar(result, cfg.startSymbol);
+
+            set<Production> productions(cfg.productions.begin(), cfg.productions.end());
+            for (const auto& prod: productions) {
+                serializeChar(result, prod.nonterminal);
+                for (const auto& symbol: prod.replacement) {
+                    serializeChar(result, char32_t(symbol.type));
+                    serializeChar(result, symbol.ch);
+                }
+                serializeChar(result, kEndOfList);
+            }
+            return result;
+        }
+
+        /* A production's right-hand side, written with terminals as themselves and
+         * nonterminals as their colors. Terminals and colors are tagged so they can't
+         * collide.
+         */
+        vector<pair<int, size_t>> coloredFormOf(const vector<Symbol>& rhs, const map<char32_t, size_t>& color) {
+            vector<pair<int, size_t>> result;
+            for (const auto& symbol: rhs) {
+                if (symbol.type == Symbol::Type::TERMINAL) {
+                    result.emplace_back(0, symbol.ch);
+                } else {
+                    result.emplace_back(1, color.at(symbol.ch));
+                }
+            }
+            return result;
+        }
+
+        /* Color refinement. Returns the stable coloring. */
+        map<char32_t, size_t> refinedColorsOf(const CFG& cfg, const map<char32_t, vector<const Production*>>& productionsOf) {
+            map<char32_t, size_t> color;
+            for (char32_t nonterminal: cfg.nonterminals) {
+                color[nonterminal] = (nonterminal == cfg.startSymbol)? 1 : 0;
+            }
+            size_t numColors = 0;
+
+            while (true) {
+                using Signature = pair<size_t, vector<vector<pair<int, size_t>>>>;
+                map<char32_t, Signature> signatures;
+                set<Signature> distinct;
+
+                for (char32_t nonterminal: cfg.nonterminals) {
+                    auto& signature = signatures[nonterminal];
+                    signature.first = color[nonterminal];
+                    for (const auto* prod: productionsOf.at(nonterminal)) {
+                        signature.second.push_back(coloredFormOf(prod->replacement, color));
+                    }
+                    sort(signature.second.begin(), signature.second.end());
+                    distinct.insert(signature);
+                }
+
+                /* Number colors in sorted order of their signatures. */
+                map<Signature, size_t> colorOf;
+                for (const auto& signature: distinct) {
+                    colorOf.insert(make_pair(signature, colorOf.size()));
+                }
+                for (char32_t nonterminal: cfg.nonterminals) {
+                    color[nonterminal] = colorOf[signatures[nonterminal]];
+                }
+
+                if (distinct.size() == numColors) break;
+                numColors = distinct.size();
+            }
+
+            return color;
+        }
+
+        /* MurmurHash3_x64_128. */
+        uint64_t rotateLeft(uint64_t value, int amount) {
+            return (value << amount) | (value >> (64 - amount));
+        }
+
+        uint64_t finalMix(uint64_t k) {
+            k ^= k >> 33;
+            k *= 0xFF51AFD7ED558CCDULL;
+            k ^= k >> 33;
+            k *= 0xC4CEB9FE1A85EC53ULL;
+            k ^= k >> 33;
+            return k;
+        }
+
+        GrammarHash murmurHash128(const string& data) {
+            const uint64_t c1 = 0x87C37B91114253D5ULL;
+            const uint64_t c2 = 0x4CF5AD432745937FULL;
+
+            /* Little-endian load of up to eight bytes. */
+            auto load = [&](size_t start, size_t count) {
+                uint64_t result = 0;
+                for (size_t i = 0; i < count; i++) {
+                    result |= uint64_t(uint8_t(data[start + i])) << (8 * i);
+                }
+                return result;
+            };
+
+            uint64_t h1 = 0, h2 = 0;
+            size_t numBlocks = data.size() / 16;
+            for (size_t block = 0; block < numBlocks; block++) {
+                uint64_t k1 = load(16 * block, 8);
+                uint64_t k2 = load(16 * block + 8, 8);
+
+                k1 *= c1; k1 = rotateLeft(k1, 31); k1 *= c2; h1 ^= k1;
+                h1 = rotateLeft(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+
+                k2 *= c2; k2 = rotateLeft(k2, 33); k2 *= c1; h2 ^= k2;
+                h2 = rotateLeft(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+            }
+
+            /* Leftover bytes. */
+            size_t tail = 16 * numBlocks, remaining = data.size() - tail;
+            if (remaining > 8) {
+                uint64_t k2 = load(tail + 8, remaining - 8);
+                k2 *= c2; k2 = rotateLeft(k2, 33); k2 *= c1; h2 ^= k2;
+            }
+            if (remaining > 0) {
+                uint64_t k1 = load(tail, min<size_t>(remaining, 8));
+                k1 *= c1; k1 = rotateLeft(k1, 31); k1 *= c2; h1 ^= k1;
+            }
+
+            h1 ^= data.size();
+            h2 ^= data.size();
+            h1 += h2;
+            h2 += h1;
+            h1 = finalMix(h1);
+            h2 = finalMix(h2);
+            h1 += h2;
+            h2 += h1;
+
+            return { h1, h2 };
+        }
+    }
+
+    CFG canonicalFormOf(const CFG& input) {
+        auto cfg = clean(input);
+        cfg.nonterminals.insert(cfg.startSymbol);
+
+        /* Dedupe productions up front so that duplicates don't affect the coloring. */
+        set<Production> unique(cfg.productions.begin(), cfg.productions.end());
+        cfg.productions.assign(unique.begin(), unique.end());
+
+        map<char32_t, vector<const Production*>> productionsOf;
+        for (char32_t nonterminal: cfg.nonterminals) {
+            productionsOf[nonterminal];
+        }
+        for (const auto& prod: cfg.productions) {
+            productionsOf[prod.nonterminal].push_back(&prod);
+        }
+
+        auto color = refinedColorsOf(cfg, productionsOf);
+
+        /* Number nonterminals in the order a breadth-first traversal first sees them,
+         * visiting each nonterminal's productions in order of their colored forms.
+         */
+        map<char32_t, char32_t> newName;
+        vector<char32_t> order;
+        auto visit = [&](char32_t nonterminal) {
+            if (!newName.count(nonterminal)) {
+                newName[nonterminal] = kBaseUnicode + order.size();
+                order.push_back(nonterminal);
+            }
+        };
+
+        visit(cfg.startSymbol);
+        for (size_t i = 0; i < order.size(); i++) {
+            auto prods = productionsOf.at(order[i]);
+            stable_sort(prods.begin(), prods.end(), [&](const Production* lhs, const Production* rhs) {
+                return coloredFormOf(lhs->replacement, color) < coloredFormOf(rhs->replacement, color);
+            });
+
+            for (const auto* prod: prods) {
+                for (const auto& symbol: prod->replacement) {
+                    if (symbol.type == Symbol::Type::NONTERMINAL) visit(symbol.ch);
+                }
+            }
+        }
+
+        CFG result;
+        result.alphabet    = cfg.alphabet;
+        result.startSymbol = newName.at(cfg.startSymbol);
+        for (char32_t nonterminal: order) {
+            result.nonterminals.insert(newName.at(nonterminal));
+        }
+        for (auto prod: cfg.productions) {
+            prod.nonterminal = newName.at(prod.nonterminal);
+            for (auto& symbol: prod.replacement) {
+                if (symbol.type == Symbol::Type::NONTERMINAL) symbol.ch = newName.at(symbol.ch);
+            }
+            result.productions.push_back(prod);
+        }
+        sort(result.productions.begin(), result.productions.end());
+
+        return result;
+    }
+
+    GrammarHash canonicalHashOf(const CFG& cfg) {
+        return murmurHash128(serializationOf(canonicalFormOf(cfg)));
+    }
+
+    bool operator== (const GrammarHash& lhs, const GrammarHash& rhs) {
+        return lhs.high == rhs.high && lhs.low == rhs.low;
+    }
+
+    bool operator!= (const GrammarHash& lhs, const GrammarHash& rhs) {
+        return !(lhs == rhs);
+    }
+
+    bool operator< (const GrammarHash& lhs, const GrammarHash& rhs) {
+        return make_pair(lhs.high, lhs.low) < make_pair(rhs.high, rhs.low);
+    }
+
+    ostream& operator<< (ostream& out, const GrammarHash& hash) {
+        ostringstream builder;
+        builder << hex << setfill('0') << setw(16) << hash.high << setw(16) << hash.low;
+        return out << builder.str();
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                        Matcher Cache                               ***
+     **************************************************************************
+     **************************************************************************
+
+     Building a matcher means computing nullables, lookahead sets, automata,
+     and tables, which is far more work than matching a typical string. Since
+     the same grammar tends to get matched over and over (a reference grammar
+     checked against every submission, or a resubmission of the exact same
+     grammar), matcherFor keeps a process-wide cache of compiled matchers.
+
+     The cache is keyed by a canonical serialization of the grammar (its
+     alphabet, nonterminals, start symbol, and sorted, deduplicated
+     productions) along with the matcher type, so grammars that differ only in
+     production order share an entry. Entries are evicted least-recently-used
+     first once the estimated size of everything cached passes a budget.
+
+     Matchers are built outside the lock, so a slow build doesn't hold up
+     lookups for other grammars. Two threads missing on the same grammar at
+     the same time may both build it; the second one to finish just uses the
+     entry the first one inserted.
+
+     *************************************************************************/
+
+    namespace {
+        /* Default memory budget for the matcher cache. */
+        const size_t kDefaultMatcherCacheCapacity = 64 << 20;
+
+        /* Fixed per-entry cost estimate, covering the bookkeeping and the small tables. */
+        const size_t kMatcherCacheEntryOverhead = 1024;
+
+        /* Serialization of a grammar and matcher type, for use as a cache key. */
+        string matcherCacheKeyFor(const CFG& cfg, MatcherType type) {
+            string result;
+            serializeChar(result, char32_t(type));
+            return result + serializationOf(cfg);
+        }
+
+        /* Rough estimate of how much memory a compiled matcher for this grammar uses. The
+         * large tables are indexed by (state, symbol), and there are typically about as
+         * many states as there are LR(0) items, so that's what we go with.
+         */
+        size_t estimatedMatcherCostFor(const CFG& cfg, const string& key) {
+            size_t items = 0;
+            for (const auto& prod: cfg.productions) {
+                items += prod.replacement.size() + 1;
+            }
+            size_t symbols = cfg.alphabet.size() + cfg.nonterminals.size();
+            return kMatcherCacheEntryOverhead + 2 * key.size() + items * symbols * sizeof(uint32_t);
+        }
+
+        /* Thread-safe LRU cache from keys to matchers. */
+        class MatcherCache {
+        public:
+            static MatcherCache& instance() {
+                static MatcherCache cache;
+                return cache;
+            }
+
+            /* Returns the matcher with the given key, or an empty Matcher if there isn't
+             * one, marking it as most recently used.
+             */
+            Matcher find(const string& key) {
+                lock_guard<mutex> guard(lock);
+                auto itr = index.find(key);
+                if (itr == index.end()) return Matcher();
+
+                entries.splice(entries.begin(), entries, itr->second);
+                return itr->second->matcher;
+            }
+
+            /* Adds a matcher, unless one with the same key got there first. Either way,
+             * returns the matcher that's now in the cache.
+             */
+            Matcher insert(const string& key, Matcher matcher, size_t cost) {
+                lock_guard<mutex> guard(lock);
+                auto itr = index.find(key);
+                if (itr != index.end()) return itr->second->matcher;
+
+                /* Too big to ever fit? Then don't bother. */
+                if (cost > capacity) return matcher;
+
+                entries.push_front({ key, matcher, cost });
+                index[key] = entries.begin();
+                used += cost;
+                evict();
+                return matcher;
+            }
+
+            void clear() {
+                lock_guard<mutex> guard(lock);
+                entries.clear();
+                index.clear();
+                used = 0;
+            }
+
+            void setCapacity(size_t bytes) {
+                lock_guard<mutex> guard(lock);
+                capacity = bytes;
+                evict();
+            }
+
+        private:
+            struct Entry {
+                string  key;
+                Matcher matcher;
+                size_t  cost;
+            };
+
+            mutex lock;
+            list<Entry> entries; // Most recently used first
+            unordered_map<string, list<Entry>::iterator> index;
+
+            size_t used     = 0;
+            size_t capacity = kDefaultMatcherCacheCapacity;
+
+            /* Drops least-recently-used entries until we're within budget. Assumes the
+             * lock is held.
+             */
+            void evict() {
+                while (used > capacity) {
+                    used -= entries.back().cost;
+                    index.erase(entries.back().key);
+                    entries.pop_back();
+                }
+            }
+        };
+    }
+
+    Matcher matcherFor(const CFG& cfg, MatcherType type) {
+        auto key = matcherCacheKeyFor(cfg, type);
+
+        auto& cache = MatcherCache::instance();
+        if (auto matcher = cache.find(key)) return matcher;
+
+        return cache.insert(key, uncachedMatcherFor(cfg, type), estimatedMatcherCostFor(cfg, key));
+    }
+
+    void setMatcherCacheCapacity(size_t bytes) {
+        MatcherCache::instance().setCapacity(bytes);
+    }
+
+    void clearMatcherCache() {
+        MatcherCache::instance().clear();
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                   Lazy Intersection Queries                        ***
+     **************************************************************************
+     **************************************************************************
+
+     Plenty of questions about a CFG and a DFA come down to whether their
+     intersection is empty, and if not, what's in it. The textbook approach is
+     to build the Bar-Hillel intersection grammar (see intersect()), which has
+     a nonterminal [A, p, q] for every nonterminal and pair of states, most of
+     them useless. Here we instead search the triples lazily, touching only
+     the ones that can actually come up in a derivation from [S, q0, qf].
+     intersect() itself runs the same search to completion; since it doesn't
+     care about lengths, it does so in rounds that are split across the pool.
+
+     The grammar is first put in weak CNF. A pair (A, p) is "predicted" when A
+     could be derived starting from DFA state p, beginning with (S, q0). When
+     we predict (A, p), we look at A's productions:
+
+       A -> a     gives [A, p, delta(p, a)] a derivation of length 1.
+       A ->       gives [A, p, p] a derivation of length 0.
+       A -> B     predicts (B, p), and each [B, p, q] found gives [A, p, q].
+       A -> BC    predicts (B, p). Each [B, p, r] found predicts (C, r), and
+                  each [C, r, q] found then gives [A, p, q].
+
+     The "each ... found" parts are handled by leaving a waiter on the pair,
+     which gets run on every triple for that pair, whether it was found before
+     or after the waiter showed up. This is really Earley's algorithm with DFA
+     states in place of string positions.
+
+     Triples are found in the style of Knuth's algorithm (see Shortest
+     Strings): candidate derivations go in a priority queue, and a triple is
+     settled by the shortest one. Predictions can make short candidates turn
+     up after longer triples have been settled, but everything a triple's
+     shortest derivation depends on is predicted before it's settled, so each
+     one still gets its true shortest length. By the same argument, the first
+     [S, q0, qf] settled with qf accepting is the shortest one, and we can
+     stop there.
+
+     *************************************************************************/
+
+    namespace {
+        /* Weak CNF grammar with nonterminals and terminals numbered densely and rules
+         * grouped by nonterminal.
+         */
+        struct IndexedGrammar {
+            struct Rule {
+                enum class Type {
+                    EPSILON,
+                    TERMINAL,
+                    UNIT,
+                    BINARY
+                };
+
+                Type   type;
+                size_t first  = 0;   // Terminal index, or first nonterminal
+                size_t second = 0;   // Second nonterminal
+            };
+
+            CFG                   cfg;         // The weak CNF grammar
+            vector<char32_t>      terminals;   // In alphabet order
+            vector<char32_t>      nonterminals;
+            vector<vector<Rule>>  rules;       // By nonterminal
+            size_t                start = 0;
+        };
+
+        IndexedGrammar indexedGrammarFor(const CFG& input) {
+            IndexedGrammar result;
+            result.cfg = toWeakCNF(input);
+            result.terminals.assign(result.cfg.alphabet.begin(), result.cfg.alphabet.end());
+
+            unordered_map<char32_t, size_t> terminalIndex;
+            for (size_t i = 0; i < result.terminals.size(); i++) {
+                terminalIndex[result.terminals[i]] = i;
+            }
+
+            unordered_map<char32_t, size_t> nonterminalIndex;
+            auto indexOf = [&](char32_t nonterminal) {
+                auto itr = nonterminalIndex.find(nonterminal);
+                if (itr == nonterminalIndex.end()) {
+                    itr = nonterminalIndex.insert(make_pair(nonterminal, result.nonterminals.size())).first;
+                    result.nonterminals.push_back(nonterminal);
+                    result.rules.emplace_back();
+                }
+                return itr->second;
+            };
+            result.start = indexOf(result.cfg.startSymbol);
+
+            for (const auto& prod: result.cfg.productions) {
+                const auto& p = prod.replacement;
+
+                IndexedGrammar::Rule rule;
+                if (p.empty()) {
+                    rule.type = IndexedGrammar::Rule::Type::EPSILON;
+                } else if (p.size() == 1 && p[0].type == Symbol::Type::TERMINAL) {
+                    rule.type  = IndexedGrammar::Rule::Type::TERMINAL;
+                    rule.first = terminalIndex.at(p[0].ch);
+                } else if (p.size() == 1) {
+                    rule.type  = IndexedGrammar::Rule::Type::UNIT;
+                    rule.first = indexOf(p[0].ch);
+                } else if (p.size() == 2 && p[0].type == Symbol::Type::NONTERMINAL &&
+                                            p[1].type == Symbol::Type::NONTERMINAL) {
+                    rule.type   = IndexedGrammar::Rule::Type::BINARY;
+                    rule.first  = indexOf(p[0].ch);
+                    rule.second = indexOf(p[1].ch);
+                } else {
+                    abort(); // Logic error!
+                }
+
+                result.rules[indexOf(prod.nonterminal)].push_back(rule);
+            }
+
+            return result;
+        }
+
+        /* Given a DFA, return its start state. */
+        const Automata::State* startOf(const Automata::DFA& dfa) {
+            for (auto state: dfa.states) {
+                if (state->isStart) return state.get();
+            }
+            abort(); // Logic error!
+        }
+
+        /* DFA with states numbered densely, start state first. Missing transitions are
+         * given as kNoState.
+         */
+        struct IndexedDFA {
+            vector<const Automata::State*> states;
+            vector<bool>                   accepting;
+            vector<uint32_t>               next;   // State x terminal index, terminals in alphabet order
+
+            size_t numTerminals;
+
+            uint32_t delta(size_t state, size_t terminal) const {
+                return next[state * numTerminals + terminal];
+            }
+        };
+
+        IndexedDFA indexedDFAFor(const Automata::DFA& dfa) {
+            IndexedDFA result;
+            result.numTerminals = dfa.alphabet.size();
+
+            auto start = startOf(dfa);
+            result.states.push_back(start);
+            for (const auto& state: dfa.states) {
+                if (state.get() != start) result.states.push_back(state.get());
+            }
+
+            unordered_map<const Automata::State*, uint32_t> indexOf;
+            for (size_t i = 0; i < result.states.size(); i++) {
+                indexOf[result.states[i]] = i;
+                result.accepting.push_back(result.states[i]->isAccepting);
+            }
+
+            result.next.assign(result.states.size() * result.numTerminals, kNoState);
+            for (size_t i = 0; i < result.states.size(); i++) {
+                size_t terminal = 0;
+                for (char32_t ch: dfa.alphabet) {
+                    auto itr = result.states[i]->transitions.find(ch);
+                    if (itr != result.states[i]->transitions.end()) {
+                        result.next[i * result.numTerminals + terminal] = indexOf.at(itr->second);
+                    }
+                    terminal++;
+                }
+            }
+
+            return result;
+        }
+
+        /* Lazy search over Bar-Hillel triples; see above. */
+        class TripleSearch {
+        public:
+            TripleSearch(const IndexedGrammar& grammar, const IndexedDFA& dfa)
+                : grammar(grammar), dfa(dfa), numStates(dfa.states.size()),
+                  predicted(grammar.nonterminals.size() * numStates),
+                  waiters(predicted.size()), found(predicted.size()) {}
+
+            /* Finds a shortest string in the intersection, returning whether there is one. */
+            bool shortestString(string& result) {
+                predict(grammar.start, 0);
+
+                while (!candidates.empty()) {
+                    auto curr = candidates.top();
+                    candidates.pop();
+
+                    auto& triple = triples[curr.second];
+                    if (triple.settled) continue;
+                    triple.settled = true;
+
+                    if (triple.nonterminal == grammar.start && triple.from == 0 && dfa.accepting[triple.to]) {
+                        if (triple.length > kMaxShortestStringLength) throw runtime_error("Shortest string is too long to write out.");
+                        result = stringFor(curr.second);
+                        return true;
+                    }
+
+                    settle(curr.second);
+                }
+                return false;
+            }
+
+            /* Builds the useful part of the Bar-Hillel grammar; see intersect().
+             *
+             * Lengths don't matter here, so rather than settling triples one at a time, we
+             * work in rounds. Each round handles everything that turned up in the last one
+             * (new predictions, new waiters and new triples) in parallel. Every task only
+             * reads what was there at the start of the round and writes what it finds to
+             * a list of its own, and the lists are merged afterwards in order, so the
+             * output doesn't depend on scheduling.
+             *
+             * Each waiter has to meet each triple for its pair exactly once. A new triple
+             * meets every waiter on its pair, and a new waiter meets only the triples that
+             * were there before it was added.
+             */
+            CFG intersection() {
+                vector<size_t>    newPairs;
+                vector<NewWaiter> newWaiters;
+                vector<uint32_t>  newTriples;
+
+                predicted[pairOf(grammar.start, 0)] = true;
+                newPairs.push_back(pairOf(grammar.start, 0));
+
+                while (!newPairs.empty() || !newWaiters.empty() || !newTriples.empty()) {
+                    size_t numItems = newPairs.size() + newWaiters.size() + newTriples.size();
+                    vector<RoundEvents> events((numItems + kIntersectionGrain - 1) / kIntersectionGrain);
+                    parallelFor(0, events.size(), 1, [&](size_t low, size_t high) {
+                        for (size_t chunk = low; chunk < high; chunk++) {
+                            for (size_t item = chunk * kIntersectionGrain; item < min(numItems, (chunk + 1) * kIntersectionGrain); item++) {
+                                runItem(item, newPairs, newWaiters, newTriples, events[chunk]);
+                            }
+                        }
+                    });
+
+                    newPairs.clear();
+                    newWaiters.clear();
+                    newTriples.clear();
+
+                    /* Waiters go in before the offers, so a new waiter only counts triples
+                     * from earlier rounds. Ones found this round meet it as new triples.
+                     */
+                    for (const auto& chunk: events) {
+                        for (const auto& entry: chunk.waiters) {
+                            newWaiters.push_back({ entry.first, waiters[entry.first].size(), found[entry.first].size() });
+                            waiters[entry.first].push_back(entry.second);
+                        }
+                    }
+                    for (const auto& chunk: events) {
+                        for (const auto& entry: chunk.predictions) {
+                            size_t pair = pairOf(entry.first, entry.second);
+                            if (!predicted[pair]) {
+                                predicted[pair] = true;
+                                newPairs.push_back(pair);
+                            }
+                        }
+                    }
+                    for (const auto& chunk: events) {
+                        for (const auto& offer: chunk.offers) {
+                            size_t numTriples = triples.size();
+                            uint32_t index = tripleFor(offer.nonterminal, offer.from, offer.to);
+                            productions.push_back({ index, offer.type, offer.first, offer.second });
+
+                            if (index == numTriples) {
+                                triples[index].settled = true;
+                                found[pairOf(offer.nonterminal, offer.from)].push_back(index);
+                                newTriples.push_back(index);
+                            }
+                        }
+                    }
+                }
+
+                /* Group productions by the triple they're for. */
+                vector<vector<size_t>> productionsFor(triples.size());
+                for (size_t i = 0; i < productions.size(); i++) {
+                    productionsFor[productions[i].triple].push_back(i);
+                }
+
+                /* Find everything reachable from the start triples, a level at a time.
+                 * Unreachable triples are left with no name.
+                 */
+                CFG result;
+                result.alphabet    = grammar.cfg.alphabet;
+                result.startSymbol = kBaseUnicode;
+                result.nonterminals.insert(result.startSymbol);
+
+                vector<char32_t> names(triples.size());
+                vector<uint32_t> reached;
+                auto reach = [&](uint32_t index) {
+                    if (names[index] != 0) return names[index];
+
+                    names[index] = kBaseUnicode + 1 + reached.size();
+                    result.nonterminals.insert(names[index]);
+                    reached.push_back(index);
+                    return names[index];
+                };
+
+                for (uint32_t to = 0; to < numStates; to++) {
+                    if (!dfa.accepting[to]) continue;
+
+                    auto itr = tripleIndex.find(pairOf(grammar.start, 0) * numStates + to);
+                    if (itr != tripleIndex.end() && triples[itr->second].settled) {
+                        result.productions.push_back({ result.startSymbol, { nonterminal(reach(itr->second)) } });
+                    }
+                }
+
+                using Type = IndexedGrammar::Rule::Type;
+                for (size_t level = 0; level < reached.size(); ) {
+                    size_t end = reached.size();
+
+                    vector<vector<uint32_t>> children((end - level + kIntersectionGrain - 1) / kIntersectionGrain);
+                    parallelFor(0, children.size(), 1, [&](size_t low, size_t high) {
+                        for (size_t chunk = low; chunk < high; chunk++) {
+                            for (size_t next = level + chunk * kIntersectionGrain; next < min(end, level + (chunk + 1) * kIntersectionGrain); next++) {
+                                for (size_t i: productionsFor[reached[next]]) {
+                                    const auto& production = productions[i];
+                                    if (production.type == Type::UNIT || production.type == Type::BINARY) {
+                                        children[chunk].push_back(production.first);
+                                    }
+                                    if (production.type == Type::BINARY) {
+                                        children[chunk].push_back(production.second);
+                                    }
+                                }
+                            }
+                        }
+                    });
+
+                    for (const auto& chunk: children) {
+                        for (uint32_t child: chunk) {
+                            reach(child);
+                        }
+                    }
+                    level = end;
+                }
+
+                /* Then write out the productions by left-hand side. */
+                vector<vector<Production>> chunks((reached.size() + kIntersectionGrain - 1) / kIntersectionGrain);
+                parallelFor(0, chunks.size(), 1, [&](size_t low, size_t high) {
+                    for (size_t chunk = low; chunk < high; chunk++) {
+                        for (size_t next = chunk * kIntersectionGrain; next < min(reached.size(), (chunk + 1) * kIntersectionGrain); next++) {
+                            writeProductions(reached[next], productionsFor, names, chunks[chunk]);
+                        }
+                    }
+                });
+                for (auto& chunk: chunks) {
+                    result.productions.insert(result.productions.end(), make_move_iterator(chunk.begin()), make_move_iterator(chunk.end()));
+                }
+
+                return result;
+            }
+
+        private:
+            /* Writes out the productions for a reachable triple, given everyone's names. */
+            void writeProductions(uint32_t index, const vector<vector<size_t>>& productionsFor,
+                                  const vector<char32_t>& names, vector<Production>& out) const {
+                using Type = IndexedGrammar::Rule::Type;
+                for (size_t i: productionsFor[index]) {
+                    const auto& production = productions[i];
+
+                    Production p;
+                    p.nonterminal = names[index];
+                    if (production.type == Type::TERMINAL) {
+                        p.replacement = { terminal(grammar.terminals[production.first]) };
+                    } else if (production.type == Type::UNIT) {
+                        p.replacement = { nonterminal(names[production.first]) };
+                    } else if (production.type == Type::BINARY) {
+                        p.replacement = { nonterminal(names[production.first]), nonterminal(names[production.second]) };
+                    }
+                    out.push_back(p);
+                }
+            }
+
+            const IndexedGrammar& grammar;
+            const IndexedDFA&     dfa;
+            size_t                numStates;
+
+            /* Something waiting on triples of a particular pair. */
+            struct Waiter {
+                enum class Type {
+                    UNIT,     // For A -> B, waiting on (B, p)
+                    FIRST,    // For A -> BC, waiting on (B, p)
+                    SECOND    // For A -> BC, waiting on (C, r) once [B, p, r] was found
+                };
+
+                Type     type;
+                uint32_t nonterminal;   // A
+                uint32_t from;          // p
+                uint32_t second;        // C, for FIRST
+                uint32_t firstTriple;   // [B, p, r], for SECOND
+            };
+
+            /* Work items per task in a round of intersection(). */
+            static constexpr size_t kIntersectionGrain = 256;
+
+            /* What one task in a round of intersection() turned up. This takes the same calls
+             * as the search itself does, so expand() and join() can report to either one.
+             */
+            struct RoundEvents {
+                struct Offer {
+                    uint32_t                   nonterminal, from, to;
+                    IndexedGrammar::Rule::Type type;
+                    size_t                     first, second;
+                };
+
+                vector<Offer>                  offers;
+                vector<pair<size_t, Waiter>>   waiters;       // By pair
+                vector<pair<size_t, size_t>>   predictions;   // Nonterminal and state
+
+                void offer(size_t nonterminal, size_t from, size_t to, size_t /* length */,
+                           IndexedGrammar::Rule::Type type, size_t first, size_t second) {
+                    offers.push_back({ uint32_t(nonterminal), uint32_t(from), uint32_t(to), type, first, second });
+                }
+                void addWaiter(size_t pair, const Waiter& waiter) {
+                    waiters.push_back(make_pair(pair, waiter));
+                }
+                void predict(size_t nonterminal, size_t state) {
+                    predictions.push_back(make_pair(nonterminal, state));
+                }
+            };
+
+            /* A waiter added in the last round of intersection(), given by its position,
+             * and how many triples for its pair were found before it.
+             */
+            struct NewWaiter {
+                size_t pair, index, numFound;
+            };
+
+            /* A triple and its best derivation so far. Children are triple indices. */
+            struct Triple {
+                uint32_t nonterminal, from, to;
+                size_t   length = kTooLong;
+                bool     settled = false;
+
+                IndexedGrammar::Rule::Type type;
+                size_t   first = 0, second = 0;   // Terminal index or child triples
+            };
+
+            static constexpr uint32_t kNoTriple = numeric_limits<uint32_t>::max();
+
+            vector<char>                   predicted;   // By pair (nonterminal, state)
+            vector<vector<Waiter>>         waiters;     // By pair
+            vector<vector<uint32_t>>       found;       // Settled triples, by pair
+            vector<Triple>                 triples;
+            unordered_map<size_t, uint32_t> tripleIndex;
+
+            /* For intersection(), every derivation found for a triple, which is one
+             * production of the intersection grammar.
+             */
+            struct RecordedProduction {
+                uint32_t                   triple;
+                IndexedGrammar::Rule::Type type;
+                size_t                     first, second;
+            };
+            vector<RecordedProduction> productions;
+
+            priority_queue<pair<size_t, uint32_t>, vector<pair<size_t, uint32_t>>, greater<pair<size_t, uint32_t>>> candidates;
+
+            size_t pairOf(size_t nonterminal, size_t state) const {
+                return nonterminal * numStates + state;
+            }
+
+            /* Index of [A, p, q], which is created if it doesn't exist yet. */
+            uint32_t tripleFor(size_t nonterminal, size_t from, size_t to) {
+                size_t key = pairOf(nonterminal, from) * numStates + to;
+                auto itr = tripleIndex.find(key);
+                if (itr == tripleIndex.end()) {
+                    itr = tripleIndex.insert(make_pair(key, uint32_t(triples.size()))).first;
+                    triples.emplace_back();
+                    triples.back().nonterminal = nonterminal;
+                    triples.back().from        = from;
+                    triples.back().to          = to;
+                }
+                return itr->second;
+            }
+
+            /* Offers a derivation of [A, p, q], keeping it if it's the best one yet. */
+            void offer(size_t nonterminal, size_t from, size_t to, size_t length,
+                       IndexedGrammar::Rule::Type type, size_t first, size_t second) {
+                uint32_t index = tripleFor(nonterminal, from, to);
+
+                auto& triple = triples[index];
+                if (triple.settled || length >= triple.length) return;
+
+                triple.length = length;
+                triple.type   = type;
+                triple.first  = first;
+                triple.second = second;
+                candidates.push(make_pair(length, index));
+            }
+
+            /* Reports everything predicting (A, p) leads to directly to the sink, which is
+             * either the search itself or a RoundEvents.
+             */
+            template <typename Sink> void expand(size_t nonterminal, size_t state, Sink& sink) const {
+                using Type = IndexedGrammar::Rule::Type;
+                for (const auto& rule: grammar.rules[nonterminal]) {
+                    if (rule.type == Type::EPSILON) {
+                        sink.offer(nonterminal, state, state, 0, rule.type, 0, 0);
+                    } else if (rule.type == Type::TERMINAL) {
+                        auto to = dfa.delta(state, rule.first);
+                        if (to != kNoState) sink.offer(nonterminal, state, to, 1, rule.type, rule.first, 0);
+                    } else if (rule.type == Type::UNIT) {
+                        sink.addWaiter(pairOf(rule.first, state), { Waiter::Type::UNIT, uint32_t(nonterminal), uint32_t(state), 0, kNoTriple });
+                        sink.predict(rule.first, state);
+                    } else {
+                        sink.addWaiter(pairOf(rule.first, state), { Waiter::Type::FIRST, uint32_t(nonterminal), uint32_t(state), uint32_t(rule.second), kNoTriple });
+                        sink.predict(rule.first, state);
+                    }
+                }
+            }
+
+            /* Reports what a waiter does with a settled triple for the pair it's waiting on. */
+            template <typename Sink> void join(const Waiter& waiter, uint32_t index, Sink& sink) const {
+                const auto triple = triples[index];   // Copy; the sink may add triples
+                if (waiter.type == Waiter::Type::UNIT) {
+                    sink.offer(waiter.nonterminal, waiter.from, triple.to, triple.length,
+                               IndexedGrammar::Rule::Type::UNIT, index, 0);
+                } else if (waiter.type == Waiter::Type::FIRST) {
+                    sink.addWaiter(pairOf(waiter.second, triple.to), { Waiter::Type::SECOND, waiter.nonterminal, waiter.from, 0, index });
+                    sink.predict(waiter.second, triple.to);
+                } else {
+                    sink.offer(waiter.nonterminal, waiter.from, triple.to,
+                               saturatingAdd(triples[waiter.firstTriple].length, triple.length),
+                               IndexedGrammar::Rule::Type::BINARY, waiter.firstTriple, index);
+                }
+            }
+
+            /* Runs one work item from a round of intersection(): a newly predicted pair, a
+             * new waiter, or a new triple, in that order.
+             */
+            void runItem(size_t item, const vector<size_t>& newPairs, const vector<NewWaiter>& newWaiters,
+                         const vector<uint32_t>& newTriples, RoundEvents& events) const {
+                if (item < newPairs.size()) {
+                    expand(newPairs[item] / numStates, newPairs[item] % numStates, events);
+                    return;
+                }
+                item -= newPairs.size();
+
+                if (item < newWaiters.size()) {
+                    const auto& entry = newWaiters[item];
+                    for (size_t i = 0; i < entry.numFound; i++) {
+                        join(waiters[entry.pair][entry.index], found[entry.pair][i], events);
+                    }
+                    return;
+                }
+                item -= newWaiters.size();
+
+                uint32_t index = newTriples[item];
+                for (const auto& waiter: waiters[pairOf(triples[index].nonterminal, triples[index].from)]) {
+                    join(waiter, index, events);
+                }
+            }
+
+            void predict(size_t nonterminal, size_t state) {
+                size_t pair = pairOf(nonterminal, state);
+                if (predicted[pair]) return;
+                predicted[pair] = true;
+
+                expand(nonterminal, state, *this);
+            }
+
+            void addWaiter(size_t pair, const Waiter& waiter) {
+                waiters[pair].push_back(waiter);
+                for (size_t i = 0; i < found[pair].size(); i++) {
+                    wake(waiter, found[pair][i]);
+                }
+            }
+
+            void settle(uint32_t index) {
+                size_t pair = pairOf(triples[index].nonterminal, triples[index].from);
+                found[pair].push_back(index);
+
+                /* Waiters added from here on see this triple when they're added. */
+                size_t numWaiters = waiters[pair].size();
+                for (size_t i = 0; i < numWaiters; i++) {
+                    Waiter waiter = waiters[pair][i];   // Copy; waking may add more waiters
+                    wake(waiter, index);
+                }
+            }
+
+            /* Tells a waiter about a settled triple for the pair it's waiting on. */
+            void wake(const Waiter& waiter, uint32_t index) {
+                join(waiter, index, *this);
+            }
+
+            /* Writes out the string a settled triple derives. Derivations can be long, so
+             * this uses an explicit stack rather than recursion.
+             */
+            string stringFor(uint32_t index) const {
+                string result;
+                vector<size_t> stack = { index };
+                while (!stack.empty()) {
+                    const auto& triple = triples[stack.back()];
+                    stack.pop_back();
+
+                    if (triple.type == IndexedGrammar::Rule::Type::TERMINAL) {
+                        result += toUTF8(grammar.terminals[triple.first]);
+                    } else if (triple.type == IndexedGrammar::Rule::Type::UNIT) {
+                        stack.push_back(triple.first);
+                    } else if (triple.type == IndexedGrammar::Rule::Type::BINARY) {
+                        stack.push_back(triple.second);
+                        stack.push_back(triple.first);
+                    }
+                }
+                return result;
+            }
+        };
+    }
+
+    bool shortestStringInIntersection(const CFG& cfg, const Automata::DFA& dfa, string& result) {
+        if (cfg.alphabet != dfa.alphabet) throw runtime_error("Alphabets don't match.");
+
+        auto grammar = indexedGrammarFor(cfg);
+        auto states  = indexedDFAFor(dfa);
+        return TripleSearch(grammar, states).shortestString(result);
+    }
+
+    /* To check whether L(G) is contained in L(D), we look for a shortest string in
+     * L(G) intersected with the complement of L(D), which is just another lazy triple
+     * search. The other direction is undecidable in general, but when the grammar is
+     * strongly regular we have an exact DFA for it, and a breadth-first search over
+     * pairs of states finds a shortest string in L(D) - L(G).
+     */
+    namespace {
+        /* Complement of a DFA: missing transitions go to a new rejecting sink, and then
+         * accepting and rejecting states swap. The sink has no original state.
+         */
+        IndexedDFA complementOf(IndexedDFA dfa) {
+            if (find(dfa.next.begin(), dfa.next.end(), kNoState) != dfa.next.end()) {
+                uint32_t sink = dfa.states.size();
+                dfa.states.push_back(nullptr);
+                dfa.accepting.push_back(false);
+                dfa.next.resize(dfa.next.size() + dfa.numTerminals, sink);
+                replace(dfa.next.begin(), dfa.next.end(), kNoState, sink);
+            }
+            dfa.accepting.flip();
+            return dfa;
+        }
+
+        /* Shortest string, first in alphabetical order, accepted by the first DFA and
+         * rejected by the second.
+         */
+        bool shortestStringInDifference(const IndexedDFA& lhs, const FlatDFA& rhs,
+                                        const vector<char32_t>& terminals, string& result) {
+            /* Pairs are (lhs state, rhs state), with an extra rhs state for "dead." */
+            size_t numRHS = rhs.accepting.size() + 1;
+            auto pairOf = [&](size_t l, uint32_t r) {
+                return l * numRHS + (r == kNoState? numRHS - 1 : r);
+            };
+
+            const size_t kUnvisited = numeric_limits<size_t>::max();
+            vector<size_t> parent(lhs.states.size() * numRHS, kUnvisited);
+            vector<size_t> via(parent.size());
+
+            queue<pair<uint32_t, uint32_t>> worklist;
+            worklist.push(make_pair(0, rhs.accepting.empty()? kNoState : 0));
+            parent[pairOf(0, worklist.front().second)] = pairOf(0, worklist.front().second);
+
+            while (!worklist.empty()) {
+                auto curr = worklist.front();
+                worklist.pop();
+
+                size_t index = pairOf(curr.first, curr.second);
+                if (lhs.accepting[curr.first] && (curr.second == kNoState || !rhs.accepting[curr.second])) {
+                    /* Walk back to the start. */
+                    vector<char32_t> reversed;
+                    while (parent[index] != index) {
+                        reversed.push_back(terminals[via[index]]);
+                        index = parent[index];
+                    }
+
+                    result.clear();
+                    for (auto itr = reversed.rbegin(); itr != reversed.rend(); ++itr) {
+                        result += toUTF8(*itr);
+                    }
+                    return true;
+                }
+
+                for (size_t terminal = 0; terminal < terminals.size(); terminal++) {
+                    uint32_t l = lhs.delta(curr.first, terminal);
+                    if (l == kNoState) continue;
+
+                    uint32_t r = curr.second == kNoState? kNoState : rhs.next[curr.second * rhs.numTerminals + terminal];
+                    size_t next = pairOf(l, r);
+                    if (parent[next] != kUnvisited) continue;
+
+                    parent[next] = index;
+                    via[next]    = terminal;
+                    worklist.push(make_pair(l, r));
+                }
+            }
+            return false;
+        }
+    }
+
+    ContainmentResult checkContainment(const CFG& cfg, const Automata::DFA& dfa) {
+        if (cfg.alphabet != dfa.alphabet) throw runtime_error("Alphabets don't match.");
+
+        ContainmentResult result;
+
+        auto grammar = indexedGrammarFor(cfg);
+        auto states  = indexedDFAFor(dfa);
+        auto outside = complementOf(states);
+        result.grammarInDFA = !TripleSearch(grammar, outside).shortestString(result.grammarOnly);
+
+        if (auto exact = regularDFAFor(cfg)) {
+            result.dfaChecked   = true;
+            result.dfaInGrammar = !shortestStringInDifference(states, *exact, grammar.terminals, result.dfaOnly);
+        }
+
+        return result;
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                Language Transform Implementations                  ***
+     **************************************************************************
+     **************************************************************************
+
+     Implementation of functions to compute various transformations on CFLs and
+     regular languages.
+
+     *************************************************************************/
+
+    /* Returns a new CFG that's the union of the two input CFGs. This works
+     * by assigning unique names to all the nonterminals in the two grammars,
+     * then adding a new start symbol S' with productions S' -> S_L | S_R.
+     */
+    CFG unionOf(const CFG& lhs, const CFG& rhs) {
+        if (lhs.alphabet != rhs.alphabet) throw runtime_error("Alphabets don't match.");
+
+        CFG result;
+        result.alphabet = lhs.alphabet;
+
+        /* Map old nonterminal names to new nonterminal names. */
+        map<char32_t, char32_t> replacements;
+        char32_t next = kBaseUnicode;
+        auto nameFor = [&](char32_t ch) {
+            if (!replacements.count(ch)) {
+                replacements[ch] = next;
+                result.nonterminals.insert(next);
+                next++;
+            }
+            return replacements[ch];
+        };
+
+        /* Clone productions. */
+        for (auto prod: lhs.productions) { // Copy, not ref
+            prod.nonterminal = nameFor(prod.nonterminal);
+            for (auto& symbol: prod.replacement) {
+                if (symbol.type == Symbol::Type::NONTERMINAL) {
+                    symbol.ch = nameFor(symbol.ch);
+                }
+            }
+            result.productions.push_back(prod);
+        }
+        for (auto prod: rhs.productions) { // Copy, not ref
+            prod.nonterminal = nameFor(prod.nonterminal);
+            for (auto& symbol: prod.replacement) {
+                if (symbol.type == Symbol::Type::NONTERMINAL) {
+                    symbol.ch = nameFor(symbol.ch);
+                }
+            }
+            result.productions.push_back(prod);
         }
 
         /* Add new start symbol S' with productions S' -> S_L and S' -> S_R. */
@@ -2644,139 +8113,389 @@ namespace CFG {
      * be something in the CFG (derived from S) and also something accepted
      * by the DFA (getting us from q0 to qf).
      *
-     * This grammar will have a LOT of nonterminals in it, many of which will
-     * be completely unreachable. To be a good citizen about it, as a final
-     * postprocessing step we convert things to weak CNF, which has the effect
-     * of cleaning up the grammar a bit.
+     * Done literally, this makes |P| |Q|^3 productions, almost all of them
+     * for nonterminals that are unproductive, unreachable, or both. Instead,
+     * we run the lazy triple search from the Lazy Intersection Queries section
+     * to completion (in parallel rounds), which only ever builds triples that
+     * are productive and whose (A, qx) can show up in a derivation from
+     * [S, q0, qf]. Each way it finds to derive a triple is exactly one of the
+     * productions above, so we record them as we go. A last pass from the
+     * start triples drops the ones that can't be reached (ones that get stuck
+     * in a state from which the rest of the derivation can't finish), which
+     * leaves the grammar clean.
      */
-    namespace {
-        /* Given a DFA, return its start state. */
-        const Automata::State* startOf(const Automata::DFA& dfa) {
-            for (auto state: dfa.states) {
-                if (state->isStart) return state.get();
-            }
-            abort(); // Logic error!
-        }
+    CFG intersect(const CFG& input, const Automata::DFA& dfa) {
+        if (input.alphabet != dfa.alphabet) throw runtime_error("Alphabets don't match.");
+
+        auto grammar = indexedGrammarFor(input);
+        auto states  = indexedDFAFor(dfa);
+        return TripleSearch(grammar, states).intersection();
+    }
 
-        /* Delta function for a DFA. */
-        const Automata::State* delta(const Automata::State* state, char32_t ch) {
-            return state->transitions.find(ch)->second;
+    /* Same as above, but for many DFAs at once. The grammar only needs to be converted
+     * to weak CNF and indexed once, and the intersections are then independent, so
+     * they're run in parallel, each one also splitting its own search across
+     * the pool.
+     */
+    vector<CFG> intersect(const CFG& input, const vector<Automata::DFA>& dfas) {
+        for (const auto& dfa: dfas) {
+            if (input.alphabet != dfa.alphabet) throw runtime_error("Alphabets don't match.");
         }
 
-        const bool kIntersectVerbose = false;
+        auto grammar = indexedGrammarFor(input);
+
+        vector<CFG> result(dfas.size());
+        parallelFor(0, dfas.size(), 1, [&](size_t low, size_t high) {
+            for (size_t i = low; i < high; i++) {
+                auto states = indexedDFAFor(dfas[i]);
+                result[i] = TripleSearch(grammar, states).intersection();
+            }
+        });
+        return result;
     }
 
-    CFG intersect(const CFG& input, const Automata::DFA& dfa) {
-        if (input.alphabet != dfa.alphabet) throw runtime_error("Alphabets don't match.");
+    /**************************************************************************
+     **************************************************************************
+     ***                    Multi-Grammar Recognition                       ***
+     **************************************************************************
+     **************************************************************************
 
-        /* Place the grammar into weak CNF. */
-        auto cfg = toWeakCNF(input);
-        CFG result;
+     Matching one string against many grammars at once. We form an n-ary union
+     of the grammars in which each grammar's start symbol hangs off its own tag
+     nonterminal, build one e-DFA for the whole thing, and run a single Earley
+     pass. The tags completed from position 0 in the last column tell us which
+     grammars matched.
 
-        /* Map from (nonterminal, start, end) to new nonterminal names. */
-        map<tuple<char32_t, const Automata::State*, const Automata::State*>, char32_t> names;
-        char32_t next = kBaseUnicode;
-        auto symbolFor = [&](char32_t nonterminal, const Automata::State* from, const Automata::State* to) {
-            auto key = make_tuple(nonterminal, from, to);
-            if (!names.count(key)) {
-                /* Skip to next free nonterminal name.
-                 *
-                 * TODO: This isn't necessary, right? Because we're producing an entirely
-                 * new set of nonterminal names?
-                 */
-                while (cfg.nonterminals.count(next)) next++;
+     Grammars for the same language tend to share a lot of structure, so before
+     building the union we merge nonterminals that are structurally identical:
+     ones with the same productions, up to merging nonterminals the same way.
+     This is the greatest fixed point of that relation, which we find by
+     starting with every nonterminal in one block and splitting blocks until
+     nothing changes. It's purely syntactic, so it never changes a language.
 
-                names[key] = next;
-                result.nonterminals.insert(next);
-                next++;
-                if (kIntersectVerbose) cout << "  Symbol " << toUTF8(names[key]) << " denotes [" << toUTF8(nonterminal) << ", " << from->name << ", " << to->name << "]" << endl;
-            }
-            return names[key];
+     *************************************************************************/
+    namespace {
+        /* Marker for symbol indices that aren't tags. */
+        const size_t kNotATag = numeric_limits<size_t>::max();
+
+        /* Tagged union of a list of grammars, with its tags. */
+        struct TaggedUnion {
+            CFG cfg;
+            vector<char32_t> tags;  // tags[i] is the tag for grammar i
         };
 
-        result.alphabet = cfg.alphabet;
-        auto q0 = startOf(dfa);
+        /* Everything the multi-grammar matcher needs. */
+        struct MultiMatcherState {
+            EDFAMatcherState matcher;
 
-        /* Transform all productions. */
-        for (const auto& prod: cfg.productions) {
-            const auto& p = prod.replacement;
-            if (kIntersectVerbose) cout << prod << endl;
-
-            /* Epsilon? */
-            if (p.size() == 0) {
-                if (kIntersectVerbose) cout << "  Epsilon production." << endl;
-                /* Add [S, q0, q0] -> epsilon, but only if q0 is accepting. */
-                if (q0->isAccepting) {
-                    result.productions.push_back({ symbolFor(prod.nonterminal, q0, q0), { } });
-                    if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
-                } else {
-                    if (kIntersectVerbose) cout << "  Start state isn't accepting." << endl;
+            /* Map from symbol indices back to grammar IDs. */
+            vector<size_t> grammarFor;
+
+            /* The tags are only ever predicted, never kernel items, and with lookahead
+             * nothing gets predicted at the end of the input. So for the empty string,
+             * we just look up which grammars can produce it.
+             */
+            set<size_t> matchingEmpty;
+        };
+
+        TaggedUnion taggedUnionOf(const vector<CFG>& grammars) {
+            TaggedUnion result;
+            if (grammars.empty()) throw runtime_error("No grammars given.");
+
+            result.cfg.alphabet = grammars[0].alphabet;
+            for (const auto& cfg: grammars) {
+                if (cfg.alphabet != result.cfg.alphabet) throw runtime_error("Alphabets don't match.");
+            }
+
+            /* Number every (grammar, nonterminal) pair. Start symbols count even if they
+             * have no productions, and so do nonterminals that show up in productions
+             * without being declared.
+             */
+            map<pair<size_t, char32_t>, size_t> ids;
+            auto idFor = [&](size_t grammar, char32_t nonterminal) {
+                return ids.insert(make_pair(make_pair(grammar, nonterminal), ids.size())).first->second;
+            };
+            for (size_t i = 0; i < grammars.size(); i++) {
+                idFor(i, grammars[i].startSymbol);
+                for (char32_t nonterminal: grammars[i].nonterminals) {
+                    idFor(i, nonterminal);
+                }
+                for (const auto& prod: grammars[i].productions) {
+                    idFor(i, prod.nonterminal);
+                    for (const auto& symbol: prod.replacement) {
+                        if (symbol.type == Symbol::Type::NONTERMINAL) idFor(i, symbol.ch);
+                    }
                 }
             }
-            /* Terminal unit? */
-            else if (p.size() == 1 && p[0].type == Symbol::Type::TERMINAL) {
-                if (kIntersectVerbose) cout << "  Unit terminal." << endl;
-                /* Add [A, qx, delta(qx, a)] -> a for all states qx. */
-                for (const auto& from: dfa.states) {
-                    auto* to = delta(from.get(), p[0].ch);
 
-                    result.productions.push_back({ symbolFor(prod.nonterminal, from.get(), to), { p[0] } });
-                    if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
+            /* Productions of each nonterminal, with nonterminals replaced by their IDs. */
+            vector<vector<vector<Symbol>>> productions(ids.size());
+            for (size_t i = 0; i < grammars.size(); i++) {
+                for (const auto& prod: grammars[i].productions) {
+                    auto rhs = prod.replacement;
+                    for (auto& symbol: rhs) {
+                        if (symbol.type == Symbol::Type::NONTERMINAL) symbol.ch = ids.at(make_pair(i, symbol.ch));
+                    }
+                    productions[ids.at(make_pair(i, prod.nonterminal))].push_back(rhs);
                 }
             }
-            /* Nonterminal unit? */
-            else if (p.size() == 1 && p[0].type == Symbol::Type::NONTERMINAL) {
-                if (kIntersectVerbose) cout << "  Unit nonterminal." << endl;
 
-                /* Add [A, qx, qy] -> [B, qx, qy] for all states qx, qy. */
-                for (const auto& qx: dfa.states) {
-                    for (const auto& qy: dfa.states) {
-                        auto lhs = symbolFor(prod.nonterminal, qx.get(), qy.get());
-                        auto rhs = symbolFor(p[0].ch, qx.get(), qy.get());
+            /* Refine until stable. */
+            vector<size_t> block(ids.size());
+            size_t numBlocks = 1;
+            while (true) {
+                map<pair<size_t, set<vector<Symbol>>>, size_t> blocks;
+                vector<size_t> next(ids.size());
+                for (size_t id = 0; id < ids.size(); id++) {
+                    set<vector<Symbol>> signature;
+                    for (auto rhs: productions[id]) { // Copy, not reference
+                        for (auto& symbol: rhs) {
+                            if (symbol.type == Symbol::Type::NONTERMINAL) symbol.ch = block[symbol.ch];
+                        }
+                        signature.insert(rhs);
+                    }
+                    next[id] = blocks.insert(make_pair(make_pair(block[id], signature), blocks.size())).first->second;
+                }
+
+                block = std::move(next);
+                if (blocks.size() == numBlocks) break;
+                numBlocks = blocks.size();
+            }
 
-                        result.productions.push_back({ lhs, { nonterminal(rhs) } });
-                        if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
+            /* One nonterminal per block. Identical productions collapse together. */
+            set<Production> merged;
+            for (size_t id = 0; id < ids.size(); id++) {
+                for (auto rhs: productions[id]) { // Copy, not reference
+                    for (auto& symbol: rhs) {
+                        if (symbol.type == Symbol::Type::NONTERMINAL) symbol.ch = kBaseUnicode + block[symbol.ch];
                     }
+                    merged.insert({ char32_t(kBaseUnicode + block[id]), rhs });
                 }
             }
-            /* Binary production? */
-            else if (p.size() == 2) {
-                if (kIntersectVerbose) cout << "  Binary production." << endl;
+            for (size_t b = 0; b < numBlocks; b++) {
+                result.cfg.nonterminals.insert(kBaseUnicode + b);
+            }
+            result.cfg.productions.assign(merged.begin(), merged.end());
 
-                /* Add [A, qx, qy] -> [B, qx, qz] [C, qz, qy] for all states qx, qy, qz. */
-                for (const auto& qx: dfa.states) {
-                    for (const auto& qy: dfa.states) {
-                        for (const auto& qz: dfa.states) {
-                            auto lhs  = symbolFor(prod.nonterminal, qx.get(), qy.get());
-                            auto rhs1 = symbolFor(p[0].ch, qx.get(), qz.get());
-                            auto rhs2 = symbolFor(p[1].ch, qz.get(), qy.get());
+            /* Tag each grammar's start symbol, and have the new start symbol produce all the tags. */
+            char32_t next = kBaseUnicode + numBlocks;
+            result.cfg.startSymbol = next++;
+            result.cfg.nonterminals.insert(result.cfg.startSymbol);
 
-                            result.productions.push_back({ lhs, { nonterminal(rhs1), nonterminal(rhs2) } });
-                            if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
-                        }
-                    }
+            for (size_t i = 0; i < grammars.size(); i++) {
+                char32_t tag = next++;
+                result.tags.push_back(tag);
+                result.cfg.nonterminals.insert(tag);
+
+                char32_t start = kBaseUnicode + block[ids.at(make_pair(i, grammars[i].startSymbol))];
+                result.cfg.productions.push_back({ tag, { nonterminal(start) } });
+                result.cfg.productions.push_back({ result.cfg.startSymbol, { nonterminal(tag) } });
+            }
+
+            return result;
+        }
+
+        /* Runs e-DFA Earley, returning the IDs whose tags complete over the whole input. */
+        set<size_t> multiEarley(const MultiMatcherState& state, const vector<size_t>& input) {
+            if (input.empty()) return state.matchingEmpty;
+
+            const auto& eDFA = state.matcher.eDFA;
+            ItemArena arena;
+            Bitmap3D  bitmap(input.size() + 1, eDFA.numStates, input.size() + 1);
+            arena.startColumn();
+            insert(arena, bitmap, 0, { eDFA.start, 0 });
+
+            for (size_t i = 0; i <= input.size(); i++) {
+                predictColumn(eDFA, arena, bitmap, i, input);
+                completeColumn(eDFA, arena, bitmap, i, input);
+
+                if (i == input.size()) break;
+                if (!scanColumn(eDFA, arena, bitmap, i, input)) return {};
+            }
+
+            set<size_t> result;
+            for (size_t k = arena.begin(input.size()); k < arena.end(input.size()); k++) {
+                const auto& item = arena.items[k];
+                if (item.itemPos != 0) continue;
+
+                for (size_t completed: eDFA.completed[item.state]) {
+                    if (state.grammarFor[completed] != kNotATag) result.insert(state.grammarFor[completed]);
                 }
             }
-            /* Oops, that's impossible. */
-            else {
-                abort(); // Logic error!
+            return result;
+        }
+    }
+
+    MultiMatcher multiMatcherFor(const vector<CFG>& grammars) {
+        auto tagged = taggedUnionOf(grammars);
+        auto state  = make_shared<MultiMatcherState>();
+
+        auto& matcher = state->matcher;
+        matcher.cfg  = tagged.cfg;
+        matcher.eDFA = uncompressedEDFAFor(matcher.cfg);
+        buildGoToTable(matcher.eDFA);
+        matcher.startSymbol = matcher.eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, matcher.cfg.startSymbol });
+
+        auto nullable = nullablesOf(matcher.cfg);
+        state->grammarFor.assign(matcher.eDFA.firstTerminal, kNotATag);
+        for (size_t i = 0; i < tagged.tags.size(); i++) {
+            state->grammarFor[matcher.eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, tagged.tags[i] })] = i;
+            if (nullable.count(tagged.tags[i])) state->matchingEmpty.insert(i);
+        }
+
+        return [=](const string& str) {
+            return multiEarley(*state, toSymbolIndices(state->matcher, str));
+        };
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                       Behavioral Clustering                        ***
+     **************************************************************************
+     **************************************************************************
+
+     Given a pile of grammars and a test corpus, we group the grammars by which
+     corpus strings they accept. Each grammar's signature is a bit vector with
+     one bit per string; grammars with equal signatures can't be told apart by
+     the corpus and go in the same cluster.
+
+     There's a lot of duplication in a typical pile of submissions, so we first
+     group the grammars by canonical hash (see canonicalFormOf) and compute only
+     one signature per group. Signatures are then computed in parallel, one
+     grammar per task, using the cheapest engine for each grammar: a linear-
+     time matcher if the grammar has one, and otherwise a batch Earley matcher
+     over the whole corpus. If the corpus is full of shared prefixes, the trie-
+     batched matcher does the least work; otherwise it's the lockstep one.
+
+     Finally, the signatures are bucketed in a hash table, and for each pair of
+     clusters we find the first corpus string they disagree on by scanning the
+     XOR of their signatures a word at a time.
+
+     *************************************************************************/
+
+    namespace {
+        /* Whether enough of the corpus is shared prefixes to make trie batching pay off.
+         * That's the case if a trie would have at most half as many nodes as there are
+         * characters in the corpus.
+         */
+        bool prefersTrieMatching(const vector<string>& corpus) {
+            vector<const string*> sorted;
+            size_t total = 0;
+            for (const auto& str: corpus) {
+                sorted.push_back(&str);
+                total += str.size();
+            }
+            sort(sorted.begin(), sorted.end(), [](const string* lhs, const string* rhs) {
+                return *lhs < *rhs;
+            });
+
+            /* Each string shares its longest common prefix with its neighbor in sorted order. */
+            size_t shared = 0;
+            for (size_t i = 1; i < sorted.size(); i++) {
+                auto mismatch = std::mismatch(sorted[i - 1]->begin(), sorted[i - 1]->end(),
+                                              sorted[i]->begin(), sorted[i]->end());
+                shared += mismatch.first - sorted[i - 1]->begin();
             }
+            return 2 * shared >= total;
         }
 
-        /* Set up the start symbol. */
-        result.startSymbol = next;
-        result.nonterminals.insert(result.startSymbol);
+        /* Acceptance signature of one grammar, packed 64 strings per word. */
+        vector<uint64_t> signatureOf(const CFG& cfg, const vector<string>& corpus, bool useTrie) {
+            vector<bool> accepted;
+            if (auto matcher = fastMatcherFor(cfg).second) {
+                for (const auto& str: corpus) {
+                    accepted.push_back(matcher(str));
+                }
+            } else {
+                accepted = (useTrie? trieBatchMatcherFor(cfg) : batchMatcherFor(cfg))(corpus);
+            }
+
+            vector<uint64_t> result((corpus.size() + 63) / 64);
+            for (size_t i = 0; i < accepted.size(); i++) {
+                if (accepted[i]) result[i / 64] |= uint64_t(1) << (i % 64);
+            }
+            return result;
+        }
+
+        /* Index of the first string two signatures disagree on; they must differ. */
+        size_t firstDifference(const vector<uint64_t>& lhs, const vector<uint64_t>& rhs) {
+            for (size_t word = 0; word < lhs.size(); word++) {
+                uint64_t diff = lhs[word] ^ rhs[word];
+                if (diff != 0) return word * 64 + __builtin_ctzll(diff);
+            }
+            abort(); // Logic error!
+        }
+    }
+
+    BehaviorClusters clusterByBehavior(const vector<CFG>& grammars, const vector<string>& corpus) {
+        for (const auto& cfg: grammars) {
+            if (cfg.alphabet != grammars[0].alphabet) throw runtime_error("Alphabets don't match.");
+        }
+
+        /* Group syntactically identical grammars. */
+        unordered_map<GrammarHash, size_t> groupFor;
+        vector<size_t> groupOf;
+        vector<size_t> representatives;
+        for (size_t i = 0; i < grammars.size(); i++) {
+            auto hash = canonicalHashOf(grammars[i]);
+            auto itr = groupFor.find(hash);
+            if (itr == groupFor.end()) {
+                itr = groupFor.insert(make_pair(hash, representatives.size())).first;
+                representatives.push_back(i);
+            }
+            groupOf.push_back(itr->second);
+        }
+
+        /* One signature per group. */
+        bool useTrie = prefersTrieMatching(corpus);
+        vector<vector<uint64_t>> signatures(representatives.size());
+        parallelFor(0, representatives.size(), 1, [&](size_t low, size_t high) {
+            for (size_t group = low; group < high; group++) {
+                signatures[group] = signatureOf(grammars[representatives[group]], corpus, useTrie);
+            }
+        });
+
+        /* Bucket the signatures. Clusters are numbered in order of their first members. */
+        BehaviorClusters result;
+        result.grammarsMatched = representatives.size();
+
+        unordered_map<string, size_t> clusterFor;
+        vector<size_t> clusterOfGroup;
+        vector<const vector<uint64_t>*> clusterSignatures;
+        for (const auto& signature: signatures) {
+            string key(reinterpret_cast<const char*>(signature.data()), signature.size() * sizeof(uint64_t));
+            auto itr = clusterFor.find(key);
+            if (itr == clusterFor.end()) {
+                itr = clusterFor.insert(make_pair(key, clusterSignatures.size())).first;
+                clusterSignatures.push_back(&signature);
+            }
+            clusterOfGroup.push_back(itr->second);
+        }
+
+        result.clusters.resize(clusterSignatures.size());
+        for (size_t i = 0; i < grammars.size(); i++) {
+            result.clusterOf.push_back(clusterOfGroup[groupOf[i]]);
+            result.clusters[result.clusterOf.back()].push_back(i);
+        }
 
-        /* Productions for the start nonterminal. */
-        for (const auto& qf: dfa.states) {
-            /* Add S' -> [S, q0, qf] for each accepting qf. */
-            if (qf->isAccepting) {
-                auto rhs = symbolFor(cfg.startSymbol, q0, qf.get());
-                result.productions.push_back({ result.startSymbol, { nonterminal(rhs) } });
-                if (kIntersectVerbose) cout << "  Start: Made " << result.productions.back() << endl;
+        for (const auto* signature: clusterSignatures) {
+            vector<bool> accepts(corpus.size());
+            for (size_t i = 0; i < corpus.size(); i++) {
+                accepts[i] = ((*signature)[i / 64] >> (i % 64)) & 1;
             }
+            result.signatures.push_back(accepts);
         }
 
-        return clean(result);
+        /* Distinguishing strings for each pair. */
+        result.distinguishing.resize(clusterSignatures.size());
+        parallelFor(0, clusterSignatures.size(), 1, [&](size_t low, size_t high) {
+            for (size_t i = low; i < high; i++) {
+                for (size_t j = 0; j < i; j++) {
+                    result.distinguishing[i].push_back(firstDifference(*clusterSignatures[i], *clusterSignatures[j]));
+                }
+            }
+        });
+
+        return result;
     }
 }
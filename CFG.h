@@ -9,6 +9,7 @@
 #include <ostream>
 #include <functional>
 #include <map>
+#include <cstdint>
 
 namespace CFG {
     /* A symbol in a production. */
@@ -56,22 +57,181 @@ namespace CFG {
     /* Input is a string, output is a boolean for whether we match. */
     using Matcher = std::function<bool(const std::string&)>;
 
+    /* Result of a match, with some details about how it went. */
+    struct MatchResult {
+        bool matches = false;
+
+        /* If the string doesn't match, the byte offset of the first character at which
+         * the parse was known to fail. This is the length of the string if the string
+         * is a valid prefix that ends too soon. Meaningless if the string matches.
+         */
+        std::size_t failurePosition = 0;
+
+        /* Work done during the parse. */
+        std::size_t itemsCreated     = 0;
+        std::size_t columnsProcessed = 0;
+    };
+
+    /* Input is a string, output is a detailed match result. */
+    using DetailedMatcher = std::function<MatchResult(const std::string&)>;
+
+    /* Input is a list of strings, output is whether each one matches. */
+    using BatchMatcher = std::function<std::vector<bool>(const std::vector<std::string>&)>;
+
+    /* Input is a string, output is the indices of the grammars that match it. */
+    using MultiMatcher = std::function<std::set<std::size_t>(const std::string&)>;
+
     /* Input is a string, output is a derivation. */
     using Deriver = std::function<Derivation (const std::string&)>;
 
     /* Input is a length, output is a pair of "can we make it?" and a string. */
     using Generator = std::function<std::pair<bool, std::string>(std::size_t)>;
 
-    /* We support three different matchers. */
+    /* We support several different matchers. */
     enum class MatcherType {
-        EARLEY_LR0, // General purpose, time-optimized. Use as default.
-        EARLEY,     // General purpose, fast for unambiguous grammars, slower as it gets more ambiguous
-        CYK,        // Only works on (weak) CNF; somewhat slow.
+        AUTOMATIC,    // Picks the fastest option that works for the grammar. Use as default.
+        LL1,          // Only works on LL(1) grammars; linear time.
+        LALR1,        // Only works on LALR(1) grammars; linear time.
+        EARLEY_LR0,   // General purpose, time-optimized.
+        EARLEY,       // General purpose, fast for unambiguous grammars, slower as it gets more ambiguous
+        CYK,          // Only works on (weak) CNF; somewhat slow.
+        PARALLEL_CYK, // Multithreaded CYK; for single very long inputs.
+        DFA,          // Only works on regular (self-embedding-free) grammars; linear time.
+    };
+
+    Matcher         matcherFor(const CFG& cfg, MatcherType type = MatcherType::AUTOMATIC);
+    Deriver         deriverFor(const CFG& cfg);         // Earley
+    Generator       generatorFor(const CFG& cfg);       // McKenzie
+    DetailedMatcher detailedMatcherFor(const CFG& cfg); // Earley (LR(0) e-DFA)
+    BatchMatcher    batchMatcherFor(const CFG& cfg);    // Earley (LR(0) e-DFA), many strings at once
+    BatchMatcher    trieBatchMatcherFor(const CFG& cfg); // Same, sharing work on common prefixes
+
+    /* Matches strings against a whole list of grammars in one pass. All grammars must
+     * have the same alphabet.
+     */
+    MultiMatcher multiMatcherFor(const std::vector<CFG>& grammars);
+
+    /* matcherFor caches the matchers it builds, keyed by the grammar's contents (up
+     * to production order) and matcher type, and evicts the least recently used ones
+     * once their estimated total size passes a budget (64MB by default). The cache is
+     * shared by all threads.
+     */
+    void setMatcherCacheCapacity(std::size_t bytes);
+    void clearMatcherCache();
+
+    /* Result of checking two grammars against one another on all short strings. */
+    struct BoundedEquivalenceResult {
+        /* Whether the grammars agree on every string up to the length bound. If not,
+         * the shortest string they disagree on (the first alphabetically, if there's a
+         * tie), and which grammar generates it.
+         */
+        bool        equivalent = true;
+        std::string counterexample;
+        bool        inLHS = false;
+
+        /* Work done and throughput. A subtree is pruned when neither grammar can
+         * generate any string with that prefix.
+         */
+        std::size_t stringsChecked   = 0;
+        std::size_t subtreesPruned   = 0;
+        std::size_t columnsBuilt     = 0;
+        double      seconds          = 0;
+        double      stringsPerSecond = 0;
+    };
+
+    /* Checks whether two grammars generate the same strings of length at most maxLength,
+     * using all available threads. The grammars must have the same alphabet.
+     */
+    BoundedEquivalenceResult checkEquivalenceUpTo(const CFG& lhs, const CFG& rhs, std::size_t maxLength);
+
+    /* Result of checking two grammars against one another on random strings. */
+    struct SampledEquivalenceResult {
+        /* Whether no disagreement turned up. If one did, a string one grammar generates
+         * and the other doesn't, and which grammar generates it. This is a string of the
+         * shortest length at which a disagreement was found, but there may be shorter ones.
+         */
+        bool        equivalent = true;
+        std::string counterexample;
+        bool        inLHS = false;
+
+        /* For each length checked, how many strings of that length were sampled from each
+         * grammar and, if the other grammar accepted all of them, an upper bound (at 95%
+         * confidence) on the fraction of the grammar's strings of that length the other
+         * grammar rejects. Nothing is sampled from a grammar at lengths it can't generate.
+         */
+        struct LengthReport {
+            std::size_t length       = 0;
+            std::size_t lhsSamples   = 0;
+            std::size_t rhsSamples   = 0;
+            double      lhsMissBound = 0;
+            double      rhsMissBound = 0;
+        };
+        std::vector<LengthReport> lengths;
+
+        /* Work done and throughput. */
+        std::size_t samplesChecked   = 0;
+        double      seconds          = 0;
+        double      samplesPerSecond = 0;
+    };
+
+    /* Checks two grammars against each other by drawing samplesPerLength random strings of
+     * each length from minLength to maxLength from each grammar (see generatorFor) and
+     * matching them against the other grammar, using all available threads. Stops at the
+     * first length with a counterexample. The result depends only on the inputs and the
+     * seed. The grammars must have the same alphabet.
+     */
+    SampledEquivalenceResult checkEquivalenceBySampling(const CFG& lhs, const CFG& rhs,
+                                                        std::size_t minLength, std::size_t maxLength,
+                                                        std::size_t samplesPerLength,
+                                                        std::uint64_t seed = 0);
+
+    /* Grammars grouped by how they behave on a test corpus. */
+    struct BehaviorClusters {
+        /* Indices of the grammars in each cluster, in increasing order. Clusters are
+         * numbered in order of their first members, which make good representatives.
+         */
+        std::vector<std::vector<std::size_t>> clusters;
+
+        /* Which cluster each grammar belongs to. */
+        std::vector<std::size_t> clusterOf;
+
+        /* For each cluster, whether it accepts each corpus string. */
+        std::vector<std::vector<bool>> signatures;
+
+        /* For clusters i > j, distinguishing[i][j] is the index of the first corpus string
+         * on which the two clusters disagree.
+         */
+        std::vector<std::vector<std::size_t>> distinguishing;
+
+        /* Number of grammars actually run against the corpus. Grammars with the same
+         * canonical form only get run once.
+         */
+        std::size_t grammarsMatched = 0;
     };
 
-    Matcher   matcherFor(const CFG& cfg, MatcherType type = MatcherType::EARLEY_LR0);
-    Deriver   deriverFor(const CFG& cfg);    // Earley
-    Generator generatorFor(const CFG& cfg);  // McKenzie
+    /* Clusters grammars by which strings of the corpus they accept, running them in
+     * parallel. All grammars must have the same alphabet.
+     */
+    BehaviorClusters clusterByBehavior(const std::vector<CFG>& grammars, const std::vector<std::string>& corpus);
+
+    /* Grammar classification. matcherTypeFor reports which engine MatcherType::AUTOMATIC
+     * will select for the given grammar, which is useful for diagnostics. isLALR1 reports
+     * false for grammars whose LR(0) automata are too large to build.
+     */
+    bool        isLL1(const CFG& cfg);
+    bool        isLALR1(const CFG& cfg);
+    bool        isStronglyRegular(const CFG& cfg);
+    MatcherType matcherTypeFor(const CFG& cfg);
+
+    /* Writes out a standalone C++ source file containing a recognizer for the given
+     * grammar, exposed as
+     *
+     *     bool nameSpace::matches(const std::string& input);
+     *
+     * It behaves like the EARLEY_LR0 matcher but with all tables compiled in. The
+     * output is deterministic for a given grammar.
+     */
+    void writeRecognizerSource(const CFG& cfg, std::ostream& out, const std::string& nameSpace);
 
     /* * * * * CFG Utility Functions * * * * */
 
@@ -87,6 +247,53 @@ namespace CFG {
      */
     CFG toWeakCNF(const CFG& cfg);
 
+    /* Converts a strongly regular grammar (see isStronglyRegular) to an NFA for the
+     * same language, throwing if the grammar isn't strongly regular. A grammar is
+     * strongly regular if, after dropping nonterminals that only derive epsilon,
+     * every set of mutually recursive nonterminals only ever appears at the right
+     * end of its productions or only ever at the left end. This is the same as the
+     * grammar having no self-embedding nonterminals, so its language is regular.
+     */
+    Automata::NFA toNFA(const CFG& cfg);
+
+    /* Returns the set of lengths of strings in the grammar's language. Since this set
+     * is ultimately periodic, it can be represented exactly, unless its period is
+     * enormous, in which case these throw Languages::LengthSetTooLarge.
+     *
+     * canGenerateLength redoes the whole analysis each time it's called. To ask about
+     * many lengths, call lengthsOf once and query the result, which takes O(1) time.
+     */
+    Languages::LengthSet lengthsOf(const CFG& cfg);
+    bool canGenerateLength(const CFG& cfg, std::size_t length);
+
+    /* Finds a shortest string in the grammar's language, returning whether the
+     * language has any strings at all. isEmpty just does the second part. Both run
+     * in time O(|G| log |G|).
+     *
+     * Shortest strings can be exponentially long in the size of the grammar, so this
+     * (like shortestStringInIntersection and checkContainment below) throws a
+     * runtime_error rather than write out one longer than 2^24 characters.
+     */
+    bool shortestStringIn(const CFG& cfg, std::string& result);
+    bool isEmpty(const CFG& cfg);
+
+    /* Returns a canonical form of the grammar: it's cleaned, its nonterminals are
+     * renamed in the order a traversal from the start symbol discovers them, and its
+     * productions are sorted. Grammars that differ only in nonterminal names, the
+     * order of productions, or useless rules have the same canonical form (barring
+     * some highly symmetric grammars where no traversal order stands out).
+     */
+    CFG canonicalFormOf(const CFG& cfg);
+
+    /* 128-bit hash of a grammar's canonical form. This is stable across runs and
+     * platforms, so it's suitable as a persistent key.
+     */
+    struct GrammarHash {
+        std::uint64_t high = 0;
+        std::uint64_t low  = 0;
+    };
+    GrammarHash canonicalHashOf(const CFG& cfg);
+
     /* * * * * Language Transforms * * * * */
 
     /* Returns a new CFG whose language is the intersection of the languages of the
@@ -99,6 +306,42 @@ namespace CFG {
      */
     CFG intersect(const CFG& lhs, const Automata::DFA& rhs);
 
+    /* Intersects one CFG with each of a list of DFAs, in parallel. This is faster than
+     * calling intersect once per DFA, since the grammar only has to be prepared once.
+     */
+    std::vector<CFG> intersect(const CFG& lhs, const std::vector<Automata::DFA>& rhs);
+
+    /* Finds a shortest string accepted by both the CFG and the DFA, returning whether
+     * there is one, without building the intersection grammar. Only the parts of the
+     * intersection that can be reached from its start symbol are ever explored. The
+     * inputs must have the same alphabets.
+     */
+    bool shortestStringInIntersection(const CFG& lhs, const Automata::DFA& rhs, std::string& result);
+
+    /* Result of comparing a CFG's language against a DFA's. */
+    struct ContainmentResult {
+        /* Whether every string the grammar generates is accepted by the DFA. If not, a
+         * shortest string the grammar generates that the DFA rejects.
+         */
+        bool        grammarInDFA = true;
+        std::string grammarOnly;
+
+        /* Whether every string the DFA accepts is generated by the grammar, and if not,
+         * a shortest string the DFA accepts that the grammar doesn't generate. This
+         * direction is undecidable in general, so it's only checked (dfaChecked) when
+         * the grammar is strongly regular (see isStronglyRegular).
+         */
+        bool        dfaChecked   = false;
+        bool        dfaInGrammar = true;
+        std::string dfaOnly;
+    };
+
+    /* Checks whether the CFG's language is contained in the DFA's and, where possible,
+     * the reverse, finding shortest counterexamples. The inputs must have the same
+     * alphabets.
+     */
+    ContainmentResult checkContainment(const CFG& cfg, const Automata::DFA& dfa);
+
     /* Returns a new CFG whose language is the union of the languages of the
      * input CFGs. The inputs must have the same alphabets for this construction
      * to work.
@@ -108,16 +351,28 @@ namespace CFG {
      */
     CFG unionOf(const CFG& lhs, const CFG& rhs);
 
+    /* Returns a DFA whose language is a regular superset of the CFG's language,
+     * built with the Mohri-Nederhof approximation. Any string the DFA rejects is
+     * definitely not in the CFG's language; strings it accepts may or may not be.
+     * For very large grammars this may just be the DFA for Sigma*.
+     */
+    Automata::DFA regularSupersetOf(const CFG& cfg);
+
 
     /* * * * * C++ Utility Functions * * * * */
     bool operator== (const Symbol& lhs, const Symbol& rhs);
     bool operator<  (const Production& lhs, const Production& rhs);
     bool operator<  (const Symbol& lhs, const Symbol& rhs);
+    bool operator== (const GrammarHash& lhs, const GrammarHash& rhs);
+    bool operator!= (const GrammarHash& lhs, const GrammarHash& rhs);
+    bool operator<  (const GrammarHash& lhs, const GrammarHash& rhs);
 
     std::ostream& operator<< (std::ostream& out, const Symbol& symbol);
     std::ostream& operator<< (std::ostream& out, const Production& production);
     std::ostream& operator<< (std::ostream& out, const Derivation& derivation);
     std::ostream& operator<< (std::ostream& out, const CFG& cfg);
+    std::ostream& operator<< (std::ostream& out, MatcherType type);
+    std::ostream& operator<< (std::ostream& out, const GrammarHash& hash);
 }
 
 /* Hash support. */
@@ -127,4 +382,9 @@ namespace std {
             return s.ch * 997 + std::size_t(s.type);
         }
     };
+    template <> struct hash<CFG::GrammarHash> {
+        std::size_t operator()(const CFG::GrammarHash& h) const {
+            return std::size_t(h.low);
+        }
+    };
 }
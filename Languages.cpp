@@ -2,6 +2,9 @@
 #include "Utilities/Unicode.h"
 #include <algorithm>
 #include <sstream>
+#include <numeric>
+#include <stdexcept>
+#include <cstdint>
 using namespace std;
 
 namespace Languages {
@@ -28,3 +31,187 @@ namespace Languages {
         return result;
     }
 }
+
+/* Length set logic. */
+namespace Languages {
+    namespace {
+        /* Shrinks a length set to canonical form. */
+        void canonicalize(LengthSet& lengths) {
+            /* Smallest period. Any period of the tail divides the one we have. */
+            for (size_t candidate = 1; candidate < lengths.period; candidate++) {
+                if (lengths.period % candidate != 0) continue;
+
+                bool works = true;
+                for (size_t n = lengths.threshold; works && n + candidate < lengths.threshold + lengths.period; n++) {
+                    works = (lengths.bits[n] == lengths.bits[n + candidate]);
+                }
+                if (works) {
+                    lengths.period = candidate;
+                    lengths.bits.resize(lengths.threshold + lengths.period);
+                    break;
+                }
+            }
+
+            /* Smallest threshold. Back it up as long as the periodic part extends. */
+            while (lengths.threshold > 0 &&
+                   lengths.bits[lengths.threshold - 1] == lengths.bits[lengths.threshold - 1 + lengths.period]) {
+                lengths.threshold--;
+                lengths.bits.pop_back();
+            }
+        }
+
+        /* Builds a length set from a membership test, given a threshold and period that
+         * are known to work.
+         */
+        template <typename Contains> LengthSet lengthSetFrom(size_t threshold, size_t period, Contains contains) {
+            if (threshold + period > kMaxLengthSetSize) throw LengthSetTooLarge();
+
+            vector<bool> bits(threshold + period);
+            for (size_t n = 0; n < threshold + period; n++) {
+                bits[n] = contains(n);
+            }
+            return makeLengthSet(bits, threshold);
+        }
+    }
+
+    LengthSet makeLengthSet(const vector<bool>& bits, size_t threshold) {
+        if (threshold >= bits.size()) throw runtime_error("Length set must have a nonempty periodic part.");
+        if (bits.size() > kMaxLengthSetSize) throw LengthSetTooLarge();
+
+        LengthSet result;
+        result.threshold = threshold;
+        result.period    = bits.size() - threshold;
+        result.bits      = bits;
+        canonicalize(result);
+        return result;
+    }
+
+    bool LengthSet::contains(size_t n) const {
+        if (n < threshold + period) return bits[n];
+        return bits[threshold + (n - threshold) % period];
+    }
+
+    LengthSet singletonLength(size_t n) {
+        return lengthSetFrom(n + 1, 1, [&](size_t length) {
+            return length == n;
+        });
+    }
+
+    LengthSet unionOf(const LengthSet& lhs, const LengthSet& rhs) {
+        return lengthSetFrom(max(lhs.threshold, rhs.threshold), lcm(lhs.period, rhs.period), [&](size_t n) {
+            return lhs.contains(n) || rhs.contains(n);
+        });
+    }
+
+    /* Past its threshold, each set is a union of progressions r + kp. A finite part
+     * plus a progression is periodic from below the sum of the thresholds, and the sum
+     * of two progressions r + kp and s + kq is r + s plus the multiples of gcd(p, q)
+     * that are combinations of p and q, which includes all of them from lcm(p, q) on.
+     * Every residue r or s is below its threshold plus its period, so everything is
+     * periodic with period lcm(p, q) once past the bound below.
+     *
+     * We find the members up to there by or-ing a shifted copy of rhs's bits in for
+     * each member of lhs.
+     */
+    LengthSet sumOf(const LengthSet& lhs, const LengthSet& rhs) {
+        size_t period    = lcm(lhs.period, rhs.period);
+        size_t threshold = lhs.threshold + rhs.threshold + lhs.period + rhs.period + period;
+        if (threshold + period > kMaxLengthSetSize) throw LengthSetTooLarge();
+
+        const size_t size  = threshold + period;
+        const size_t words = (size + 63) / 64;
+        vector<uint64_t> ours(words), theirs(words);
+        for (size_t n = 0; n < size; n++) {
+            if (rhs.contains(n)) theirs[n / 64] |= uint64_t(1) << (n % 64);
+        }
+
+        for (size_t a = 0; a < size; a++) {
+            if (!lhs.contains(a)) continue;
+
+            /* ours |= theirs << a */
+            size_t wordShift = a / 64, bitShift = a % 64;
+            for (size_t w = words; w-- > wordShift; ) {
+                uint64_t shifted = theirs[w - wordShift] << bitShift;
+                if (bitShift != 0 && w > wordShift) shifted |= theirs[w - wordShift - 1] >> (64 - bitShift);
+                ours[w] |= shifted;
+            }
+        }
+
+        return lengthSetFrom(threshold, period, [&](size_t n) {
+            return bool((ours[n / 64] >> (n % 64)) & 1);
+        });
+    }
+
+    /* The closure under addition contains only multiples of g, the gcd of all the
+     * positive elements, and eventually contains all of them. Once it has m consecutive
+     * multiples of g, where m * g is the smallest positive element, it has every larger
+     * one too.
+     */
+    LengthSet starOf(const LengthSet& lengths) {
+        /* Each element beyond the first two periods is congruent to an earlier one modulo
+         * the period, so these determine the gcd.
+         */
+        size_t g = 0, smallest = 0;
+        for (size_t n = 1; n < lengths.threshold + 2 * lengths.period; n++) {
+            if (lengths.contains(n)) {
+                if (smallest == 0) smallest = n;
+                g = gcd(g, n);
+            }
+        }
+        if (g == 0) return singletonLength(0);
+
+        /* Fill in membership until we see a long enough run. */
+        vector<bool> closure = { true };
+        size_t run = 0;
+        while (run < smallest / g) {
+            size_t n = closure.size();
+            if (n >= kMaxLengthSetSize) throw LengthSetTooLarge();
+
+            bool member = false;
+            for (size_t a = 1; !member && a <= n; a++) {
+                member = lengths.contains(a) && closure[n - a];
+            }
+            closure.push_back(member);
+
+            if (n % g == 0) run = member? run + 1 : 0;
+        }
+
+        return lengthSetFrom(closure.size(), g, [&](size_t n) {
+            return n < closure.size()? bool(closure[n]) : n % g == 0;
+        });
+    }
+
+    bool isEmpty(const LengthSet& lengths) {
+        return lengths == LengthSet();
+    }
+
+    bool isEverything(const LengthSet& lengths) {
+        return lengths.threshold == 0 && lengths.period == 1 && lengths.bits[0];
+    }
+
+    bool operator== (const LengthSet& lhs, const LengthSet& rhs) {
+        return lhs.threshold == rhs.threshold && lhs.period == rhs.period && lhs.bits == rhs.bits;
+    }
+
+    bool operator!= (const LengthSet& lhs, const LengthSet& rhs) {
+        return !(lhs == rhs);
+    }
+
+    /* Prints the set as, e.g., { 0, 3, 5, 7, ... }, listing everything up through two
+     * periods past the threshold.
+     */
+    ostream& operator<< (ostream& out, const LengthSet& lengths) {
+        out << "{";
+        bool first = true;
+        for (size_t n = 0; n < lengths.threshold + 2 * lengths.period; n++) {
+            if (lengths.contains(n)) {
+                out << (first? " " : ", ") << n;
+                first = false;
+            }
+        }
+        if (any_of(lengths.bits.begin() + lengths.threshold, lengths.bits.end(), [](bool b) { return b; })) {
+            out << ", ...";
+        }
+        return out << " }";
+    }
+}
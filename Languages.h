@@ -2,6 +2,10 @@
 #pragma once
 #include <string>
 #include <set>
+#include <vector>
+#include <ostream>
+#include <cstddef>
+#include <stdexcept>
 
 namespace Languages {
     /* An alphabet is a set of characters. Stored ordered for convenience. */
@@ -10,4 +14,49 @@ namespace Languages {
     bool isSubsetOf(const Alphabet& lhs, const Alphabet& rhs);
     Alphabet toAlphabet(const std::string& alphaChars);
     std::string toString(const Alphabet& alphabet);
+
+    /* An ultimately periodic set of natural numbers. The set of lengths of strings in
+     * a context-free language always has this form (Parikh's theorem), as does the set
+     * of lengths of strings in a regular language.
+     *
+     * Membership of n is given by bits[n] when n < threshold + period, and by
+     * bits[threshold + (n - threshold) % period] otherwise. All operations leave the
+     * set in a canonical form with the smallest possible period and threshold, so two
+     * LengthSets are equal exactly when they have equal fields. A default-constructed
+     * LengthSet is empty.
+     *
+     * The period of a union of progressions is the lcm of their periods, which can be
+     * exponential in the size of whatever the set describes. Operations that would
+     * produce a set whose threshold plus period exceeds kMaxLengthSetSize throw
+     * LengthSetTooLarge instead.
+     */
+    struct LengthSet {
+        std::size_t threshold = 0;
+        std::size_t period    = 1;
+        std::vector<bool> bits = { false };
+
+        bool contains(std::size_t n) const;
+    };
+
+    const std::size_t kMaxLengthSetSize = 1 << 16;
+
+    struct LengthSetTooLarge: std::runtime_error {
+        LengthSetTooLarge() : std::runtime_error("Length set is too large to represent.") {}
+    };
+
+    /* Builds the set where n is a member iff bits[n] is set, with the bits from
+     * threshold onward repeating forever.
+     */
+    LengthSet makeLengthSet(const std::vector<bool>& bits, std::size_t threshold);
+
+    LengthSet singletonLength(std::size_t n);                         // { n }
+    LengthSet unionOf(const LengthSet& lhs, const LengthSet& rhs);    // lhs u rhs
+    LengthSet sumOf(const LengthSet& lhs, const LengthSet& rhs);      // { a + b | a in lhs, b in rhs }
+    LengthSet starOf(const LengthSet& lengths);                       // { 0 } u lengths u sumOf(lengths, lengths) u ...
+    bool      isEmpty(const LengthSet& lengths);
+    bool      isEverything(const LengthSet& lengths);                 // Contains every natural number?
+
+    bool operator== (const LengthSet& lhs, const LengthSet& rhs);
+    bool operator!= (const LengthSet& lhs, const LengthSet& rhs);
+    std::ostream& operator<< (std::ostream& out, const LengthSet& lengths);
 }